@@ -18,9 +18,33 @@
 #define PAUSE_MESSAGE "Paused"
 #define NICKNAME_DEFAULT_LENGTH 11
 #define DIAMONDS_DEFAULT_COUNT 10
-#define MONSTER_MAP_THRESSHOLD 9
 #define MENU_ITEMS_COUNT 3
 #define SLC_QUIT 2
+#define SIM_DEFAULT_MAX_TURNS 100000
+#define REPLAY_FILE "lastgame"
+#define REPLAY_MAGIC "TFQR"
+#define REPLAY_VERSION 2     // Bump along with any change to where a seed puts things
+#define MAPCACHE_SUFFIX ".tfqc"
+#define MAPCACHE_MAGIC "TFQC"
+#define MAPCACHE_VERSION 3
+#define SIM_DEFAULT_MAX_BATCH_TURNS 5000
+#define SIM_CAPTURE_HOTSPOTS 5
+#define TICK_DEFAULT_MS 250
+#define TICK_MAX_CATCHUP 4
+#define INPUT_QUEUE_SIZE 64
+#define INPUT_ESC_DELAY_MS 25
+#define PERF_BUCKETS 96
+#define BENCH_BATCH_MS 20
+#define BENCH_RUNS 5
+#define BENCH_CELLS 4096
+#define BENCH_MAZE_LOOPS 10
+#define BENCH_TOP_SCORES 10
+#define SERVER_HELLO "TFQ"
+#define SERVER_HELLO_MAX 64
+#define SERVER_EVENTS 64
+#define SERVER_MAX_SESSIONS 1024
+#define SCORES_FILE "scores"
+#define SCORES_COMPACT_SLACK 64
 
 #define COLOR_PAIR_NORMAL           1
 #define COLOR_PAIR_GREEN_BLACK      2
@@ -28,13 +52,38 @@
 #define COLOR_PAIR_BLACK_RED        4
 #define COLOR_PAIR_BLACK_BLUE       5
 #define COLOR_PAIR_BLACK_YELLOW     6
+#define COLOR_PAIR_COUNT            7
 
 #define UP       0x01
 #define RIGHT    0x02
 #define DOWN     0x04
 #define LEFT     0x08
 
+#define MAZEGRAPH_MIN_GAIN 8
+
+// Width of the map coordinates: 16 bits take maps of up to 65535 x 65535
+// cells, 32 bits are there for the odd map that is even larger on one side
+#ifndef COORD_BITS
+#define COORD_BITS 16
+#endif
+
+// The benchmarks run the engine without a terminal, like the simulator
+#if defined(BENCH) && !defined(HEADLESS)
+#define HEADLESS
+#endif
+
+#ifndef HEADLESS
 #include <ncurses.h>
+#else
+// The headless build links no ncurses, so the few key codes the engine
+// understands are defined here with the same values ncurses gives them.
+#define ERR            (-1)
+#define KEY_DOWN       0402
+#define KEY_UP         0403
+#define KEY_LEFT       0404
+#define KEY_RIGHT      0405
+#define KEY_ENTER      0527
+#endif
 #include <string.h>
 #include <vector>
 #include <fstream>
@@ -42,13 +91,58 @@
 #include <math.h>
 #include <algorithm>
 #include <time.h>
+#include <queue>
+#include <functional>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unordered_map>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <memory>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <signal.h>
 
 typedef unsigned char   UI8;
 typedef unsigned short  UI16;
 typedef unsigned int    UI32;
+typedef unsigned long long UI64;
 typedef char    I8;
 typedef short   I16;
 typedef int     I32;
+typedef long long I64;
+
+#if COORD_BITS == 32
+typedef UI32    COORD;
+#elif COORD_BITS == 16
+typedef UI16    COORD;
+#else
+#error "COORD_BITS must be 16 or 32"
+#endif
+#define COORD_MAX ((COORD)~(COORD)0)
 
 /**
  *  COLL_T
@@ -59,6 +153,67 @@ typedef enum
     NONE, WALL, DMND, MONSTER, PARCH
 }   COLL_T;
 
+/**
+ *  TURN_T
+ *  Defines an enumaration type with all the possible outcomes of a game turn.
+ */
+typedef enum
+{
+    PLAYING, WON, LOST, ESCAPED
+}   TURN_T;
+
+/**
+ *  MONST_T
+ *  Defines an enumaration type with the kinds of monsters, each one moving
+ *  in its own way: SMART ones chase Harry (gnomes) and DUMMY ones wander
+ *  around the maze (traals).
+ */
+typedef enum
+{
+    SMART, DUMMY
+}   MONST_T;
+
+/**
+ *  INPUT_T
+ *  Defines an enumaration type with the ways the keys pressed between two
+ *  turns become the key of the turn: the last one wins, or the first one does
+ *  and the last of the others is kept for the turn after.
+ */
+typedef enum
+{
+    LATEST_WINS, BUFFER_AHEAD
+}   INPUT_T;
+
+/**
+ *  RENDER_T
+ *  Defines an enumaration type with the backends the levels can be drawn with:
+ *  ncurses, escape sequences written straight to the terminal, or nothing.
+ */
+typedef enum
+{
+    CURSES_OUT, ANSI_OUT, NULL_OUT
+}   RENDER_T;
+
+/**
+ *  PHASE_T
+ *  Defines an enumaration type with the phases of a turn that are timed.
+ */
+typedef enum
+{
+    INPUT_PHASE, PLAYER_PHASE, MONSTERS_PHASE, COLLISION_PHASE, RENDER_PHASE, PHASE_COUNT
+}   PHASE_T;
+
+/**
+ *  MOVE_T
+ *  Defines an enumaration type with the ways a monster can move: a gnome steps
+ *  towards Harry or, when he cannot be reached, wanders; a traal moves by the
+ *  first of the three levels of its algorithm that finds a way, or is stuck.
+ */
+typedef enum
+{
+    SMART_STEP, SMART_WANDER, DUMMY_LEVEL1, DUMMY_LEVEL2, DUMMY_LEVEL3, DUMMY_STUCK, MOVE_COUNT
+}   MOVE_T;
+
 /**
  *  STRUCT coords AS POS
  *  @brief      Defines a struct that holds a point (position) in a 2-Dimensional
@@ -66,8 +221,8 @@ typedef enum
  */
 typedef struct coords
 {
-    UI8 x;
-    UI8 y;
+    COORD x;
+    COORD y;
 
     coords() : x(0), y(0)
     {}
@@ -130,6 +285,491 @@ typedef struct general_exc
     {}
 } GENEXP;
 
+#ifndef GRID_H_INCLUDED
+#define GRID_H_INCLUDED
+
+/**
+ *  CLASS TEMPLATE: Grid
+ *  @brief      Grid holds a 2-Dimensional array of cells in a single allocation.
+ *              The cells are surrounded by a one cell wide border, initialised
+ *              with a sentinel value, so reading the neighbours of any cell of the
+ *              grid never goes out of range.
+ *              Cells are stored in square tiles of GRID_TILE x GRID_TILE cells, one
+ *              tile after the other, instead of one long row after the other. The
+ *              cells above and below a cell are then most often in the same tile,
+ *              a few hundred bytes away, however wide the maze is. Walking from a
+ *              cell to its neighbours goes through Up, Right, Down and Left.
+ *              Grids of the same size have the same layout whatever their cell
+ *              type, so a cell index of one is a valid cell index of the other.
+ */
+#define GRID_TILE_BITS 4
+#define GRID_TILE (1 << GRID_TILE_BITS)
+
+template <typename T>
+class Grid
+{
+    public:
+    Grid() : width(0), height(0), tiles_x(0), sentinel(), tile_row(0)
+    {}
+
+    void Reset(UI32, UI32, T);
+    void Fill(T);
+    void Clear(void)    { cells.clear(); cells.shrink_to_fit(); width = height = tiles_x = tile_row = 0; }
+
+    UI32 Width(void)    const   { return width; }
+    UI32 Height(void)   const   { return height; }
+
+    /// Index of the cell (x, y); x may be -1 to width and y -1 to height.
+    UI32 Index(I32 x, I32 y) const
+    {
+        UI32 gx = x + 1, gy = y + 1;
+        return ((gy >> GRID_TILE_BITS) * tiles_x + (gx >> GRID_TILE_BITS)) << (2 * GRID_TILE_BITS) |
+               (gy & TILE_MASK) << GRID_TILE_BITS | (gx & TILE_MASK);
+    }
+    UI32 X(UI32) const;
+    UI32 Y(UI32) const;
+    bool Inside(UI32) const;
+
+    /// Indices of the neighbours of a cell of the grid or of its border
+    UI32 Up(UI32 cell)      const   { return cell & ROW_MASK ? cell - GRID_TILE : cell - tile_row + ROW_MASK; }
+    UI32 Down(UI32 cell)    const   { return (cell & ROW_MASK) != ROW_MASK ? cell + GRID_TILE : cell + tile_row - ROW_MASK; }
+    UI32 Left(UI32 cell)    const   { return cell & TILE_MASK ? cell - 1 : cell - TILE_AREA + TILE_MASK; }
+    UI32 Right(UI32 cell)   const   { return (cell & TILE_MASK) != TILE_MASK ? cell + 1 : cell + TILE_AREA - TILE_MASK; }
+    UI32 Step(UI32, UI8) const;
+
+    T& operator () (I32 x, I32 y)               { return cells[Index(x, y)]; }
+    const T& operator () (I32 x, I32 y) const   { return cells[Index(x, y)]; }
+    T& operator [] (UI32 cell)                  { return cells[cell]; }
+    const T& operator [] (UI32 cell)    const   { return cells[cell]; }
+
+    /// The whole allocation, border and tile padding included
+    size_t Size(void)           const   { return cells.size(); }
+    T* Data(void)                       { return cells.data(); }
+    const T* Data(void)         const   { return cells.data(); }
+
+    private:
+    static const UI32 TILE_MASK = GRID_TILE - 1;
+    static const UI32 ROW_MASK = TILE_MASK << GRID_TILE_BITS;
+    static const UI32 TILE_AREA = GRID_TILE * GRID_TILE;
+
+    UI32 width, height;
+    UI32 tiles_x;
+    T sentinel;
+    UI32 tile_row;  // Cells in a row of tiles
+    std::vector<T> cells;
+};
+
+#endif // GRID_H_INCLUDED
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::X
+ *  @brief  Returns the column of a cell index (-1 for the left border).
+ */
+template <typename T>
+UI32 Grid<T>::X(UI32 cell) const
+{
+    return (((cell >> (2 * GRID_TILE_BITS)) % tiles_x) << GRID_TILE_BITS | (cell & TILE_MASK)) - 1;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::Y
+ *  @brief  Returns the row of a cell index (-1 for the upper border).
+ */
+template <typename T>
+UI32 Grid<T>::Y(UI32 cell) const
+{
+    return (((cell >> (2 * GRID_TILE_BITS)) / tiles_x) << GRID_TILE_BITS | (cell & ROW_MASK) >> GRID_TILE_BITS) - 1;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::Inside
+ *  @brief  Tells whether an index is the index of a cell of the grid, rather
+ *          than of its border, of the padding of its tiles or of no cell at
+ *          all. Works out the column and the row with a single division.
+ */
+template <typename T>
+bool Grid<T>::Inside(UI32 cell) const
+{
+    UI32 tile = cell >> (2 * GRID_TILE_BITS);
+    UI32 ty = tile / tiles_x, tx = tile - ty * tiles_x;
+    UI32 x = (tx << GRID_TILE_BITS | (cell & TILE_MASK)) - 1;
+    UI32 y = (ty << GRID_TILE_BITS | (cell & ROW_MASK) >> GRID_TILE_BITS) - 1;
+
+    return cell < cells.size() && x < width && y < height;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::Step
+ *  @brief  Returns the index of the neighbour of a cell towards a direction.
+ *  @param  cell: The cell.
+ *  @param  dir: One of UP, RIGHT, DOWN or LEFT.
+ */
+template <typename T>
+UI32 Grid<T>::Step(UI32 cell, UI8 dir) const
+{
+    switch (dir)
+    {
+        case UP:    return Up(cell);
+        case RIGHT: return Right(cell);
+        case DOWN:  return Down(cell);
+        default:    return Left(cell);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::Reset
+ *  @brief  Resizes the grid, setting the border to the sentinel value and
+ *          every other cell to T().
+ *  @param  w: The width of the grid.
+ *  @param  h: The height of the grid.
+ *  @param  border: The sentinel value of the border cells.
+ */
+template <typename T>
+void Grid<T>::Reset(UI32 w, UI32 h, T border)
+{
+    UI64 tx = ((UI64)w + 2 + GRID_TILE - 1) / GRID_TILE;
+    UI64 ty = ((UI64)h + 2 + GRID_TILE - 1) / GRID_TILE;
+
+    // Cell indices are 32 bit
+    if (tx * ty * TILE_AREA > 0xFFFFFFFFULL)
+        throw GENEXP("General error in Grid::Reset:\nThe grid is too large");
+
+    width = w;
+    height = h;
+    tiles_x = tx;
+    tile_row = tx * TILE_AREA;
+    sentinel = border;
+
+    cells.assign((size_t)(tx * ty * TILE_AREA), sentinel);
+    Fill(T());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Grid::Fill
+ *  @brief  Sets every cell of the grid, but not the border, to a value.
+ *          The whole allocation is filled at once and the border is then
+ *          put back, which is much cheaper than filling tile by tile.
+ *  @param  value: The value to set.
+ */
+template <typename T>
+void Grid<T>::Fill(T value)
+{
+    std::fill(cells.begin(), cells.end(), value);
+
+    for (I32 x = -1; x <= (I32)width; x++)
+    {
+        cells[Index(x, -1)] = sentinel;
+        cells[Index(x, height)] = sentinel;
+    }
+    for (UI32 y = 0; y < height; y++)
+    {
+        cells[Index(-1, y)] = sentinel;
+        cells[Index(width, y)] = sentinel;
+    }
+}
+
+#ifndef MAPBITS_H_INCLUDED
+#define MAPBITS_H_INCLUDED
+
+/**
+ *  CLASS: MapBits
+ *  @brief      MapBits keeps the walls of a maze as a bitset, one bit per cell
+ *              and a few 64 bit words per row. Rows are padded to a whole number
+ *              of 128 bit blocks and, like a Grid, have a border, so bit x + 1 of
+ *              row y + 1 stands for cell (x, y). Other bitsets of the maze, like
+ *              the diamonds of a Stage, are laid out alike through Word and Bit.
+ *              Since the walls never change during a level, the cells every
+ *              direction is open from are worked out once, 128 cells at a time,
+ *              into four more bitsets (one per direction bit). The legal moves
+ *              of a cell are then a 4 bit mask with the UP, RIGHT, DOWN and LEFT
+ *              bits, read straight from those bitsets.
+ */
+class MapBits
+{
+    friend class MapCache;
+
+    public:
+    MapBits() : words_per_row(0)
+    {}
+
+    void Build(const Grid<I8>&);
+    void Clear(void);
+
+    bool Wall(UI32 x, UI32 y)       const   { return (walls[Word(x, y)] >> Bit(x)) & 1; }
+
+    UI8 MoveMask(UI32, UI32) const;
+    void MoveMasks(const POS*, size_t, UI8*) const;
+
+    size_t Words(void)              const   { return walls.size(); }
+    UI32 Word(UI32 x, UI32 y)       const   { return (y + 1) * words_per_row + (x + 1) / 64; }
+    static UI32 Bit(UI32 x)                 { return (x + 1) % 64; }
+
+    private:
+    UI32 words_per_row;
+    std::vector<UI64> walls;
+    std::vector<UI64> open[4];  // Indexed by the position of UP, RIGHT, DOWN and LEFT bits
+
+    void BuildMoves(UI32);
+};
+
+#endif // MAPBITS_H_INCLUDED
+
+/**
+ *  PRIVATE MEMBER FUNCTION MapBits::BuildMoves
+ *  @brief  Works out the open directions of every cell of a row from the walls
+ *          of the row and of the rows above and below it. A cell is open to the
+ *          right when the bit after it is not a wall, which is the wall row
+ *          shifted right by one bit; to the left it is the row shifted left.
+ *  @param  row: The row to build (border included, so 1 to height).
+ */
+void MapBits::BuildMoves(UI32 row)
+{
+    const UI64* cur = &walls[row * words_per_row];
+    const UI64* above = cur - words_per_row;
+    const UI64* below = cur + words_per_row;
+    UI32 base = row * words_per_row;
+
+#ifdef __SSE2__
+    const __m128i ones = _mm_set1_epi32(-1);
+
+    for (UI32 i = 0; i < words_per_row; i += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(cur + i));
+        __m128i prev = i > 0 ? _mm_loadu_si128((const __m128i*)(cur + i - 2)) : ones;
+        __m128i next = i + 2 < words_per_row ? _mm_loadu_si128((const __m128i*)(cur + i + 2)) : ones;
+
+        // 128 bit shifts by one, carrying the bits across the two lanes and
+        // from the neighbouring blocks of the row
+        __m128i right = _mm_or_si128(_mm_or_si128(_mm_srli_epi64(v, 1),
+                                                  _mm_slli_epi64(_mm_srli_si128(v, 8), 63)),
+                                     _mm_slli_epi64(_mm_slli_si128(next, 8), 63));
+        __m128i left = _mm_or_si128(_mm_or_si128(_mm_slli_epi64(v, 1),
+                                                 _mm_srli_epi64(_mm_slli_si128(v, 8), 63)),
+                                    _mm_srli_epi64(_mm_srli_si128(prev, 8), 63));
+
+        _mm_storeu_si128((__m128i*)&open[0][base + i], _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(above + i)), ones));
+        _mm_storeu_si128((__m128i*)&open[1][base + i], _mm_andnot_si128(right, ones));
+        _mm_storeu_si128((__m128i*)&open[2][base + i], _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(below + i)), ones));
+        _mm_storeu_si128((__m128i*)&open[3][base + i], _mm_andnot_si128(left, ones));
+    }
+#else
+    for (UI32 i = 0; i < words_per_row; i++)
+    {
+        UI64 next = i + 1 < words_per_row ? cur[i + 1] : ~0ULL;
+        UI64 prev = i > 0 ? cur[i - 1] : ~0ULL;
+
+        open[0][base + i] = ~above[i];
+        open[1][base + i] = ~((cur[i] >> 1) | (next << 63));
+        open[2][base + i] = ~below[i];
+        open[3][base + i] = ~((cur[i] << 1) | (prev >> 63));
+    }
+#endif
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION MapBits::Build
+ *  @brief  Builds the bitsets of the given maze. The '*' cells, the border
+ *          and the padding count as walls; every other cell, the creatures'
+ *          starting cells included, can be walked on.
+ *  @param  map: The maze.
+ */
+void MapBits::Build(const Grid<I8>& map)
+{
+    words_per_row = (map.Width() + 2 + 127) / 128 * 2;
+    size_t words = (size_t)(map.Height() + 2) * words_per_row;
+
+    walls.assign(words, ~0ULL);
+
+    for (UI32 y = 0; y < map.Height(); y++)
+        for (UI32 x = 0; x < map.Width(); x++)
+            if (map(x, y) != '*')
+                walls[Word(x, y)] &= ~(1ULL << Bit(x));
+
+    for (UI8 d = 0; d < 4; d++)
+        open[d].assign(words, 0);
+
+    for (UI32 row = 1; row <= map.Height(); row++)
+        BuildMoves(row);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION MapBits::Clear
+ *  @brief  Releases the bitsets.
+ */
+void MapBits::Clear(void)
+{
+    words_per_row = 0;
+    walls.clear();
+
+    for (UI8 d = 0; d < 4; d++)
+        open[d].clear();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION MapBits::MoveMask
+ *  @brief  Returns the directions a creature standing on the given cell may
+ *          move to, as a mask of the UP, RIGHT, DOWN and LEFT bits.
+ *  @param  x, y: The cell.
+ */
+UI8 MapBits::MoveMask(UI32 x, UI32 y) const
+{
+    UI32 word = Word(x, y), bit = Bit(x);
+
+    return  (UI8)(((open[0][word] >> bit) & 1)        |
+                  (((open[1][word] >> bit) & 1) << 1) |
+                  (((open[2][word] >> bit) & 1) << 2) |
+                  (((open[3][word] >> bit) & 1) << 3));
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION MapBits::MoveMasks
+ *  @brief  Same as MoveMask for a whole array of cells. With AVX2, four cells
+ *          are looked up at once: their words are gathered from each direction
+ *          bitset and shifted by each cell's own bit in a single instruction.
+ *  @param  cells: The cells to look up.
+ *  @param  count: The number of cells.
+ *  @param  masks: Receives one mask per cell.
+ */
+void MapBits::MoveMasks(const POS* cells, size_t count, UI8* masks) const
+{
+    size_t i = 0;
+
+#ifdef __AVX2__
+    const __m256i one = _mm256_set1_epi64x(1);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i words = _mm256_set_epi64x(Word(cells[i + 3].x, cells[i + 3].y), Word(cells[i + 2].x, cells[i + 2].y),
+                                          Word(cells[i + 1].x, cells[i + 1].y), Word(cells[i].x, cells[i].y));
+        __m256i bits = _mm256_set_epi64x(Bit(cells[i + 3].x), Bit(cells[i + 2].x),
+                                         Bit(cells[i + 1].x), Bit(cells[i].x));
+        __m256i acc = _mm256_setzero_si256();
+
+        for (UI8 d = 0; d < 4; d++)
+        {
+            __m256i gathered = _mm256_i64gather_epi64((const long long*)&open[d][0], words, 8);
+            __m256i flag = _mm256_and_si256(_mm256_srlv_epi64(gathered, bits), one);
+            acc = _mm256_or_si256(acc, _mm256_slli_epi64(flag, d));
+        }
+
+        UI64 out[4];
+        _mm256_storeu_si256((__m256i*)out, acc);
+        for (UI8 j = 0; j < 4; j++)
+            masks[i + j] = (UI8)out[j];
+    }
+#endif
+
+    for (; i < count; i++)
+        masks[i] = MoveMask(cells[i].x, cells[i].y);
+}
+
+#ifndef PHILOX_H_INCLUDED
+#define PHILOX_H_INCLUDED
+
+/**
+ *  CLASS: Philox
+ *  @brief      Philox is a counter-based random number generator (Philox4x32-10).
+ *              Every block of four numbers is the encryption of a 128 bit counter
+ *              under a 64 bit key, so a generator is nothing more than its key and
+ *              counter. Split derives a new key from the current one, giving any
+ *              number of independent streams (one per game, per thread, per
+ *              stage, ...) that are reproducible from a single seed.
+ */
+class Philox
+{
+    public:
+    explicit Philox(UI64 seed = 0) : used(4)
+    {
+        key[0] = (UI32)seed;
+        key[1] = (UI32)(seed >> 32);
+        ctr[0] = ctr[1] = ctr[2] = ctr[3] = 0;
+    }
+
+    UI32 Next(void);
+    UI32 Below(UI32);
+    Philox Split(UI64) const;
+
+    private:
+    UI32 key[2];
+    UI32 ctr[4];
+    UI32 out[4];
+    UI8 used;
+
+    static void Block(const UI32[2], const UI32[4], UI32[4]);
+};
+
+#endif // PHILOX_H_INCLUDED
+
+/**
+ *  PRIVATE STATIC MEMBER FUNCTION Philox::Block
+ *  @brief  Encrypts a counter under a key with the ten Philox4x32 rounds.
+ *  @param  _key: The key.
+ *  @param  _ctr: The counter.
+ *  @param  result: Receives the four output numbers.
+ */
+void Philox::Block(const UI32 _key[2], const UI32 _ctr[4], UI32 result[4])
+{
+    UI32 k0 = _key[0], k1 = _key[1];
+    UI32 c0 = _ctr[0], c1 = _ctr[1], c2 = _ctr[2], c3 = _ctr[3];
+
+    for (UI8 round = 0; round < 10; round++)
+    {
+        UI64 p0 = (UI64)0xD2511F53 * c0;
+        UI64 p1 = (UI64)0xCD9E8D57 * c2;
+
+        c0 = (UI32)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (UI32)p1;
+        c2 = (UI32)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (UI32)p0;
+
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+
+    result[0] = c0; result[1] = c1; result[2] = c2; result[3] = c3;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Philox::Next
+ *  @brief  Returns the next 32 bit random number of the stream.
+ */
+UI32 Philox::Next(void)
+{
+    if (used == 4)
+    {
+        Block(key, ctr, out);
+        if (++ctr[0] == 0 && ++ctr[1] == 0 && ++ctr[2] == 0) ++ctr[3];
+        used = 0;
+    }
+
+    return out[used++];
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Philox::Below
+ *  @brief  Returns a random number in [0, bound).
+ *  @param  bound: The exclusive upper limit.
+ */
+UI32 Philox::Below(UI32 bound)
+{
+    return (UI32)(((UI64)Next() * bound) >> 32);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Philox::Split
+ *  @brief  Derives an independent generator from this one. The same id always
+ *          gives the same generator and this one is left untouched.
+ *  @param  id: The number of the stream to derive.
+ */
+Philox Philox::Split(UI64 id) const
+{
+    UI32 id_ctr[4] = { (UI32)id, (UI32)(id >> 32), 0xFFFFFFFF, 0xFFFFFFFF };
+    UI32 derived[4];
+    Block(key, id_ctr, derived);
+
+    return Philox(((UI64)derived[1] << 32) | derived[0]);
+}
+
 #ifndef LIVING_H_INCLUDED
 #define LIVING_H_INCLUDED
 
@@ -141,12 +781,12 @@ typedef struct general_exc
 class Living
 {
     public:
-    UI8 CurX(void)      const   { return xypos.x; }
-    UI8 CurY(void)      const   { return xypos.y; }
+    COORD CurX(void)    const   { return xypos.x; }
+    COORD CurY(void)    const   { return xypos.y; }
     POS CurPos(void)    const   { return xypos; }
 
-    void SetX(UI8 x)       { xypos.x = x; }
-    void SetY(UI8 y)       { xypos.y = y; }
+    void SetX(COORD x)     { xypos.x = x; }
+    void SetY(COORD y)     { xypos.y = y; }
     void SetPos(POS pos)   { xypos = pos; }
 
     void MoveDown(void)     { xypos.y++; }
@@ -218,1617 +858,7314 @@ class Potter : public Living
 
 #endif // POTTER_H_INCLUDED
 
-#ifndef MONSTER_H_INCLUDED
-#define MONSTER_H_INCLUDED
+#ifndef OCCUPANCY_H_INCLUDED
+#define OCCUPANCY_H_INCLUDED
 
 /**
- *  CLASS: Monster
- *  @brief      This is the class used to create the monsters of the game (gnome and traal).
- *              The monsters hold a movement map, helping them to make better decisions about
- *              where on the map to go next.
+ *  CLASS: Occupancy
+ *  @brief      Occupancy tells who stands on every cell of the maze. Each cell holds
+ *              the first of its occupants and the occupants of a cell are chained
+ *              to each other in both directions, so placing, moving and looking up
+ *              an occupant costs the same with two creatures or with thousands.
+ *              The cell each occupant last came from is kept as well, so the
+ *              occupant that crossed an edge between two cells is found among
+ *              the occupants of the second one.
  */
-class Monster : public Living
+class Occupancy
 {
-    friend class Engine;
-
     public:
-    Monster() : Living(), moves(0), prev_pos({0,0})
-    {}
+    static const UI32 NOBODY = 0xFFFFFFFF;
 
-    UI8 Moves(UI8 move)  const   { return moves & move; }
-    void SetMoves(UI8 _moves)     { moves = _moves; }
-    void ResetMoves(void)   { moves = 0; }
+    void Reset(UI32, UI32);
+    void Clear(void);
 
-    POS PrevPos(void)   const   { return prev_pos; }
-    UI8 PrevX(void)     const   { return prev_pos.x; }
-    UI8 PrevY(void)     const   { return prev_pos.y; }
-    void PrevPos(POS set)  { prev_pos = set; }
+    void Add(UI32, POS);
+    void Move(UI32, POS, POS);
+    void Stay(UI32 who, POS at)     { came_from[who] = at; }
+
+    UI32 At(POS at) const           { return first(at.x, at.y); }
+    UI32 Next(UI32 who) const       { return next[who]; }
+    UI32 Crossed(POS, POS) const;
 
     private:
-    UI8 moves;
-    POS prev_pos;
-    UI32** move_map;
-
-    /** PRIVATE MEMBER FUNCTION: CalculateShortest
-     *  @brief      Calculates the best movement to be made byt the monster in order to
-     *              get closer to the position given as a parametre.
-     *  @param      coords: The cordinates of the referenced position.
-     */
-    void CalculateShortest(POS coords)
-    {
-        if (coords.y > xypos.y)     moves |= DOWN;
-        else if (coords.y < xypos.y) moves |= UP;
+    Grid<UI32> first;
+    std::vector<UI32> next;
+    std::vector<UI32> prev;
+    std::vector<POS> came_from; // The cell each occupant left on its last move, its own if it stayed
 
-        if (coords.x > xypos.x)     moves |= RIGHT;
-        else if (coords.x < xypos.x) moves |= LEFT;
-    }
-};
-
-#endif // MONSTER_H_INCLUDED
+    void Unlink(UI32, POS);
+};
 
-#ifndef SCOREPLAY_H_INCLUDED
-#define SCOREPLAY_H_INCLUDED
+#endif // OCCUPANCY_H_INCLUDED
+
+/* CLASS OCCUPANCY PRIVATE MEMBER DEFINITIONS */
+const UI32 Occupancy::NOBODY;
 
 /**
- *  CLASS: HighScore
- *  @brief      HighScore is used to retrieve and keep information about
- *              the game's high score table.
+ *  PRIVATE MEMBER FUNCTION Occupancy::Unlink
+ *  @brief  Takes an occupant out of the chain of the given cell.
+ *  @param  who: The occupant.
+ *  @param  at: The cell it currently occupies.
  */
-class HighScore
+void Occupancy::Unlink(UI32 who, POS at)
 {
-    public:
-    void InitTable(void);
-    void SaveTable(void);
-    void EmptyTable(void) { score_table.erase(score_table.begin(), score_table.end()); }
-    void SortTable(void) { sort(score_table.rbegin(), score_table.rend()); }
-
-    std::string PlayerName(void)    const       { return cur_player_name; }
-    std::string& PlayerName(void)               { return cur_player_name; }
-    void PlayerName(const std::string& name)    { cur_player_name = name; }
+    if (prev[who] != NOBODY)    next[prev[who]] = next[who];
+    else                        first(at.x, at.y) = next[who];
 
-    const std::vector<SCOS>& ScoreTable(void)   const   { return score_table; }
+    if (next[who] != NOBODY)    prev[next[who]] = prev[who];
+}
 
-    /**
-     *  PUBLIC MEMBER OVERLOADED OPERATOR HighScore::operator <<
-     *  @brief      Accepts a score integer as an argument and if the player name
-     *              already exists on the high score table, it is assigned the
-     *              score, else a new table record is created.
-     */
-    void friend operator << (HighScore& self, UI32 score)
-    {
-        std::vector<SCOS>::iterator existance;
+/* CLASS OCCUPANCY PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Occupancy::Reset
+ *  @brief  Empties every cell of a maze of the given size.
+ *  @param  width: The width of the maze.
+ *  @param  height: The height of the maze.
+ */
+void Occupancy::Reset(UI32 width, UI32 height)
+{
+    first.Reset(width, height, NOBODY);
+    first.Fill(NOBODY);
+    next.clear();
+    prev.clear();
+    came_from.clear();
+}
 
-        for (existance = self.score_table.begin(); existance != self.score_table.end(); existance++)
-            if (strcmp((*existance).player_name,self.cur_player_name.c_str()) == 0)
-                break;
+/**
+ *  PUBLIC MEMBER FUNCTION Occupancy::Clear
+ *  @brief  Frees the memory held for the current maze.
+ */
+void Occupancy::Clear(void)
+{
+    first.Clear();
+    next.clear();
+    prev.clear();
+    came_from.clear();
+}
 
-        if (existance == self.score_table.end())
-            self.score_table.push_back(SCOS(score, self.cur_player_name.c_str()));
-        else if ((*existance).player_score < score)
-                (*existance).player_score = score;
+/**
+ *  PUBLIC MEMBER FUNCTION Occupancy::Add
+ *  @brief  Places a new occupant on a cell. Occupants are numbered in the
+ *          order they are added, starting from 0.
+ *  @param  who: The number of the occupant.
+ *  @param  at: The cell to place it on.
+ */
+void Occupancy::Add(UI32 who, POS at)
+{
+    if (who >= next.size())
+    {
+        next.resize(who + 1, NOBODY);
+        prev.resize(who + 1, NOBODY);
+        came_from.resize(who + 1);
     }
 
-    private:
-    std::vector<SCOS> score_table;
-    std::string cur_player_name;
-    std::ifstream score_in;
-    std::ofstream score_out;
-};
+    UI32& head = first(at.x, at.y);
+    came_from[who] = at;
 
-#endif  // SCORE_H_INCLUDED
+    next[who] = head;
+    prev[who] = NOBODY;
+    if (head != NOBODY) prev[head] = who;
+    head = who;
+}
 
 /**
- *  PUBLIC MEMBER FUNCTION HighScore::InitTable
- *  @brief      Initiates the high score table of the game retrieving the
- *              data from the file specified within the corresponding class
- *              of the function.
+ *  PUBLIC MEMBER FUNCTION Occupancy::Move
+ *  @brief  Moves an occupant from the cell it occupies to another one.
+ *  @param  who: The occupant.
+ *  @param  from: The cell it currently occupies.
+ *  @param  to: The cell it moves to.
  */
-void HighScore::InitTable(void)
+void Occupancy::Move(UI32 who, POS from, POS to)
 {
-    if (score_table.size() > 0) return;    // If The file is already open we return doing nothing
+    Unlink(who, from);
 
-    score_in.open("scores", std::ios::in | std::ios::binary);
-    if (!score_in) throw FILEEXP("scores", "input");
+    UI32& head = first(to.x, to.y);
 
-    SCOS tmp_score;
-    UI8 buf_size = sizeof(SCOS);
-
-    while (score_in.read((char*)&tmp_score, buf_size), score_in.good())
-        score_table.push_back(tmp_score);
-
-    score_in.close();
+    next[who] = head;
+    prev[who] = NOBODY;
+    if (head != NOBODY) prev[head] = who;
+    head = who;
+    came_from[who] = from;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION HighScore::SaveTable
- *  @brief      Writes the high score table in the file specified within
- *              the corresponding class of the function.
+ *  PUBLIC MEMBER FUNCTION Occupancy::Crossed
+ *  @brief  Looks for an occupant that moved from one cell to another one on its
+ *          last move. Only the occupants of the second cell need to be checked.
+ *  @param  from: The cell the occupant left.
+ *  @param  to: The cell it moved to, which must differ from the first one.
+ *  @return The first such occupant, or NOBODY.
  */
-void HighScore::SaveTable(void)
+UI32 Occupancy::Crossed(POS from, POS to) const
 {
-    score_out.open("scores", std::ios::out | std::ios::binary);
-    if (!score_out) throw FILEEXP("scores", "output");
+    for (UI32 who = At(to); who != NOBODY; who = next[who])
+        if (came_from[who].x == from.x && came_from[who].y == from.y)
+            return who;
 
-    UI8 buf_size = sizeof(SCOS);
-    SCOS tmp_score;
-
-    for (std::vector<SCOS>::const_iterator it = score_table.begin(); it != score_table.end(); it++)
-        score_out.write((char*)&(*it), buf_size);
-
-    score_out.close();
+    return NOBODY;
 }
 
-#ifndef STAGE_H_INCLUDED
-#define STAGE_H_INCLUDED
+#ifndef MONSTERS_H_INCLUDED
+#define MONSTERS_H_INCLUDED
 
 /**
- *  CLASS: Stage
- *  @brief      Stage is the main part of the game where all the living
- *              creatures exist and react. Stage holds the maze and the
- *              soulless objects.
- */
-class Stage
+ *  CLASS: Monsters
+ *  @brief      Monsters holds every monster of a level, be it two or thousands of them.
+ *              Instead of one object per monster, each attribute is kept in its own
+ *              array indexed by the monster's number (positions, previous positions
+ *              and kinds), so the engine walks the arrays from start to end on every
+ *              turn and reads only the attributes it needs. An occupancy grid kept up
+ *              to date on every move tells which monsters stand on a cell and which
+ *              one crossed an edge during the turn.
+ */
+class Monsters
 {
     friend class Engine;
 
     public:
-    Stage();
-
-    UI8 MapHeight(void)     const       { return map_h; }
-    UI8 MapWidth(void)      const       { return map_w; }
-    POS ParchPos(void)      const       { return parch_pos; }
-    UI8 DiamondsCount(void) const       { return diamonds_count; }
-    void DiamondsCount(UI8 _count)      { diamonds_count = _count; }
+    static const UI32 NOBODY = Occupancy::NOBODY;
 
-    bool EraseDiamond(POS);
+    UI32 Count(void)            const   { return pos.size(); }
+    POS Pos(UI32 i)             const   { return pos[i]; }
+    POS PrevPos(UI32 i)         const   { return prev_pos[i]; }
+    MONST_T Kind(UI32 i)        const   { return (MONST_T)kind[i]; }
 
-    void Load(std::ifstream&);
-    void Unload(void);
-    const std::vector<I8*>& Map() const { return map; }
+    void Reset(UI32, UI32);
+    UI32 Add(POS, MONST_T);
+    void Move(UI32, UI8);
+    UI32 Find(POS at) const             { return cells.At(at); }
+    UI32 FindNext(UI32 i) const         { return cells.Next(i); }
+    UI32 Crossed(POS from, POS to) const    { return cells.Crossed(from, to); }
+    void Clear(void);
 
     private:
-    UI8 map_w, map_h, diamonds_count;
-    POS parch_pos;
-    std::vector<I8*> map;
-
-    void PopDmnds(void);
-    void PlaceParchment(void);
-};
+    std::vector<POS> pos;
+    std::vector<POS> prev_pos;
+    std::vector<UI8> kind;      // MONST_T of each monster
+    Occupancy cells;
+};
 
-#endif // STAGE_H_INCLUDED
+#endif // MONSTERS_H_INCLUDED
+
+/* CLASS MONSTERS PUBLIC MEMBER DEFINITIONS */
+const UI32 Monsters::NOBODY;
 
-/* CLASS STAGE PRIVATE MEMBER DEFINITIONS */
 /**
- *  PRIVATE MEMBER FUNCTION Stage::PopDmnds
- *  @brief  Populates the map with diamonds, represented as dots ('.')
+ *  PUBLIC MEMBER FUNCTION Monsters::Reset
+ *  @brief  Removes every monster and prepares the store for a maze of the given size.
+ *  @param  width: The width of the maze.
+ *  @param  height: The height of the maze.
  */
-void Stage::PopDmnds(void)
+void Monsters::Reset(UI32 width, UI32 height)
 {
-    UI8 dx, dy;
-    srand(time(NULL));
+    Clear();
+    cells.Reset(width, height);
+}
 
-    for (UI8 cc = 0; cc < DIAMONDS_DEFAULT_COUNT; cc++)
-    {
-        do
-        {
-            dx = rand() % (map_w - 1);
-            dy = rand() % (map_h - 1);
-        } while (map[dy][dx] != ' ');
+/**
+ *  PUBLIC MEMBER FUNCTION Monsters::Add
+ *  @brief  Adds a new monster to the store.
+ *  @param  at: The cell the monster starts from.
+ *  @param  _kind: The kind of the monster.
+ *  @return The number of the new monster.
+ */
+UI32 Monsters::Add(POS at, MONST_T _kind)
+{
+    pos.push_back(at);
+    prev_pos.push_back(POS(0,0));
+    kind.push_back(_kind);
+    cells.Add(pos.size() - 1, at);
 
-        map[dy][dx] = '.';
-    }
+    return pos.size() - 1;
 }
 
 /**
- *  PRIVATE MEMBER FUNCTION Stage::PlaceParchment
- *  @brief  Places the parchment on the map required for Harry to complete the level.
- *          The parchment is represented with the character 'P'.
+ *  PUBLIC MEMBER FUNCTION Monsters::Move
+ *  @brief  Moves a monster one cell towards the given direction, remembering
+ *          the cell it leaves.
+ *  @param  i: The number of the monster to be moved.
+ *  @param  direction: One of UP, RIGHT, DOWN or LEFT.
  */
- void Stage::PlaceParchment(void)
- {
-     UI8 dx, dy;
+void Monsters::Move(UI32 i, UI8 direction)
+{
+    POS from = pos[i];
+    POS& to = pos[i];
 
-     do
-     {
-        dx = rand() % (map_w - 1);
-        dy = rand() % (map_h - 1);
-     } while (map[dy][dx] != ' ');
+    switch (direction)
+    {
+        case UP:    to.y--; break;
+        case RIGHT: to.x++; break;
+        case DOWN:  to.y++; break;
+        case LEFT:  to.x--; break;
+        default:    return;
+    }
 
-     parch_pos = {dx, dy};
- }
+    prev_pos[i] = from;
+    cells.Move(i, from, to);
+}
 
-/* CLASS STAGE PUBLIC MEMBER DEFINITIONS */
 /**
- *  PUBLIC DEFAULT CONTRUCTOR Stage
- *  @brief Initialises the private members needed for the object to be valid.
+ *  PUBLIC MEMBER FUNCTION Monsters::Clear
+ *  @brief  Removes every monster from the store.
  */
-Stage::Stage() : map_w(0), map_h(0),
-                 diamonds_count(DIAMONDS_DEFAULT_COUNT)
-{} //Stage::Stage()
+void Monsters::Clear(void)
+{
+    pos.clear();
+    prev_pos.clear();
+    kind.clear();
+    cells.Clear();
+}
+
+#ifndef TRAILS_H_INCLUDED
+#define TRAILS_H_INCLUDED
 
 /**
- *  PUBLIC MEMBER FUNCTION Stage::Load
- *  @brief  Loads the stage map (maze) from the given input file stream
- *  @param  mapdata: The input file stream
- *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
- *          before a new call of this function occurs
+ *  CLASS: Trails
+ *  @brief      Trails counts how many times every monster has left every cell, which
+ *              is the movement map each wandering monster steers by. Only the cells
+ *              a monster has actually left are kept, all of them in one open addressed
+ *              table keyed by the monster's number and the cell, so thousands of
+ *              monsters on a large maze cost what they have walked and not a whole
+ *              maze each. A key and its count share a slot, so a lookup touches
+ *              one cache line in most cases.
  */
-void Stage::Load(std::ifstream& mapdata)
+class Trails
 {
-    // ifstream must point to some file and
-    // object's width and height must be set to 0
-    if (mapdata == NULL)
-        throw GENEXP("General error in Stage::Load:\nCould not load map file");
+    public:
+    Trails() : used(0), shift(64)
+    {}
 
-    if (map_w != 0 || map_h != 0)
-        throw GENEXP("General error in Stage::Load:\nInvalid initial class values. You need to call Unload first.");
+    void Reset(void);
+    void Clear(void);
 
-    I8 *buf, aux_ch = 0;
-    std::stringstream ss;
+    UI32 Count(UI32, UI32) const;
+    void Leave(UI32, UI32);
 
-    // File must contain only asterisks ('*') and new line characters to be valid
-    // If not, return an error report state showing an invalid file
-    // If valid, store the character and proceed to reading the next ones
-    while (aux_ch != '\n')
+    private:
+    struct SLOT
     {
-        mapdata.read(&aux_ch, 1);
-
-        if (aux_ch != '*' &&
-            aux_ch != '\n')
-            throw GENEXP("General error in Stage::Load:\nInvalid data were found in map file");
+        UI64 key;               // The monster and the cell plus one, 0 if the slot is empty
+        UI32 count;
+    };
 
-        ss << aux_ch;
-        map_w++;
-    }
+    std::vector<SLOT> slots;
+    UI32 used;
+    UI8 shift;                  // 64 minus the bits of the table size
 
-    buf = new I8[map_w + 1];
-    ss.getline(buf, map_w);
-    map.push_back(buf);
-    map_h++;
+    static UI64 Key(UI32 who, UI32 cell)    { return ((UI64)who << 32 | cell) + 1; }
+    size_t Find(UI64) const;
+    void Grow(void);
+};
 
-    buf = new I8[map_w + 1];
-    while (mapdata.read(buf, map_w), mapdata.good()) // Many thanks to GMeles for this good piece of code
-    {
-        // Each line read must have exactly the same width as the ones above it.
-        // If not then an error report state is returned, showing invalid file.
-        // If everything is OK and we haven't reached the end of the file
-        // continue reading lines.
-        if (buf[map_w - 1]  != '\n' &&
-            buf[map_w - 2]  != '*' &&
-            buf[0]          != '*')
-            throw GENEXP("General error in Stage::Load:\nInvalid data were found in map file");
+#endif // TRAILS_H_INCLUDED
 
-        map.push_back(buf);
-        buf = new I8[map_w + 1];
-        map_h++;
-    }
+/* CLASS TRAILS PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION Trails::Find
+ *  @brief  Returns the slot that holds the given key, or the empty slot where
+ *          it would go. The table is never more than half full, so there
+ *          always is one.
+ *  @param  key: The key, as Trails::Key makes it.
+ */
+size_t Trails::Find(UI64 key) const
+{
+    size_t mask = slots.size() - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> shift;
 
-    // Decreasing the map's width to represent the real width of the mase
-    // (without the '\0' character)
-    map_w--;
+    while (slots[slot].key != key && slots[slot].key != 0)
+        slot = (slot + 1) & mask;
 
-    //Populating the map with the diamonds and placing the parchment
-    PopDmnds();
-    PlaceParchment();
-} // Stage::Load()
+    return slot;
+}
 
 /**
- *  PUBLIC MEMBER FUNCTION Stage::Unload
- *  @brief  Unloads the stage map (maze) and sets the object appropriately to load new map.
- *  @note   This specific function must be called after every Stage::Load call in order to
- *          load a new map.
+ *  PRIVATE MEMBER FUNCTION Trails::Grow
+ *  @brief  Doubles the table and puts every count back in it.
  */
-void Stage::Unload(void)
+void Trails::Grow(void)
 {
-    std::vector<I8*>::iterator iter = map.begin();
+    SLOT empty = { 0, 0 };
+    std::vector<SLOT> old_slots(slots.empty() ? 64 : slots.size() * 2, empty);
 
-    for (int i = 0; i < map_h; i++)
-    {
-        delete[] map[0];
-        map.erase(iter);
-    }
+    slots.swap(old_slots);
+    shift = 64;
+    for (size_t size = slots.size(); size > 1; size >>= 1)
+        shift--;
 
-    map_h = map_w = 0;
-} // Stage::Unload
+    for (size_t i = 0; i < old_slots.size(); i++)
+        if (old_slots[i].key != 0)
+            slots[Find(old_slots[i].key)] = old_slots[i];
+}
 
+/* CLASS TRAILS PUBLIC MEMBER DEFINITIONS */
 /**
- *  PUBLIC MEMBER FUNCTION Stage::EraseDiamond
- *  @brief  Erases the diamond at the position given as a parametre.
- *  @param  coords: The position of the diamond to erase.
+ *  PUBLIC MEMBER FUNCTION Trails::Reset
+ *  @brief  Forgets every count, keeping the memory for the next level unless
+ *          the table was grown far beyond what the last level needed. Wiping
+ *          it then would cost every later level what the longest one walked.
  */
-bool Stage::EraseDiamond(POS coords)
+void Trails::Reset(void)
 {
-    if (map[coords.y][coords.x] == '.')
+    if (used == 0) return;
+
+    if (slots.size() > 4 * (size_t)used)
     {
-        map[coords.y][coords.x] = ' ';
-        diamonds_count--;
-        return true;
+        Clear();
+        return;
     }
 
-    return false;
-} // EraseDiamonds
+    SLOT empty = { 0, 0 };
+    std::fill(slots.begin(), slots.end(), empty);
+    used = 0;
+}
 
-#ifndef ENGINE_H_INCLUDED
-#define ENGINE_H_INCLUDED
+/**
+ *  PUBLIC MEMBER FUNCTION Trails::Clear
+ *  @brief  Forgets every count and frees the memory of the table.
+ */
+void Trails::Clear(void)
+{
+    std::vector<SLOT>().swap(slots);
+    used = 0;
+    shift = 64;
+}
 
 /**
- *  CLASS: Engine
- *  @brief      Engine controls every basic aspect of the game;
- *              be that the monsters' and player's moves, collisions
- *              or the proper initialisation of levels. It also holds an
- *              inner struct for use as an exception when the user presses
- *              the escape key to end the current game.
+ *  PUBLIC MEMBER FUNCTION Trails::Count
+ *  @brief  Returns how many times a monster has left a cell.
+ *  @param  who: The number of the monster.
+ *  @param  cell: The index of the cell in the map of the stage.
  */
-class Engine
+UI32 Trails::Count(UI32 who, UI32 cell) const
 {
-    public:
-    Engine() : player("Player 1"), thres(MONSTER_MAP_THRESSHOLD)
-    {}
+    if (used == 0) return 0;
 
-    typedef struct esc_struct
-    {   // Used as exception for when the user presses the escape key
-        std::string esc_reason;
+    const SLOT& slot = slots[Find(Key(who, cell))];
 
-        esc_struct(const std::string& _reason) : esc_reason(_reason)
-        {}
-    }   Escape;
+    return slot.key ? slot.count : 0;
+}
 
-    void InitLevel(std::ifstream&);
-    void EndLevel(void);
-    COLL_T CheckMapCollision(POS);
+/**
+ *  PUBLIC MEMBER FUNCTION Trails::Leave
+ *  @brief  Counts one more time a monster has left a cell.
+ *  @param  who: The number of the monster.
+ *  @param  cell: The index of the cell in the map of the stage.
+ */
+void Trails::Leave(UI32 who, UI32 cell)
+{
+    if ((used + 1) * 2 > slots.size()) Grow();
 
-    void NewMove(Living*, I32);
-    void NewSmartMove(Monster*);
-    void NewDummyMove(Monster*);
+    UI64 key = Key(who, cell);
+    SLOT& slot = slots[Find(key)];
 
-    Stage stage;
-    Potter player;
-    Monster gnome;
-    Monster traal;
+    if (slot.key == 0)
+    {
+        slot.key = key;
+        slot.count = 0;
+        used++;
+    }
 
-    private:
-    UI8 thres;
-    void InitPos(void);
-    void InitMoveMaps(void);
-    void DestroyMoveMaps(void);
-};
+    slot.count++;
+}
 
-#endif // ENGINE_H_INCLUDED
+#ifndef SCOREPLAY_H_INCLUDED
+#define SCOREPLAY_H_INCLUDED
 
-/* CLASS ENGINE PRIVATE MEMBER DEFINITIONS */
 /**
- *  PRIVATE MEMBER FUNCTION Engine::InitPos
- *  @brief  Initialises the positions of the living creatures on the
- *          map. Creatures are positioned randomly and monsters cannot
- *          be placed on player's initial position.
+ *  CLASS: HighScore
+ *  @brief      HighScore is used to retrieve and keep information about
+ *              the game's high score table. The file is a journal shared by
+ *              every game on the machine: a record is only ever appended to it,
+ *              and a later record of a player with a higher score supersedes an
+ *              earlier one. Games append under a shared lock, so any number of
+ *              them commit at once; the file is compacted, by whichever game
+ *              gets an exclusive lock without waiting, into a new file renamed
+ *              over the old one. Reading the table only reads the part of the
+ *              journal appended since the last read.
+ *              In memory an index finds the record of a player by name and a
+ *              ranking tree keeps the records ordered by score, best first,
+ *              the earlier record first on a tie. The tree knows the size of
+ *              every subtree, so a rank is found in logarithmic time and the
+ *              top of the table is read straight off it, with no sorting.
  */
-void Engine::InitPos(void)
+class HighScore
 {
-    UI8 dx = 0, dy = 0;
-    srand(time(NULL));
+    public:
+    HighScore() : journal_dev(0), journal_ino(0), journal_end(0)
+    {}
 
-    // Positioning Harry
-    do
-    {
-        dx = rand() % (stage.MapWidth() - 1);
-        dy = rand() % (stage.MapHeight() - 1);
-    } while (stage.map[dy][dx] != ' ');
+    void InitTable(void);
+    void SaveTable(void);
+    void EmptyTable(void);
+
+    std::string PlayerName(void)    const       { return cur_player_name; }
+    std::string& PlayerName(void)               { return cur_player_name; }
+    void PlayerName(const std::string& name)    { cur_player_name = name; }
 
-    player.SetX(dx);
-    player.SetY(dy);
+    UI32 Count(void)    const   { return records.size(); }
+    UI32 Rank(const std::string&) const;
+    std::vector<SCOS> Top(UI32) const;
 
-    // Positioning Gnome
-    do
+    /**
+     *  PUBLIC MEMBER OVERLOADED OPERATOR HighScore::operator <<
+     *  @brief      Accepts a score integer as an argument and if the player name
+     *              already exists on the high score table, it is assigned the
+     *              score, if higher, else a new table record is created.
+     */
+    void friend operator << (HighScore& self, UI32 score)
     {
-        dx = rand() % (stage.MapWidth() - 1);
-        dy = rand() % (stage.MapHeight() - 1);
-    } while (stage.map[dy][dx] != ' ' || POS(dx, dy) == player.CurPos());
+        self.Raise(self.cur_player_name, score, true);
+    }
 
-    gnome.SetX(dx);
-    gnome.SetY(dy);
+    private:
+    typedef __gnu_pbds::tree<UI64, __gnu_pbds::null_type, std::less<UI64>, __gnu_pbds::rb_tree_tag,
+                             __gnu_pbds::tree_order_statistics_node_update> RANKING;
+
+    std::vector<SCOS> records;
+    std::vector<UI32> pending;  // Records to append on the next save
+    std::vector<UI8> is_pending;
+    std::unordered_map<std::string, UI32> index;
+    RANKING ranking;
+    std::string cur_player_name;
 
-    // Positioning Traal
-    do
-    {
-        dx = rand() % (stage.MapWidth() - 1);
-        dy = rand() % (stage.MapHeight() - 1);
-    } while (stage.map[dy][dx] != ' ' || POS(dx, dy) == player.CurPos());
+    UI64 journal_dev, journal_ino;  // The file this table last read
+    UI64 journal_end;               // How much of it was read
 
-    traal.SetX(dx);
-    traal.SetY(dy);
+    // Better scores first, then earlier records first
+    UI64 Key(UI32 record) const { return ((UI64)~records[record].player_score << 32) | record; }
+    void Raise(const std::string&, UI32, bool);
+    int OpenJournal(int, const char*);
+    void ReadJournal(int);
+    void Compact(void);
+};
 
-    gnome.PrevPos(POS(0,0));
-    traal.PrevPos(POS(0,0));
-}
+#endif  // SCORE_H_INCLUDED
 
+/* CLASS HIGHSCORE PRIVATE MEMBER DEFINITIONS */
 /**
- *  PRIVATE MEMBER FUNCTION Engine::InitMoveMaps
- *  @brief  Initialises movement map arrays of the monsters.
+ *  PRIVATE MEMBER FUNCTION HighScore::Raise
+ *  @brief  Gives a player a score, if it is higher than the one on the table,
+ *          or adds the player to the table.
+ *  @param  name: The name of the player.
+ *  @param  score: The score.
+ *  @param  pend: Whether the score is new and must be appended on the next
+ *          save, or was read from the file.
  */
-void Engine::InitMoveMaps(void)
+void HighScore::Raise(const std::string& name, UI32 score, bool pend)
 {
-        gnome.move_map = new UI32*[stage.MapHeight()];
-        traal.move_map = new UI32*[stage.MapHeight()];
+    std::unordered_map<std::string, UI32>::const_iterator existance = index.find(name);
+    UI32 record;
 
-        for (UI8 i = 0; i < stage.MapHeight(); i++)
-        {
-            gnome.move_map[i] = new UI32[stage.MapWidth()];
-            traal.move_map[i] = new UI32[stage.MapWidth()];
-        }
+    if (existance == index.end())
+    {
+        record = records.size();
+        records.push_back(SCOS(score, name.c_str()));
+        is_pending.push_back(0);
+        index.insert(std::make_pair(name, record));
+    }
+    else
+    {
+        record = existance->second;
+        if (records[record].player_score >= score) return;
 
-        for (UI8 i = 0; i < stage.MapHeight(); i++)
-            for (UI8 j = 0; j < stage.MapWidth(); j++)
-            {
-                gnome.move_map[i][j] = 0;
-                traal.move_map[i][j] = 0;
-            }
-}
+        ranking.erase(Key(record));
+        records[record].player_score = score;
+    }
 
-/**
- *  PRIVATE MEMBER FUNCTION Engine::DestroyMoveMaps
- *  @brief  Dealocates the memory occupied by the monsters' movement maps.
- */
-void Engine::DestroyMoveMaps(void)
-{
-    delete[] gnome.move_map;
-    delete[] traal.move_map;
-}
+    ranking.insert(Key(record));
 
-/* CLASS ENGINE PUBLIC MEMBER DEFINITIONS */
-/**
- *  PUBLIC MEMBER FUNCTION Engine::InitLevel
- *  @brief  Performs all the necessary actions to set a game level,
- *          according to the map file passed as argument.
- *  @param  mapdata: The input filestream that points to the file
- *                   containing a valid map.
- */
-void Engine::InitLevel(std::ifstream& mapdata)
-{
-    stage.Load(mapdata);
-    InitMoveMaps();
-    InitPos();
+    if (!pend || is_pending[record]) return;
+    is_pending[record] = 1;
+    pending.push_back(record);
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Engine::EndLevel
- *  @brief  Performs all the necessary actions to end a game level,
+ *  PRIVATE MEMBER FUNCTION HighScore::OpenJournal
+ *  @brief  Opens the file and takes a shared lock on it. A game compacting the
+ *          file may have renamed a new one over it meanwhile, so the file is
+ *          opened again until the locked one is the one under the name.
+ *  @param  flags: The flags to open the file with.
+ *  @param  purpose: What the file is opened for, should it fail to open.
+ *  @return The file descriptor.
  */
-void Engine::EndLevel(void)
+int HighScore::OpenJournal(int flags, const char* purpose)
 {
-    DestroyMoveMaps();
+    while (true)
+    {
+        int fd = open(SCORES_FILE, flags, 0666);
+        if (fd < 0) throw FILEEXP(SCORES_FILE, purpose);
 
-    stage.Unload();
-    stage.DiamondsCount(10);
+        struct stat held, named;
+        while (flock(fd, LOCK_SH) != 0 && errno == EINTR);
 
-    player.SetPos(POS());
-    gnome.SetPos(POS());
-    traal.SetPos(POS());
+        if (fstat(fd, &held) == 0 && stat(SCORES_FILE, &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino)
+            return fd;
+
+        close(fd);
+    }
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Engine::CheckMapCollision
- *  @brief  Calculates whether a given Living creature collides with another
- *          object on the stage.
- *  @param  liv_pos: The position that needs to be checked for collisions.
+ *  PRIVATE MEMBER FUNCTION HighScore::ReadJournal
+ *  @brief  Reads the records appended to the file since the last read. A file
+ *          other than the last one read is a compacted one and is read whole;
+ *          its records are already on the table or supersede the ones on it, so
+ *          nothing has to be forgotten first. A record still being appended by
+ *          another game is left for the next read.
+ *  @param  fd: The open file.
  */
-COLL_T Engine::CheckMapCollision(POS liv_pos)
+void HighScore::ReadJournal(int fd)
 {
-    I8 block = stage.map[liv_pos.y][liv_pos.x];
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw FILEEXP(SCORES_FILE, "input");
 
-    switch (block)
+    if ((UI64)st.st_dev != journal_dev || (UI64)st.st_ino != journal_ino || (UI64)st.st_size < journal_end)
     {
-        case '.':   return COLL_T::DMND;
-        case '*':   return COLL_T::WALL;
+        journal_dev = st.st_dev;
+        journal_ino = st.st_ino;
+        journal_end = 0;
     }
 
-    if (stage.DiamondsCount() == 0)
-        if (liv_pos == stage.parch_pos)
-            return COLL_T::PARCH;
+    UI64 count = ((UI64)st.st_size - journal_end) / sizeof(SCOS);
+    if (count == 0) return;
 
-    return COLL_T::NONE;
-}
+    std::vector<SCOS> entries(count);
+    if (pread(fd, &entries[0], count * sizeof(SCOS), journal_end) != (ssize_t)(count * sizeof(SCOS)))
+        throw FILEEXP(SCORES_FILE, "input");
+
+    for (UI32 i = 0; i < entries.size(); i++)
+    {
+        entries[i].player_name[NICKNAME_DEFAULT_LENGTH - 1] = '\0';
+        Raise(entries[i].player_name, entries[i].player_score, false);
+    }
 
+    journal_end += count * sizeof(SCOS);
+}
 
 /**
- *  PUBLIC MEMBER FUNCTION Engine::NewMove
- *  @brief  It moves a creature to a new position according to the key provided,
- *          only if  no wall collisions occur!
- *  @param  creature: The creature to be moved.
- *  @param  key: Value representing the direction of movement.
+ *  PRIVATE MEMBER FUNCTION HighScore::Compact
+ *  @brief  Rewrites the file with one record per player, once the superseded
+ *          records outnumber the live ones. Only a game that can lock the file
+ *          for itself right away compacts it; should any other game be reading
+ *          or appending, the file is left for the next save.
  */
-void Engine::NewMove(Living* creature, I32 key)
+void HighScore::Compact(void)
 {
-    POS mvpos = creature->CurPos();
-
-    switch(key)
-    {
-        case KEY_UP:
-        mvpos.y--;
-        if ((CheckMapCollision(mvpos)) != COLL_T::WALL)
-            creature->MoveUp();
+    if (journal_end / sizeof(SCOS) <= 2 * records.size() + SCORES_COMPACT_SLACK) return;
 
-        break;
+    int fd = open(SCORES_FILE, O_RDONLY);
+    if (fd < 0) return;
 
-        case KEY_DOWN:
-        mvpos.y++;
-        if ((CheckMapCollision(mvpos)) != COLL_T::WALL)
-            creature->MoveDown();
+    struct stat held, named;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &held) != 0 || stat(SCORES_FILE, &named) != 0 ||
+        held.st_dev != named.st_dev || held.st_ino != named.st_ino)
+    {
+        close(fd);
+        return;
+    }
 
-        break;
+    try { ReadJournal(fd); }
+    catch(FILEEXP& exp)
+    {
+        close(fd);
+        throw;
+    }
 
-        case KEY_LEFT:
-        mvpos.x--;
-        if ((CheckMapCollision(mvpos)) != COLL_T::WALL)
-            creature->MoveLeft();
+    // Appends wait on the lock of the old file and find the new one under its name
+    int new_fd = open(SCORES_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC, held.st_mode & 0777);
+    if (new_fd < 0)
+    {
+        close(fd);
+        return;
+    }
 
-        break;
+    ssize_t size = records.size() * sizeof(SCOS);
+    bool written = write(new_fd, records.data(), size) == size && fsync(new_fd) == 0;
 
-        case KEY_RIGHT:
-        mvpos.x++;
-        if ((CheckMapCollision(mvpos)) != COLL_T::WALL)
-            creature->MoveRight();
+    if (close(new_fd) != 0 || !written || rename(SCORES_FILE ".new", SCORES_FILE) != 0)
+    {
+        unlink(SCORES_FILE ".new");
+        close(fd);
+        throw FILEEXP(SCORES_FILE, "output");
+    }
 
-        break;
+    if (stat(SCORES_FILE, &named) == 0)
+    {
+        journal_dev = named.st_dev;
+        journal_ino = named.st_ino;
+        journal_end = size;
     }
+
+    close(fd);
 }
 
+/* CLASS HIGHSCORE PUBLIC MEMBER DEFINITIONS */
 /**
- *  PUBLIC MEMBER FUNCTION Engine::NewSmartMove
- *  @brief  This may be the trickiest function of all! It decides the movement of a monster
- *          smartly enough to be able to track Harry's position. If you don't understand
- *          it's logic, be glad it works!!!
- *  @param  creature: The creature to be moved.
- */
-void Engine::NewSmartMove(Monster* creature)
-{
-
-    COLL_T collision;
-    bool monster_moved = false;
+ *  PUBLIC MEMBER FUNCTION HighScore::InitTable
+ *  @brief      Initiates the high score table of the game retrieving the
+ *              data from the file specified within the corresponding class
+ *              of the function. Only the records appended since the table was
+ *              last read are read, and scores not saved yet are kept.
+ */
+void HighScore::InitTable(void)
+{
+    int fd = OpenJournal(O_RDONLY, "input");
 
-    POS toup = { (UI8)(creature->CurX()),
-                 (UI8)(creature->CurY() - 1) };
-    POS toright = { (UI8)(creature->CurX() + 1),
-                    (UI8)(creature->CurY()) };
-    POS todown = { (UI8)(creature->CurX()),
-                   (UI8)(creature->CurY() + 1) };
-    POS toleft = { (UI8)(creature->CurX() - 1),
-                   (UI8)(creature->CurY()) };
+    try { ReadJournal(fd); }
+    catch(FILEEXP& exp)
+    {
+        close(fd);
+        throw;
+    }
 
-    if (thres > 0)
-    {   // Level 1
-        creature->CalculateShortest(player.CurPos());
+    close(fd);
+}
 
-        if (((collision = CheckMapCollision(toup)) != COLL_T::WALL) && (creature->move_map[toup.y][toup.x] == 0))
-        {
-            if (creature->Moves(UP))
-                {
-                    creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                    creature->PrevPos(creature->CurPos());
-                    creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                    creature->MoveUp();
-                    thres--;
-                    monster_moved = true;
-                }
-        }
+/**
+ *  PUBLIC MEMBER FUNCTION HighScore::SaveTable
+ *  @brief      Appends the scores that changed since the table was last saved
+ *              to the file specified within the corresponding class of the
+ *              function, with a single write, and compacts the file if it has
+ *              grown enough.
+ */
+void HighScore::SaveTable(void)
+{
+    if (pending.empty()) return;
 
-        if (((collision = CheckMapCollision(toright)) != COLL_T::WALL) && (creature->move_map[toright.y][toright.x] == 0))
-        {
-            if (creature->Moves(RIGHT) && !monster_moved)
-                {
-                    creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                    creature->PrevPos(creature->CurPos());
-                    creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                    creature->MoveRight();
-                    thres--;
-                    monster_moved = true;
-                }
-        }
+    std::vector<SCOS> entries;
+    entries.reserve(pending.size());
+    for (UI32 i = 0; i < pending.size(); i++)
+        entries.push_back(records[pending[i]]);
 
-        if (((collision = CheckMapCollision(toleft)) != COLL_T::WALL) && (creature->move_map[toleft.y][toleft.x] == 0))
-        {
-            if (creature->Moves(LEFT) && !monster_moved)
-                {
-                    creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                    creature->PrevPos(creature->CurPos());
-                    creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                    creature->MoveLeft();
-                    thres--;
-                    monster_moved = true;
-                }
-        }
+    int fd = OpenJournal(O_WRONLY | O_APPEND | O_CREAT, "output");
 
-        if (((collision = CheckMapCollision(todown)) != COLL_T::WALL) && (creature->move_map[todown.y][todown.x] == 0))
-        {
-            if (creature->Moves(DOWN) && !monster_moved)
-                {
-                    creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                    creature->PrevPos(creature->CurPos());
-                    creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                    creature->MoveDown();
-                    thres--;
-                    monster_moved = true;
-                }
-        }
+    ssize_t written;
+    while ((written = write(fd, entries.data(), entries.size() * sizeof(SCOS))) < 0 && errno == EINTR);
 
-        creature->ResetMoves();
-    }   // Level 1
+    if (close(fd) != 0 || written != (ssize_t)(entries.size() * sizeof(SCOS)))
+        throw FILEEXP(SCORES_FILE, "output");
 
-    if (!monster_moved && thres > 0)
-    {   // Level 2
-        if (((collision = CheckMapCollision(toup)) != COLL_T::WALL) && (creature->move_map[toup.y][toup.x] == 0))
-        {
-            creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-            creature->PrevPos(creature->CurPos());
-            creature->move_map[creature->CurY()][creature->CurX()] = 1;
-            creature->MoveUp();
-            monster_moved = true;
-        }
+    for (UI32 i = 0; i < pending.size(); i++)
+        is_pending[pending[i]] = 0;
+    pending.clear();
 
-        if (((collision = CheckMapCollision(toright)) != COLL_T::WALL) && (creature->move_map[toright.y][toright.x] == 0))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveRight();
-                monster_moved = true;
-            }
-        }
+    Compact();
+}
 
-        if (((collision = CheckMapCollision(todown)) != COLL_T::WALL) && (creature->move_map[todown.y][todown.x] == 0))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveDown();
-                monster_moved = true;
-            }
-        }
+/**
+ *  PUBLIC MEMBER FUNCTION HighScore::EmptyTable
+ *  @brief      Forgets the table, so that the next InitTable reads it again.
+ *              Records not saved yet are lost.
+ */
+void HighScore::EmptyTable(void)
+{
+    records.clear();
+    pending.clear();
+    is_pending.clear();
+    index.clear();
+    ranking.clear();
+    journal_dev = journal_ino = journal_end = 0;
+}
 
-        if (((collision = CheckMapCollision(toleft)) != COLL_T::WALL) && (creature->move_map[toleft.y][toleft.x] == 0))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveLeft();
-                monster_moved = true;
-            }
-        }
-    }   // Level 2
+/**
+ *  PUBLIC MEMBER FUNCTION HighScore::Rank
+ *  @brief      Returns the place of a player on the table.
+ *  @param      name: The name of the player.
+ *  @return     The place, counting from 1, or 0 if the player is not on it.
+ */
+UI32 HighScore::Rank(const std::string& name) const
+{
+    std::unordered_map<std::string, UI32>::const_iterator existance = index.find(name);
+    if (existance == index.end()) return 0;
 
-    if (!monster_moved)
-    {   // Level 3
-        if (((collision = CheckMapCollision(todown)) != COLL_T::WALL))
-        {
-            creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-            creature->PrevPos(creature->CurPos());
-            creature->move_map[creature->CurY()][creature->CurX()] = 1;
-            creature->MoveDown();
-            monster_moved = true;
-        }
+    return ranking.order_of_key(Key(existance->second)) + 1;
+}
 
-        if (((collision = CheckMapCollision(toleft)) != COLL_T::WALL))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveLeft();
-                monster_moved = true;
-            }
-        }
+/**
+ *  PUBLIC MEMBER FUNCTION HighScore::Top
+ *  @brief      Returns the best records of the table, best first.
+ *  @param      count: How many records to return at most.
+ */
+std::vector<SCOS> HighScore::Top(UI32 count) const
+{
+    std::vector<SCOS> top;
+    top.reserve(std::min<size_t>(count, records.size()));
 
-        if (((collision = CheckMapCollision(toright)) != COLL_T::WALL))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveRight();
-                monster_moved = true;
-            }
-        }
+    for (RANKING::const_iterator it = ranking.begin(); it != ranking.end() && top.size() < count; it++)
+        top.push_back(records[(UI32)*it]);
 
-        if (((collision = CheckMapCollision(toup)) != COLL_T::WALL))
-        {
-            if (!monster_moved)
-            {
-                creature->move_map[creature->PrevY()][creature->PrevX()]  = 0;
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()] = 1;
-                creature->MoveUp();
-                monster_moved = true;
-            }
-        }
+    return top;
+}
 
-        if (!thres) thres = MONSTER_MAP_THRESSHOLD;  // The higher the thresshold is set, the longest the gnome maps Harry!
-    }   // Level 3
-}   // Engine::NewSmartMove
+#ifndef MAZEGRAPH_H_INCLUDED
+#define MAZEGRAPH_H_INCLUDED
 
 /**
- *  PUBLIC MEMBER FUNCTION Engine::NewDummyMove
- *  @brief  This function is used to move a Monster randomly. The algorithm
- *          does not allow the creature to get stuck in one route.
- *  @param  creature: The creature to be moved.
+ *  CLASS: MazeGraph
+ *  @brief      MazeGraph is the maze compressed into a graph. Its nodes are the
+ *              junctions and the dead ends of the maze. Its edges are the
+ *              corridors between them, weighted by their length. Every corridor
+ *              cell knows its edge, how far along the edge it lies and which way
+ *              leads to either end, so a path over the graph maps straight back to
+ *              moves on the grid. The graph never changes during a level; search
+ *              results are kept by the caller, so one graph serves any number of
+ *              searches.
  */
-void Engine::NewDummyMove(Monster* creature)
+class MazeGraph
 {
+    friend class MapCache;
+
+    public:
+    static const UI32 UNREACHABLE = 0xFFFFFFFF;
+
+    MazeGraph() : free_cells(0), node_count(0)
+    {}
+
+    void Build(const Grid<I8>&);
+    void Clear(void);
 
-    COLL_T collision;
-    bool monster_moved = false;
+    UI32 NodeCount(void)    const   { return node_count; }
+    UI32 EdgeCount(void)    const   { return edges.size(); }
+    UI32 FreeCells(void)    const   { return free_cells; }
+    bool Compact(void)      const   { return (UI64)NodeCount() * MAZEGRAPH_MIN_GAIN <= free_cells; }
 
-    POS toup = { (UI8)(creature->CurX()),
-                 (UI8)(creature->CurY() - 1) };
-    POS toright = { (UI8)(creature->CurX() + 1),
-                    (UI8)(creature->CurY()) };
-    POS todown = { (UI8)(creature->CurX()),
-                   (UI8)(creature->CurY() + 1) };
-    POS toleft = { (UI8)(creature->CurX() - 1),
-                   (UI8)(creature->CurY()) };
+    void Search(POS, std::vector<UI32>&) const;
+    UI32 Distance(POS, POS, const std::vector<UI32>&) const;
+    UI8 NextStep(POS, POS, const std::vector<UI32>&) const;
+
+    private:
+    static const UI32 NODE_FLAG = 0x80000000;
+    static const UI32 NO_REF = 0xFFFFFFFF;
 
-    if (1)
+    typedef struct edge_struct
     {
-        if (((collision = CheckMapCollision(toup)) != COLL_T::WALL) && (creature->move_map[toup.y][toup.x] < creature->move_map[todown.y][todown.x]))
-        {
-            creature->PrevPos(creature->CurPos());
-            creature->move_map[creature->CurY()][creature->CurX()]++;
-            creature->MoveUp();
-            monster_moved = true;
-        }
+        UI32 a, b;          // The nodes at the two ends
+        UI32 length;        // Steps from a to b
+        UI8 dir_a, dir_b;   // The direction to take from a (and from b) to enter the corridor
+    }   EDGE;
+
+    UI32 free_cells;
+    UI32 node_count;
+    std::vector<UI32> nodes;        // Cell index of every node
+    std::vector<UI32> adj_start;    // Edges of node n are adj[adj_start[n]] to adj[adj_start[n + 1]]
+    std::vector<UI32> adj;
+    std::vector<EDGE> edges;
+
+    Grid<UI32> cell_ref;    // Node id | NODE_FLAG, edge id, or NO_REF for walls
+    Grid<UI32> cell_offset; // Steps from the 'a' end of the edge
+    Grid<UI8> cell_dirs;    // Low nibble: direction towards 'a', high nibble: towards 'b'
+
+    void Walk(UI32, UI8);
+    UI32 Cost(UI32, UI32, UI32, const std::vector<UI32>&, UI8*) const;
+};
 
-        if (((collision = CheckMapCollision(todown)) != COLL_T::WALL) && (creature->move_map[todown.y][todown.x] < creature->move_map[toup.y][toup.x]))
-        {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveDown();
-                monster_moved = true;
-            }
-        }
+#endif // MAZEGRAPH_H_INCLUDED
 
-        if (((collision = CheckMapCollision(toright)) != COLL_T::WALL) && (creature->move_map[toright.y][toright.x] < creature->move_map[toleft.y][toleft.x]))
-        {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveRight();
-                monster_moved = true;
-            }
-        }
+/**
+ *  FUNCTION opposite_dir
+ *  @brief  Returns the direction bit opposite to the given one.
+ */
+inline UI8 opposite_dir(UI8 dir)
+{
+    return ((dir << 2) | (dir >> 2)) & 0x0F;
+}
 
-        if (((collision = CheckMapCollision(toleft)) != COLL_T::WALL) && (creature->move_map[toleft.y][toleft.x] < creature->move_map[toright.y][toright.x]))
-        {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveLeft();
-                monster_moved = true;
-            }
-        }
-    }   // Level 1
+const UI32 MazeGraph::UNREACHABLE;
+const UI32 MazeGraph::NODE_FLAG;
+const UI32 MazeGraph::NO_REF;
+
+/* CLASS MAZEGRAPH PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION MazeGraph::Walk
+ *  @brief  Follows the corridor leaving a node towards a direction until it
+ *          reaches a node, and records it as an edge. Corridors already walked
+ *          from their other end are skipped.
+ *  @param  from: The node the walk starts from.
+ *  @param  dir: The direction the corridor leaves the node to.
+ */
+void MazeGraph::Walk(UI32 from, UI8 dir)
+{
+    UI32 cell = cell_ref.Step(nodes[from], dir);
+    UI32 ref = cell_ref[cell];
+
+    if (ref == NO_REF) return;
+    if (!(ref & NODE_FLAG) && cell_offset[cell] != 0) return;   // Walked from the other end
+    if ((ref & NODE_FLAG) && (ref & ~NODE_FLAG) < from) return; // Adjacent nodes: one edge, made by the lower one
+
+    EDGE edge;
+    edge.a = from;
+    edge.dir_a = dir;
+
+    UI32 id = edges.size();
+    UI32 length = 1;
+    UI8 came = dir;
+
+    while (!(cell_ref[cell] & NODE_FLAG))
+    {   // A corridor cell has exactly two ways out: the way back and the way on
+        UI8 on = 0;
+        for (UI8 d = UP; d <= LEFT; d <<= 1)
+            if (d != opposite_dir(came) && cell_ref[cell_ref.Step(cell, d)] != NO_REF)
+                on = d;
+
+        cell_ref[cell] = id;
+        cell_offset[cell] = length;
+        cell_dirs[cell] = opposite_dir(came) | (on << 4);
+
+        cell = cell_ref.Step(cell, on);
+        came = on;
+        length++;
+    }
 
+    edge.b = cell_ref[cell] & ~NODE_FLAG;
+    edge.dir_b = opposite_dir(came);
+    edge.length = length;
+    edges.push_back(edge);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION MazeGraph::Cost
+ *  @brief  Returns the length of the shortest path to the target that leaves a
+ *          cell of an edge towards one of its ends, and its first direction.
+ *  @param  edge_id: The edge.
+ *  @param  offset: How far along the edge the cell lies (0 for node a, length for node b).
+ *  @param  target_ref: The cell_ref of the target; its offset follows in target_offset.
+ */
+UI32 MazeGraph::Cost(UI32 edge_id, UI32 offset, UI32 target_offset,
+                     const std::vector<UI32>& node_dist, UI8* dir) const
+{
+    // Towards a, then on from a; or towards b, then on from b
+    const EDGE& e = edges[edge_id];
+    UI32 best = UNREACHABLE;
 
-    if (!monster_moved)
+    if (offset > 0 && node_dist[e.a] != UNREACHABLE)
     {
-        if (((collision = CheckMapCollision(toup)) != COLL_T::WALL) && (creature->move_map[toup.y][toup.x] < creature->move_map[creature->PrevY()][creature->PrevX()]))
-        {
-            creature->PrevPos(creature->CurPos());
-            creature->move_map[creature->CurY()][creature->CurX()]++;
-            creature->MoveUp();
-            monster_moved = true;
-        }
+        best = offset + node_dist[e.a];
+        *dir = 0;
+    }
+    if (offset < e.length && node_dist[e.b] != UNREACHABLE && e.length - offset + node_dist[e.b] < best)
+    {
+        best = e.length - offset + node_dist[e.b];
+        *dir = 1;
+    }
 
-        if (((collision = CheckMapCollision(toright)) != COLL_T::WALL) && (creature->move_map[toright.y][toright.x] < creature->move_map[creature->PrevY()][creature->PrevX()]))
+    // Straight along the edge, if the target lies on it
+    if (target_offset != UNREACHABLE)
+    {
+        if (target_offset < offset && offset - target_offset < best)
         {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveRight();
-                monster_moved = true;
-            }
+            best = offset - target_offset;
+            *dir = 0;
         }
-
-        if (((collision = CheckMapCollision(todown)) != COLL_T::WALL) && (creature->move_map[todown.y][todown.x] < creature->move_map[creature->PrevY()][creature->PrevX()]))
+        if (target_offset > offset && target_offset - offset < best)
         {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveDown();
-                monster_moved = true;
-            }
+            best = target_offset - offset;
+            *dir = 1;
         }
+    }
 
-        if (((collision = CheckMapCollision(toleft)) != COLL_T::WALL) && (creature->move_map[toleft.y][toleft.x] < creature->move_map[creature->PrevY()][creature->PrevX()]))
-        {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveLeft();
-                monster_moved = true;
-            }
-        }
-    }   // Level 2
+    return best;
+}
 
-    if (!monster_moved)
-    {
-        if ((collision = CheckMapCollision(toup)) != COLL_T::WALL)
+/* CLASS MAZEGRAPH PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION MazeGraph::Build
+ *  @brief  Builds the graph of the given maze. Free cells with other than two
+ *          free neighbours become nodes; runs of cells with exactly two become
+ *          the edges between them. Loops with no junction at all get one node
+ *          of their own, so every free cell ends up in the graph.
+ *          The nodes are counted first: a maze that is not Compact gets no
+ *          graph at all, which spares the memory of the per-cell grids on
+ *          large open maps.
+ *  @param  map: The maze.
+ */
+void MazeGraph::Build(const Grid<I8>& map)
+{
+    Clear();
+    for (UI32 y = 0; y < map.Height(); y++)
+        for (UI32 x = 0; x < map.Width(); x++)
         {
-            creature->PrevPos(creature->CurPos());
-            creature->move_map[creature->CurY()][creature->CurX()]++;
-            creature->MoveUp();
-            monster_moved = true;
-        }
+            UI32 cell = map.Index(x, y);
+            if (map[cell] == '*') continue;
 
-        if ((collision = CheckMapCollision(toright)) != COLL_T::WALL)
-        {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveRight();
-                monster_moved = true;
-            }
+            free_cells++;
+            node_count += ((map[map.Up(cell)] != '*') + (map[map.Right(cell)] != '*') +
+                           (map[map.Down(cell)] != '*') + (map[map.Left(cell)] != '*')) != 2;
         }
 
-        if ((collision = CheckMapCollision(todown)) != COLL_T::WALL)
+    if (!Compact())
+        return;     // Not worth it: keep the counts only
+
+    nodes.reserve(node_count);
+    cell_ref.Reset(map.Width(), map.Height(), NO_REF);
+    cell_offset.Reset(map.Width(), map.Height(), 0);
+    cell_dirs.Reset(map.Width(), map.Height(), 0);
+    cell_ref.Fill(NO_REF);
+
+    for (UI32 y = 0; y < map.Height(); y++)
+        for (UI32 x = 0; x < map.Width(); x++)
         {
-            if (!monster_moved)
+            UI32 cell = map.Index(x, y);
+            if (map[cell] == '*') continue;
+
+            UI8 degree = (map[map.Up(cell)] != '*') + (map[map.Right(cell)] != '*') +
+                         (map[map.Down(cell)] != '*') + (map[map.Left(cell)] != '*');
+
+            if (degree != 2)
             {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveDown();
-                monster_moved = true;
+                cell_ref[cell] = nodes.size() | NODE_FLAG;
+                nodes.push_back(cell);
             }
+            else cell_ref[cell] = 0;    // Corridor, offset 0 until walked
         }
 
-        if ((collision = CheckMapCollision(toleft)) != COLL_T::WALL)
+    for (UI32 n = 0; n < nodes.size(); n++)
+        for (UI8 d = UP; d <= LEFT; d <<= 1)
+            Walk(n, d);
+
+    for (UI32 y = 0; y < map.Height(); y++)
+        for (UI32 x = 0; x < map.Width(); x++)
         {
-            if (!monster_moved)
-            {
-                creature->PrevPos(creature->CurPos());
-                creature->move_map[creature->CurY()][creature->CurX()]++;
-                creature->MoveLeft();
-                monster_moved = true;
-            }
+            UI32 cell = map.Index(x, y);
+            if (cell_ref[cell] == NO_REF || (cell_ref[cell] & NODE_FLAG) || cell_offset[cell] != 0)
+                continue;
+
+            // Left over corridor cell: a loop with no junction
+            UI32 n = nodes.size();
+            cell_ref[cell] = n | NODE_FLAG;
+            nodes.push_back(cell);
+
+            for (UI8 d = UP; d <= LEFT; d <<= 1)
+                if (map[map.Step(cell, d)] != '*')
+                {
+                    Walk(n, d);
+                    break;
+                }
         }
-    }   // Level 3
-}   // Engine::NewDummyMove
 
-#ifndef GAMEPLAY_H_INCLUDED
-#define GAMEPLAY_H_INCLUDED
+    node_count = nodes.size();
+
+    // Adjacency lists, in one array
+    adj_start.assign(nodes.size() + 1, 0);
+    for (UI32 e = 0; e < edges.size(); e++)
+    {
+        adj_start[edges[e].a + 1]++;
+        if (edges[e].b != edges[e].a) adj_start[edges[e].b + 1]++;
+    }
+    for (UI32 n = 0; n < nodes.size(); n++)
+        adj_start[n + 1] += adj_start[n];
+
+    std::vector<UI32> fill(adj_start.begin(), adj_start.end() - 1);
+    adj.resize(adj_start.back());
+    for (UI32 e = 0; e < edges.size(); e++)
+    {
+        adj[fill[edges[e].a]++] = e;
+        if (edges[e].b != edges[e].a) adj[fill[edges[e].b]++] = e;
+    }
+}   // MazeGraph::Build
 
 /**
- *  CLASS: Gameplay
- *  @brief      Gameplay is the class that represents the visual aspects
- *              of the game. Its instances hold every window and subwindow
- *              (ncurses' terminology) that is shown to the screen and control
- *              every interactive way of communication with the player.
- */
-class Gameplay
+ *  PUBLIC MEMBER FUNCTION MazeGraph::Clear
+ *  @brief  Releases the graph.
+ */
+void MazeGraph::Clear(void)
 {
-    public:
-    Gameplay() : stage_offset(COLS / 2), score_offset(1), debug_offset(LINES - 3)
-    {}
+    free_cells = 0;
+    node_count = 0;
+    nodes.clear();
+    adj_start.clear();
+    adj.clear();
+    edges.clear();
+    cell_ref.Clear();
+    cell_offset.Clear();
+    cell_dirs.Clear();
+}
 
-    typedef struct win_exc
-    {   // Used as an exceptiom to be thrown in case a window function goes bad
-        std::string message;
-        win_exc(std::string arg): message(arg) {}
-    } WINEXP;
+/**
+ *  PUBLIC MEMBER FUNCTION MazeGraph::Search
+ *  @brief  Works out the distance of every node to the target cell. The target
+ *          is joined to the graph through the two ends of its corridor, then a
+ *          Dijkstra search runs over the nodes alone.
+ *  @param  target: The cell every distance is measured to.
+ *  @param  node_dist: Receives the distance of every node.
+ */
+void MazeGraph::Search(POS target, std::vector<UI32>& node_dist) const
+{
+    typedef std::pair<UI32, UI32> ENTRY;  // Distance, node
+    std::priority_queue<ENTRY, std::vector<ENTRY>, std::greater<ENTRY> > heap;
 
-    void InitDebugWin(void);
-    void InitInfoBar(const std::string&);
-    void InitStageWin(void);
-    void InitPlayerWin(void);
-    void InitGnomeWin(void);
-    void InitTraalWin(void);
-    void InitLevel(const std::vector<I8*>);
-    void EndLevel(void);
-    void DrawMenu(UI8);
-    void DrawParch(POS);
-    void DrawScore(UI32);
-    void DrawHighScores(const std::vector<SCOS>&);
+    node_dist.assign(nodes.size(), UNREACHABLE);
 
-    const WINDOW* Stage(void)   const   { return stage_win; }
-    const WINDOW* Map(void)     const   { return map_win; }
-    const WINDOW* Player(void)  const   { return player_win; }
-    const WINDOW* Gnome(void)   const   { return gnome_win; }
-    const WINDOW* Traal(void)   const   { return traal_win; }
-    const WINDOW* Debug(void)   const   { return debug_win; }
-    const WINDOW* InfoBar(void) const   { return info_win; }
-    const WINDOW* Score(void)   const   { return score_win; }
+    if (target.x >= cell_ref.Width() || target.y >= cell_ref.Height())
+        return;
 
-    WINDOW* Stage(void)     { return stage_win; }
-    WINDOW* Map(void)       { return map_win; }
-    WINDOW* Player(void)    { return player_win; }
-    WINDOW* Gnome(void)     { return gnome_win; }
-    WINDOW* Traal(void)     { return traal_win; }
-    WINDOW* Debug(void)     { return debug_win; }
-    WINDOW* InfoBar(void)   { return info_win; }
-    WINDOW* Score(void)     { return score_win; }
+    UI32 ref = cell_ref(target.x, target.y);
+    if (ref == NO_REF) return;
 
-    void MoveWin(WINDOW*, POS);
-    void ShowWin (WINDOW*) const;
+    if (ref & NODE_FLAG)
+    {
+        node_dist[ref & ~NODE_FLAG] = 0;
+        heap.push(ENTRY(0, ref & ~NODE_FLAG));
+    }
+    else
+    {
+        const EDGE& e = edges[ref];
+        UI32 k = cell_offset(target.x, target.y);
 
-    void ColorFlashWin(WINDOW*, UI32);
-    void FlashToggleWin(WINDOW*, WINDOW*, UI32);
+        node_dist[e.a] = k;
+        node_dist[e.b] = std::min(node_dist[e.b], e.length - k);
+        heap.push(ENTRY(node_dist[e.a], e.a));
+        heap.push(ENTRY(node_dist[e.b], e.b));
+    }
 
-    I32 GetPlayerInput(void);
-    void Pause(bool);
-    bool Pause(void) const { return isPaused; }
+    while (!heap.empty())
+    {
+        ENTRY top = heap.top();
+        heap.pop();
+        if (top.first != node_dist[top.second]) continue;
 
-    void DiamondEaten(POS);
+        for (UI32 i = adj_start[top.second]; i < adj_start[top.second + 1]; i++)
+        {
+            const EDGE& e = edges[adj[i]];
+            UI32 other = e.a == top.second ? e.b : e.a;
+            UI32 d = top.first + e.length;
 
-    private:
-    WINDOW* stage_win;
-    WINDOW* map_win;
-    WINDOW* info_win;
-    WINDOW* score_win;
-    WINDOW* player_win;
-    WINDOW* gnome_win;
-    WINDOW* traal_win;
-    WINDOW* debug_win;
+            if (d < node_dist[other])
+            {
+                node_dist[other] = d;
+                heap.push(ENTRY(d, other));
+            }
+        }
+    }
+}   // MazeGraph::Search
 
-    UI8 stage_offset;
-    UI8 score_offset;
-    UI8 debug_offset;
-    bool isPaused;
+/**
+ *  PUBLIC MEMBER FUNCTION MazeGraph::NextStep
+ *  @brief  Returns the direction of the first step of a shortest path from a
+ *          cell to the target of the last search, or 0 if there is none.
+ *  @param  from: The cell the path starts from.
+ *  @param  target: The target the search was made for.
+ *  @param  node_dist: The result of that search.
+ */
+UI8 MazeGraph::NextStep(POS from, POS target, const std::vector<UI32>& node_dist) const
+{
+    if (from.x >= cell_ref.Width() || from.y >= cell_ref.Height() ||
+        target.x >= cell_ref.Width() || target.y >= cell_ref.Height() ||
+        from == target)
+        return 0;
+
+    UI32 ref = cell_ref(from.x, from.y);
+    UI32 target_ref = cell_ref(target.x, target.y);
+    if (ref == NO_REF || target_ref == NO_REF) return 0;
+
+    UI32 best = UNREACHABLE;
+    UI8 dir = 0, end = 0;
+
+    if (!(ref & NODE_FLAG))
+    {   // In a corridor: one way or the other
+        UI32 target_offset = target_ref == ref ? cell_offset(target.x, target.y) : UNREACHABLE;
+        if (Cost(ref, cell_offset(from.x, from.y), target_offset, node_dist, &end) == UNREACHABLE)
+            return 0;
+
+        UI8 dirs = cell_dirs(from.x, from.y);
+        return end == 0 ? dirs & 0x0F : dirs >> 4;
+    }
 
-    const static std::string menu_items[MENU_ITEMS_COUNT];
+    UI32 node = ref & ~NODE_FLAG;
+    for (UI32 i = adj_start[node]; i < adj_start[node + 1]; i++)
+    {   // On a node: the cheapest of its corridors, entered from either end
+        const EDGE& e = edges[adj[i]];
+        UI32 target_offset = target_ref == adj[i] ? cell_offset(target.x, target.y) : UNREACHABLE;
 
-    void InitMapWin(UI8, UI8);
-};
-
-#endif // GAMEPLAY_H_INCLUDED
+        if (e.a == node)
+        {
+            UI32 cost = Cost(adj[i], 0, target_offset, node_dist, &end);
+            if (cost < best && end == 1) { best = cost; dir = e.dir_a; }
+        }
+        if (e.b == node)
+        {
+            UI32 cost = Cost(adj[i], e.length, target_offset, node_dist, &end);
+            if (cost < best && end == 0) { best = cost; dir = e.dir_b; }
+        }
+    }
 
-const std::string Gameplay::menu_items[MENU_ITEMS_COUNT] = // Main menu options
-    {"Play game", "Show High Score Table", "Quit"};
+    return dir;
+}   // MazeGraph::NextStep
 
-/* CLASS GAMEPLAY PRIVATE MEMBER FUNCTIONS */
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitMapWin
- *  @brief  Initialises the map window according to the width and height passed
- *          as arguments. Map window is stage's derivative window. Map window
- *          holds the visual part of the game's maze.
- *  @param  height: The height of the map window.
- *  @param  width: The width of the map window.
+ *  PUBLIC MEMBER FUNCTION MazeGraph::Distance
+ *  @brief  Returns the length of the shortest path from a cell to the target
+ *          of the last search, or UNREACHABLE.
  */
-void Gameplay::InitMapWin(UI8 height, UI8 width)
+UI32 MazeGraph::Distance(POS from, POS target, const std::vector<UI32>& node_dist) const
 {
-    stage_offset = (COLS - width) / 2;
-    if ((map_win = derwin(stage_win, height, width, 0, stage_offset)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: map_win");
+    if (from.x >= cell_ref.Width() || from.y >= cell_ref.Height() ||
+        target.x >= cell_ref.Width() || target.y >= cell_ref.Height())
+        return UNREACHABLE;
+
+    UI32 ref = cell_ref(from.x, from.y);
+    UI32 target_ref = cell_ref(target.x, target.y);
+    if (ref == NO_REF || target_ref == NO_REF) return UNREACHABLE;
+    if (from == target) return 0;
+    if (ref & NODE_FLAG) return node_dist[ref & ~NODE_FLAG];
+
+    UI8 end = 0;
+    UI32 target_offset = target_ref == ref ? cell_offset(target.x, target.y) : UNREACHABLE;
+    return Cost(ref, cell_offset(from.x, from.y), target_offset, node_dist, &end);
 }
 
-/* CLASS GAMEPLAY PUBLIC MEMBER FUNCTIONS */
+#ifndef MAPFILE_H_INCLUDED
+#define MAPFILE_H_INCLUDED
+
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitStageWin
- *  @brief  Initialises the stage window. The maze, the living creatures and some
- *          game messages are hosted in the stage window.
+ *  CLASS: MapFile
+ *  @brief      MapFile maps a whole file in memory, read only, for as long as the
+ *              object lives. The pages are read in by the kernel as they are first
+ *              touched, so a map file is parsed straight from the page cache with
+ *              no copy and no stream call per line.
  */
-void Gameplay::InitStageWin(void)
+class MapFile
 {
-    if ((stage_win = newwin(LINES - 3, COLS - 1, score_offset, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: stage_win");
+    public:
+    MapFile() : data(NULL), size(0)
+    {}
+    ~MapFile()  { Close(); }
 
-    keypad(stage_win, TRUE);
-    nodelay(stage_win, TRUE);
+    bool Open(const std::string&);
+    void Close(void);
+
+    const char* Data(void)  const   { return data ? data : ""; }
+    size_t Size(void)       const   { return size; }
+
+    private:
+    MapFile(const MapFile&);
+    MapFile& operator = (const MapFile&);
+
+    char* data;
+    size_t size;
+};
+
+#endif // MAPFILE_H_INCLUDED
+
+/* CLASS MAPFILE PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION MapFile::Open
+ *  @brief  Maps the given file, unmapping the previous one.
+ *  @param  filename: The file to map.
+ *  @return False if the file could not be opened or mapped.
+ */
+bool MapFile::Open(const std::string& filename)
+{
+    Close();
+
+    I32 fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    size = info.st_size;
+    if (size > 0)
+    {
+        void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            close(fd);
+            size = 0;
+            return false;
+        }
+
+        data = (char*)addr;
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+    return true;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitPlayerWin
- *  @brief  Initialises the main player window. Player window is a 1X1 window
- *          that is assigned the letter H (stands for Harry). It visually re=
- *          presents Harry in the maze.
+ *  PUBLIC MEMBER FUNCTION MapFile::Close
+ *  @brief  Unmaps the file.
  */
-void Gameplay::InitPlayerWin(void)
+void MapFile::Close(void)
 {
-    if ((player_win = newwin(1, 1, 0, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: player_win");
+    if (data) munmap(data, size);
 
-    waddch(player_win, 'H');
-    wbkgd(player_win, COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK));
+    data = NULL;
+    size = 0;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitGnomeWin
- *  @brief  Initialises the gnome window. Gnome window is a 1X1 window
- *          that is assigned the letter G (stands for Gnome). It visually
- *          represents Gnome monster in the maze.
+ *  FUNCTION scan_map_row
+ *  @brief  Finds the first character of a row of a map that is not a wall, a
+ *          space or a monster ('*', ' ', 'G' or 'T'). With SSE2 (or AVX2) the
+ *          row is checked 16 (or 32) characters at a time: every character is
+ *          compared to the four valid ones at once and the comparison masks give
+ *          the position of the first invalid one.
+ *  @param  row: The characters of the row.
+ *  @param  length: How many characters to check.
+ *  @param  monsters: Set to true if the row holds a monster before the first
+ *                    invalid character.
+ *  @return The position of the first invalid character, or length.
  */
-void Gameplay::InitGnomeWin(void)
+size_t scan_map_row(const char* row, size_t length, bool* monsters)
 {
-    if ((gnome_win = newwin(1, 1, 0, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: gnome_win");
+    size_t i = 0;
+    *monsters = false;
+
+#ifdef __AVX2__
+    const __m256i wall32 = _mm256_set1_epi8('*'), space32 = _mm256_set1_epi8(' ');
+    const __m256i gnome32 = _mm256_set1_epi8('G'), traal32 = _mm256_set1_epi8('T');
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i mons = _mm256_or_si256(_mm256_cmpeq_epi8(v, gnome32), _mm256_cmpeq_epi8(v, traal32));
+        __m256i ok = _mm256_or_si256(mons, _mm256_or_si256(_mm256_cmpeq_epi8(v, wall32),
+                                                           _mm256_cmpeq_epi8(v, space32)));
+
+        UI32 bad = ~(UI32)_mm256_movemask_epi8(ok);
+        if (bad) return i + __builtin_ctz(bad);
+        if (_mm256_movemask_epi8(mons)) *monsters = true;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i wall = _mm_set1_epi8('*'), space = _mm_set1_epi8(' ');
+    const __m128i gnome = _mm_set1_epi8('G'), traal = _mm_set1_epi8('T');
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i mons = _mm_or_si128(_mm_cmpeq_epi8(v, gnome), _mm_cmpeq_epi8(v, traal));
+        __m128i ok = _mm_or_si128(mons, _mm_or_si128(_mm_cmpeq_epi8(v, wall),
+                                                     _mm_cmpeq_epi8(v, space)));
+
+        UI32 bad = ~(UI32)_mm_movemask_epi8(ok) & 0xFFFF;
+        if (bad) return i + __builtin_ctz(bad);
+        if (_mm_movemask_epi8(mons)) *monsters = true;
+    }
+#endif
+
+    for (; i < length; i++)
+    {
+        if (row[i] == 'G' || row[i] == 'T')     *monsters = true;
+        else if (row[i] != '*' && row[i] != ' ') break;
+    }
 
-    waddch(gnome_win, 'G');
-    wbkgd(gnome_win, COLOR_PAIR(COLOR_PAIR_BLACK_RED));
+    return i;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitTraalWin
- *  @brief  Initialises the traal window. Traal window is a 1X1 window
- *          that is assigned the letter T (stands for Traal). It visually
- *          represents Traal monster in the maze.
+ *  FUNCTION collect_free_cells
+ *  @brief  Appends the grid index of every free cell (' ') of a row of a map
+ *          to an array. With SSE2 the row is compared 16 characters at a time
+ *          and only the free ones found in the comparison mask are visited.
+ *  @param  row: The characters of the row.
+ *  @param  width: The width of the row.
+ *  @param  y: The number of the row.
+ *  @param  map: The grid the row belongs to.
+ *  @param  cells: Receives the indices.
  */
-void Gameplay::InitTraalWin(void)
+void collect_free_cells(const char* row, size_t width, UI32 y, const Grid<I8>& map, std::vector<UI32>& cells)
 {
-    if ((traal_win = newwin(1, 1, 0, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: traal_win");
+    size_t x = 0;
+
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for (; x + 16 <= width; x += 16)
+    {
+        UI32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x)), space));
+
+        for (; mask; mask &= mask - 1)
+            cells.push_back(map.Index(x + __builtin_ctz(mask), y));
+    }
+#endif
 
-    waddch(traal_win, 'T');
-    wbkgd(traal_win, COLOR_PAIR(COLOR_PAIR_BLACK_RED));
+    for (; x < width; x++)
+        if (row[x] == ' ')
+            cells.push_back(map.Index(x, y));
 }
 
+#ifndef MAZE_H_INCLUDED
+#define MAZE_H_INCLUDED
+
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitLevel
- *  @brief  Performs the necessary actions to set up the screen for a new level.
- *  @param  map: The data retrieved to draw the maze.
+ *  CLASS: Maze
+ *  @brief      Maze is everything a Stage works out from the text of a map before
+ *              the diamonds are placed: the maze grid, the monster spawns, the
+ *              free cells, the wall and move bitsets and the junction graph. None
+ *              of it changes during a level, so the stages playing the same map
+ *              share one Maze and only keep what does change of their own.
  */
-void Gameplay::InitLevel(const std::vector<I8*> _map)
+class Maze
 {
-    UI8 map_height = _map.size();
-    UI8 map_width  = ((std::string)_map[0]).length();
+    friend class MapCache;
 
-    InitMapWin(map_height, map_width);
+    public:
+    Maze() : map_w(0), map_h(0)
+    {}
+
+    COORD Height(void)          const   { return map_h; }
+    COORD Width(void)           const   { return map_w; }
+    const Grid<I8>& Map()       const   { return map; }
+    const MapBits& Bits()       const   { return bits; }
+    const MazeGraph& Graph()    const   { return graph; }
+
+    UI32 FreeCount(void)        const   { return free_cells.size(); }
+    UI32 FreeCell(UI32 i)       const   { return free_cells[i]; }
 
-    for (UI8 i = 0; i < map_height; i++)
+    UI32 SpawnCount(void)       const   { return spawn_pos.size(); }
+    POS SpawnPos(UI32 i)        const   { return spawn_pos[i]; }
+    MONST_T SpawnKind(UI32 i)   const   { return (MONST_T)spawn_kind[i]; }
+
+    void Build(const char*, size_t);
+    void Clear(void);
+
+    private:
+    Maze(const Maze&);
+    Maze& operator = (const Maze&);
+
+    COORD map_w, map_h;
+    std::vector<POS> spawn_pos;     // Monsters declared by the map file
+    std::vector<UI8> spawn_kind;
+    std::vector<UI32> free_cells;   // Every free cell of the bare maze, see Stage::TakeCell
+    Grid<I8> map;
+    MapBits bits;
+    MazeGraph graph;
+};
+
+#endif // MAZE_H_INCLUDED
+
+/* CLASS MAZE PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Maze::Build
+ *  @brief  Builds the maze from the text of a map. The first line
+ *          gives the width of the maze and every other line must be exactly as
+ *          wide. Lines hold walls ('*') and free cells (' '), and may place any
+ *          number of monsters with the letters G (gnome) and T (traal). A map
+ *          that places none gets one of each.
+ *          Each line is checked by scan_map_row and copied to the grid right
+ *          away, so the text is read only once. On any error, the exception
+ *          tells the row and the column and the maze is left empty.
+ *          The bitsets and the graph are built from the bare maze, which is
+ *          all they depend on, so a maze serves any number of stages.
+ *  @param  text: The text of the map.
+ *  @param  size: The length of the text.
+ */
+void Maze::Build(const char* text, size_t size)
+{
+    char error[128] = "";
+    bool monsters = false;
+
+    // Trailing empty lines are ignored
+    while (size > 0 && text[size - 1] == '\n')
+        size--;
+
+    size_t width = scan_map_row(text, size, &monsters);
+
+    if (width < size && text[width] != '\n')
+        snprintf(error, sizeof(error), isprint((UI8)text[width]) ? "Invalid character '%c' at row %u, column %u" :
+                                                                 "Invalid character (code %d) at row %u, column %u",
+                 text[width], 1, (UI32)width + 1);
+    else if (width == 0)
+        snprintf(error, sizeof(error), "The map is empty");
+    else if (width > COORD_MAX)
+        snprintf(error, sizeof(error), "The map is too wide (%u columns)", (UI32)width);
+    else if ((size + width) / (width + 1) > COORD_MAX)
+        snprintf(error, sizeof(error), "The map is too high");
+
+    if (error[0])
+        throw GENEXP(std::string("General error in Stage::Load:\n") + error);
+
+    // Every line but the last one ends with a new line character
+    size_t height = (size + width) / (width + 1);
+
+    spawn_pos.clear();
+    spawn_kind.clear();
+    free_cells.clear();
+    free_cells.reserve(width * height);     // Only the pages actually filled get used
+    map.Reset(width, height, '*');
+
+    for (size_t y = 0; y < height && !error[0]; y++)
     {
-        wmove(map_win, i, 0);
-        for (UI8 j = 0; j < map_width; j++)
+        const char* line = text + y * (width + 1);
+        size_t length = std::min(width, size - y * (width + 1));
+        size_t valid = scan_map_row(line, length, &monsters);
+
+        if (valid < length && line[valid] != '\n')
+            snprintf(error, sizeof(error), isprint((UI8)line[valid]) ? "Invalid character '%c' at row %u, column %u" :
+                                                                     "Invalid character (code %d) at row %u, column %u",
+                     line[valid], (UI32)y + 1, (UI32)valid + 1);
+        else if (valid < width)
+            snprintf(error, sizeof(error), "Row %u is %u characters wide instead of %u",
+                     (UI32)y + 1, (UI32)valid, (UI32)width);
+        else if (y + 1 < height ? line[width] != '\n' : y * (width + 1) + width != size)
+            snprintf(error, sizeof(error), "Row %u is wider than %u characters",
+                     (UI32)y + 1, (UI32)width);
+        if (error[0]) break;
+
+        // A row of the grid is spread over a row of tiles and is only contiguous
+        // up to the end of each tile (the border takes the first cell of the first one)
+        for (size_t x = 0, run; x < width; x += run)
         {
-            if (_map[i][j] == '.')
-                wattron(map_win, COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK));
-            waddch(map_win, _map[i][j]);
-
-            wstandend(map_win);
+            run = std::min<size_t>(GRID_TILE - (x + 1) % GRID_TILE, width - x);
+            memcpy(&map(x, y), line + x, run);
         }
+
+        collect_free_cells(line, width, y, map, free_cells);
+
+        if (!monsters) continue;
+
+        for (size_t x = 0; x < width; x++)
+            if (line[x] == 'G' || line[x] == 'T')
+            {
+                spawn_pos.push_back(POS(x, y));
+                spawn_kind.push_back(line[x] == 'G' ? SMART : DUMMY);
+                map(x, y) = ' ';
+            }
     }
-}   // Gameplay::InitLevel
+
+    if (error[0])
+    {
+        Clear();
+        throw GENEXP(std::string("General error in Stage::Load:\n") + error);
+    }
+
+    map_w = width;
+    map_h = height;
+
+    bits.Build(map);
+    graph.Build(map);
+}   // Maze::Build
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::EndLevel
- *  @brief  Clears the screen and ends the current level.
+ *  PUBLIC MEMBER FUNCTION Maze::Clear
+ *  @brief  Releases the maze.
  */
-void Gameplay::EndLevel(void)
+void Maze::Clear(void)
 {
-    wclear(stage_win);
-    wclear(map_win);
-    delwin(map_win);
+    map.Clear();
+    bits.Clear();
+    graph.Clear();
+    spawn_pos.clear();
+    spawn_kind.clear();
+    free_cells.clear();
+    free_cells.shrink_to_fit();
+    map_h = map_w = 0;
 }
 
-void Gameplay::InitDebugWin(void)
+#ifndef STAGE_H_INCLUDED
+#define STAGE_H_INCLUDED
+
+class MapCache;
+
+/**
+ *  CLASS: Stage
+ *  @brief      Stage is the main part of the game where all the living
+ *              creatures exist and react. Stage holds the maze and the
+ *              soulless objects. The maze is shared with every other stage
+ *              of the same map; the diamonds and the cells taken off the free
+ *              ones are the stage's own.
+ */
+class Stage
 {
-    debug_offset = LINES - 3;
-    if ((debug_win = newwin(3, COLS, debug_offset, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: debug_win");
+    friend class Engine;
+#ifdef BENCH
+    friend class Bench;
+#endif
 
-    wbkgd(debug_win, COLOR_PAIR(COLOR_PAIR_BLACK_BLUE));
-    scrollok(debug_win, TRUE);
-}
+    public:
+    Stage();
+
+    COORD MapHeight(void)   const       { return map_h; }
+    COORD MapWidth(void)    const       { return map_w; }
+    POS ParchPos(void)      const       { return parch_pos; }
+    UI32 DiamondsCount(void) const      { return diamonds_count; }
+    void DiamondsCount(UI32 _count)     { diamonds_count = _count; }
+
+    bool EraseDiamond(POS);
+    bool Diamond(UI32 x, UI32 y)    const
+    { return (diamonds[Bits().Word(x, y)] >> MapBits::Bit(x)) & 1; }
+    I8 Tile(UI32 x, UI32 y)         const   { return Diamond(x, y) ? '.' : Map()(x, y); }
+    void Seed(const Philox& _rng)       { rng = _rng; }
+    const Philox& Rng(void) const       { return rng; }
+
+    void Load(const std::string&);
+    void Load(std::istream&);
+    void Load(const MapCache&);
+    void Load(const std::shared_ptr<const Maze>&);
+    void Parse(const char*, size_t);
+    void Unload(void);
+    const Grid<I8>& Map() const { return maze->Map(); }
+    const MapBits& Bits() const { return maze->Bits(); }
+    const MazeGraph& Graph() const  { return maze->Graph(); }
+
+    UI32 FreeCount(void)        const   { return free_count; }
+    POS TakeCell(Philox&);
+
+    UI32 SpawnCount(void)       const   { return maze->SpawnCount(); }
+    POS SpawnPos(UI32 i)        const   { return maze->SpawnPos(i); }
+    MONST_T SpawnKind(UI32 i)   const   { return maze->SpawnKind(i); }
+
+    private:
+    COORD map_w, map_h;
+    UI32 diamonds_count;
+    POS parch_pos;
+    std::shared_ptr<const Maze> maze;
+    std::vector<UI64> diamonds;     // One bit per cell, laid out like the walls of the maze
+    UI32 free_count;                // Cells still free to place things on, see TakeCell
+    typedef __gnu_pbds::gp_hash_table<UI32, UI32> MOVED;
+    MOVED moved;                    // Free cells moved within the free cells of the maze, by place
+    Philox rng;
+
+    void Diamond(UI32, UI32, bool);
+    UI32 FreeCell(UI32) const;
+    void Populate(void);
+    void PopDmnds(void);
+    void PlaceParchment(void);
+};
+
+#endif // STAGE_H_INCLUDED
+
+#ifndef MAPCACHE_H_INCLUDED
+#define MAPCACHE_H_INCLUDED
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::InitInfoBar
- *  @brief  Initialises the information bar window. The information bar shows
- *          information about the current player.
- *  @param  player_name: The player name to draw on the bar.
+ *  CLASS: MapCache
+ *  @brief      MapCache is the cache file kept next to a map file (the map name
+ *              followed by MAPCACHE_SUFFIX). It holds the Maze worked out from
+ *              the text of the map: the maze grid, the monster spawns, the free
+ *              cells, the wall and move bitsets and the junction graph. Loading a large map from it is a few straight
+ *              copies out of a mapped file instead of a parse and two builds.
+ *              The file starts with a fixed header that records the hash and the
+ *              length of the map text it was made from, along with the version of
+ *              the format and the layout of this build (coordinate width, tile
+ *              size, ...). A cache file that does not match the map, or this
+ *              build, is ignored and written anew. Every section after the header
+ *              is the raw memory of a grid or an array, padded to 8 bytes, in the
+ *              byte order of the machine that wrote it.
  */
-void Gameplay::InitInfoBar(const std::string& player_name)
+class MapCache
 {
-    if ((info_win = newwin(1,COLS, 0, 0)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: info_win");
+    public:
+    MapCache() : header(NULL)
+    {}
 
-    if ((score_win = derwin(info_win, 1, 5, 0, COLS - 5)) == NULL)
-        throw WINEXP("Unable to acquire resources to construct window: score_win");
+    bool Open(const std::string&, const char*, size_t);
+    void Close(void);
+    bool Restore(Maze&) const;
 
-    wbkgd(info_win, COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
-    wbkgd(score_win, COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
-    wprintw(info_win, " %s", player_name.c_str());
-}
+    static bool Store(const std::string&, const char*, size_t, const Maze&);
+    static UI64 Hash(const char*, size_t);
 
+    private:
+    typedef struct cache_header
+    {
+        char magic[4];
+        UI32 version;
+        UI32 layout;        // See Layout
+        UI32 width, height;
+        UI32 spawns;
+        UI32 map_cells;     // Size of the grid allocation
+        UI32 words_per_row;
+        UI32 free_cells, node_count;
+        UI32 edges, adj;
+        UI32 graph_cells;   // Size of the graph grids, 0 when the maze is not Compact
+        UI32 free_list;     // Free cells of the maze, see Stage::TakeCell
+        UI64 words;         // Words of each bitset
+        UI64 text_size;
+        UI64 hash;
+    }   HEADER;
+
+    MapFile file;
+    const HEADER* header;
+
+    static UI32 Layout(void);
+    static bool ValidWalls(const MapBits&, UI32, UI32);
+    static bool ValidGraph(const MazeGraph&);
+};
+
+#endif // MAPCACHE_H_INCLUDED
+
+/* CLASS MAPCACHE PRIVATE MEMBER DEFINITIONS */
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::DrawMenu
- *  @brief  Draws the main menu on the screen.
- *  @param  slc: An integer showing which menu item to highlight.
+ *  PRIVATE MEMBER FUNCTION MapCache::Layout
+ *  @brief  Returns a summary of the build settings the cached structures
+ *          depend on, so that a cache file written by a differently built
+ *          game is not mistaken for a valid one.
  */
-void Gameplay::DrawMenu(UI8 slc)
+UI32 MapCache::Layout(void)
 {
-    for (UI8 i = 0; i < MENU_ITEMS_COUNT; i++)
-    {
-        if (slc == i) wattron(stage_win, COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK));
-        mvwaddstr(stage_win, i*2 + 3, (COLS - menu_items[i].length()) / 2, menu_items[i].c_str());
-        wstandend(stage_win);
-    }
+    return COORD_BITS << 24 | GRID_TILE_BITS << 16 | MAZEGRAPH_MIN_GAIN << 8 | sizeof(MazeGraph::EDGE);
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::DrawParch
- *  @brief  Draws the parch in the maze (as a 'P' character). Must be called
- *          after all of the diamonds in the level are eaten.
- *  @param  parch_pos: The position to draw the parch.
+ *  PRIVATE STATIC MEMBER FUNCTION MapCache::ValidWalls
+ *  @brief  Tells whether the border and the padding of a wall bitset are all
+ *          walls, so that no move worked out from it leads out of the maze.
+ *  @param  bits: The bitsets, words_per_row and walls set.
+ *  @param  width, height: The size of the maze.
  */
-void Gameplay::DrawParch(POS parch_pos)
+bool MapCache::ValidWalls(const MapBits& bits, UI32 width, UI32 height)
 {
-    wattron(map_win, COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK) | A_BOLD);
-    mvwdelch(map_win, parch_pos.y, parch_pos.x);
-    mvwinsch(map_win, parch_pos.y, parch_pos.x, 'P');
-    wstandend(map_win);
+    const UI32 per_row = bits.words_per_row;
+    const UI64 right = (UI64)width + 1;     // Bit of the right border
+
+    for (UI64 row = 0; row < (UI64)height + 2; row++)
+        for (UI32 i = 0; i < per_row; i++)
+        {
+            UI64 first = (UI64)i * 64, must = ~0ULL;
+
+            if (row > 0 && row <= height)
+            {
+                must = right <= first ? ~0ULL : right >= first + 64 ? 0 : ~0ULL << (right - first);
+                if (i == 0) must |= 1;  // The left border
+            }
+
+            if ((bits.walls[row * per_row + i] & must) != must)
+                return false;
+        }
+
+    return true;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::DrawScore
- *  @brief  Draws the score passed as an argument on the info bar.
- *  @param  score: The value to draw.
+ *  PRIVATE STATIC MEMBER FUNCTION MapCache::ValidGraph
+ *  @brief  Tells whether every node, edge and adjacency list a graph refers to
+ *          is one of its own, so that no search goes out of its arrays.
+ *  @param  graph: The graph, with its cell grids.
  */
-void Gameplay::DrawScore(UI32 score)
+bool MapCache::ValidGraph(const MazeGraph& graph)
 {
-    wclear(score_win);
-    wprintw(score_win, "%d", score);
-    wrefresh(score_win);
+    const UI32 nodes = graph.nodes.size(), edges = graph.edges.size();
+    const size_t cells = graph.cell_ref.Size();
+
+    if (graph.adj_start[0] != 0 || graph.adj_start[nodes] != graph.adj.size())
+        return false;
+
+    for (UI32 n = 0; n < nodes; n++)
+        if (graph.nodes[n] >= cells || graph.adj_start[n] > graph.adj_start[n + 1])
+            return false;
+
+    for (size_t i = 0; i < graph.adj.size(); i++)
+        if (graph.adj[i] >= edges)
+            return false;
+
+    for (UI32 e = 0; e < edges; e++)
+        if (graph.edges[e].a >= nodes || graph.edges[e].b >= nodes)
+            return false;
+
+    // Every cell holds a node, an edge or no reference at all
+    const UI32* ref = graph.cell_ref.Data();
+    bool bad = false;
+
+    for (size_t c = 0; c < cells; c++)
+        bad |= ref[c] != MazeGraph::NO_REF &&
+               (ref[c] & MazeGraph::NODE_FLAG ? (ref[c] & ~MazeGraph::NODE_FLAG) >= nodes : ref[c] >= edges);
+
+    return !bad;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::DrawHighScores
- *  @brief  Draws the high score table with a nice delay effect.
- *  @param  table: The score table to retrieve data from.
+ *  FUNCTION cache_section
+ *  @brief  Returns the next section of a cache file and moves past it, or NULL
+ *          if the file is too short to hold it.
+ *  @param  data: The cache file.
+ *  @param  size: The length of the cache file.
+ *  @param  pos: The offset of the section; moved to the offset of the next one.
+ *  @param  bytes: The length of the section.
  */
-void Gameplay::DrawHighScores(const std::vector<SCOS>& sc_table)
+static const char* cache_section(const char* data, size_t size, size_t& pos, UI64 bytes)
 {
-    UI8 counter = 1;
-    std::string sc_label = "HIGHSCORE TABLE";
+    if (bytes > size - pos) return NULL;
 
-    wattron(stage_win, COLOR_PAIR(COLOR_PAIR_GREEN_BLACK) | A_BOLD);
-    mvwprintw(stage_win, 0, (COLS - sc_label.length()) / 2, "%s", sc_label.c_str());
-    wstandend(stage_win);
+    const char* section = data + pos;
+    pos += (bytes + 7) & ~(UI64)7;
+    if (pos > size) pos = size;
 
-    if (sc_table.begin() == sc_table.end())
+    return section;
+}
+
+/**
+ *  FUNCTION cache_write
+ *  @brief  Writes a section of a cache file, padded to 8 bytes.
+ *  @param  fd: The cache file.
+ *  @param  data: The section.
+ *  @param  bytes: The length of the section.
+ *  @return False on any write error.
+ */
+static bool cache_write(I32 fd, const void* data, size_t bytes)
+{
+    static const char padding[8] = { 0 };
+    const char* next = (const char*)data;
+
+    for (size_t left = bytes; left > 0; )
     {
-        mvwprintw(stage_win, counter*2, (COLS - std::string("(empty)").length()) / 2,
-                  "(empty)");
-        wrefresh(stage_win);
+        ssize_t done = write(fd, next, left);
+        if (done <= 0) return false;
+
+        next += done;
+        left -= done;
     }
-    else
-        for(std::vector<SCOS>::const_iterator it = sc_table.begin(); it != sc_table.end(); it++)
-        {
-            mvwprintw(stage_win, counter*2, (COLS - 20) / 2,
-                      "%d \t %s", (*it).player_score, (*it).player_name);
-            counter++;
-            if (counter*2 == LINES) break;
 
-            napms(50);
-            wrefresh(stage_win);
-        }
+    size_t pad = (8 - bytes % 8) % 8;
+    return pad == 0 || write(fd, padding, pad) == (ssize_t)pad;
 }
 
+/* CLASS MAPCACHE PUBLIC MEMBER DEFINITIONS */
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::GetPlayerInput
- *  @brief  Handles the input from the keyboard.
- *  @return The keycode.
+ *  PUBLIC STATIC MEMBER FUNCTION MapCache::Hash
+ *  @brief  Returns a 64 bit hash of the text of a map, eight characters at a
+ *          time.
+ *  @param  text: The text of the map.
+ *  @param  size: The length of the text.
  */
-I32 Gameplay::GetPlayerInput(void)
+UI64 MapCache::Hash(const char* text, size_t size)
 {
-    I32 key = wgetch(stage_win);
+    const UI64 mul = 0x9E3779B97F4A7C15ULL;
+    UI64 hash = size * mul;
+    size_t i = 0;
 
-    if (key == ' ') ShowWin(debug_win);
+    for (; i + 8 <= size; i += 8)
+    {
+        UI64 word;
+        memcpy(&word, text + i, 8);
+        hash = (hash ^ word) * mul;
+        hash ^= hash >> 29;
+    }
 
-    return key;
+    UI64 tail = 0;
+    memcpy(&tail, text + i, size - i);
+    hash = (hash ^ tail) * mul;
+
+    hash ^= hash >> 32;
+    hash *= 0xD6E8FEB86659FD93ULL;
+    return hash ^ (hash >> 32);
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::MoveWin
- *  @brief  Moves window win in the coordinates specified by coords.
- *  @param  win: The window to be moved.
- *  @param  coords: The new coordinates of the window.
+ *  PUBLIC MEMBER FUNCTION MapCache::Open
+ *  @brief  Maps the cache file of a map and checks that it was made from the
+ *          given text by a game built like this one.
+ *  @param  map_name: The map file.
+ *  @param  text: The text of the map.
+ *  @param  size: The length of the text.
+ *  @return False if there is no cache file or it does not match.
  */
-void Gameplay::MoveWin(WINDOW* _win, POS coords)
+bool MapCache::Open(const std::string& map_name, const char* text, size_t size)
 {
-    mvwin(_win, coords.y + score_offset, stage_offset + coords.x);
+    Close();
+
+    if (!file.Open(map_name + MAPCACHE_SUFFIX) || file.Size() < sizeof(HEADER))
+        return false;
+
+    const HEADER* head = (const HEADER*)file.Data();
+
+    if (memcmp(head->magic, MAPCACHE_MAGIC, 4) != 0 || head->version != MAPCACHE_VERSION ||
+        head->layout != Layout() || head->text_size != size || head->hash != Hash(text, size))
+    {
+        file.Close();
+        return false;
+    }
+
+    header = head;
+    return true;
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::ShowWin
- *  @brief  Brings the window passed as argument to the front and
- *          refreshes the view in order to draw it.
- *  @param  win: The window to be drawn.
+ *  PUBLIC MEMBER FUNCTION MapCache::Close
+ *  @brief  Unmaps the cache file.
  */
-void Gameplay::ShowWin (WINDOW* _win) const
+void MapCache::Close(void)
 {
-    touchwin(_win);
-    wrefresh(_win);
+    file.Close();
+    header = NULL;
 }
 
-
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::GetPlayerInput
- *  @brief  Pauses or unpauses the gameplay according to the
- *          boolean parametre passed.
- *  @param  state: True for paused or false for unpaused.
+ *  PUBLIC MEMBER FUNCTION MapCache::Restore
+ *  @brief  Copies the cached maze, spawns, bitsets and graph into a maze, as
+ *          Maze::Build would have left them. A file whose hash matches the
+ *          map may still have been damaged, so the sizes of the header are
+ *          checked against each other before anything is allocated from them,
+ *          and every cell, node and edge the copies refer to is checked to be
+ *          in range. The moves are worked out again from the walls and must
+ *          match the cached ones.
+ *  @param  maze: An empty maze.
+ *  @return False if the cache file is truncated or damaged, or its grids do
+ *          not have the layout of this build; the maze must then be cleared.
  */
-void Gameplay::Pause(bool state)
+bool MapCache::Restore(Maze& maze) const
 {
-    int stage_x, stage_y;
-    getmaxyx(stage_win, stage_y, stage_x);
+    if (!header) return false;
+
+    // A maze has no more cells than its text has characters
+    const UI64 cells = (UI64)header->width * header->height;
+    if (header->width == 0 || header->height == 0 || header->width > COORD_MAX || header->height > COORD_MAX ||
+        cells > header->text_size || header->spawns > cells || header->free_list > cells ||
+        header->free_cells > cells || header->node_count > header->free_cells ||
+        header->words_per_row != ((UI64)header->width + 2 + 127) / 128 * 2 ||
+        header->words != (UI64)header->words_per_row * (header->height + 2) ||
+        (header->graph_cells != 0) != ((UI64)header->node_count * MAZEGRAPH_MIN_GAIN <= header->free_cells))
+        return false;
+
+    const char* data = file.Data();
+    size_t size = file.Size(), pos = 0;
+    const char* section[17];
+    const UI64 graph_nodes = header->graph_cells ? header->node_count : 0;
+    const UI64 bytes[17] =
+    {
+        sizeof(HEADER), header->map_cells, (UI64)header->spawns * sizeof(POS), header->spawns,
+        (UI64)header->free_list * 4,
+        header->words * 8, header->words * 8, header->words * 8, header->words * 8, header->words * 8,
+        graph_nodes * 4, header->graph_cells ? (graph_nodes + 1) * 4 : 0, (UI64)header->adj * 4,
+        (UI64)header->edges * sizeof(MazeGraph::EDGE), (UI64)header->graph_cells * 4,
+        (UI64)header->graph_cells * 4, header->graph_cells
+    };
+
+    for (UI8 i = 0; i < 17; i++)
+        if (!(section[i] = cache_section(data, size, pos, bytes[i])))
+            return false;
+
+    maze.map.Reset(header->width, header->height, '*');
+    if (maze.map.Size() != header->map_cells)
+        return false;
+
+    memcpy(maze.map.Data(), section[1], header->map_cells);
+    maze.spawn_pos.assign((const POS*)section[2], (const POS*)section[2] + header->spawns);
+    maze.spawn_kind.assign((const UI8*)section[3], (const UI8*)section[3] + header->spawns);
+    maze.free_cells.assign((const UI32*)section[4], (const UI32*)section[4] + header->free_list);
+
+    MapBits& bits = maze.bits;
+    bits.words_per_row = header->words_per_row;
+    bits.walls.assign((const UI64*)section[5], (const UI64*)section[5] + header->words);
+    if (!ValidWalls(bits, header->width, header->height))
+        return false;
+
+    // The monsters and the diamonds are put on these cells, so each of them must
+    // be a free cell of the maze, in the grid as well as in the wall bitset
+    for (UI32 i = 0; i < header->spawns; i++)
+    {
+        POS at = maze.spawn_pos[i];
+        if (at.x >= header->width || at.y >= header->height ||
+            (maze.spawn_kind[i] != SMART && maze.spawn_kind[i] != DUMMY) ||
+            maze.map(at.x, at.y) != ' ' || bits.Wall(at.x, at.y))
+            return false;
+    }
 
-    if (!isPaused)
-        mvwprintw(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2, PAUSE_MESSAGE);
-    else
+    // The column and the row of a cell are those of its tile plus its place in
+    // the tile, so the tiles are worked out once rather than a cell at a time
+    const UI32 tile_bits = 2 * GRID_TILE_BITS, tiles = maze.map.Size() >> tile_bits;
+    std::vector<UI32> tile_x(tiles), tile_y(tiles);
+    for (UI32 t = 0; t < tiles; t++)
     {
-        for (int i = 0; i < strlen(PAUSE_MESSAGE); i++)
-            mvwdelch(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2);
-        for (int i = 0; i < strlen(PAUSE_MESSAGE); i++)
-            mvwinsch(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2, ' ');
+        tile_x[t] = maze.map.X(t << tile_bits);
+        tile_y[t] = maze.map.Y(t << tile_bits);
+    }
+
+    for (UI32 i = 0; i < header->free_list; i++)
+    {
+        UI32 cell = maze.free_cells[i], tile = cell >> tile_bits;
+        if (tile >= tiles) return false;
+
+        // The border is at -1, which wraps past the width and the height
+        UI32 x = tile_x[tile] + (cell & (GRID_TILE - 1));
+        UI32 y = tile_y[tile] + (cell >> GRID_TILE_BITS & (GRID_TILE - 1));
+        if (x >= header->width || y >= header->height || maze.map[cell] != ' ' || bits.Wall(x, y))
+            return false;
+    }
+
+    for (UI8 d = 0; d < 4; d++)
+        bits.open[d].assign(header->words, 0);
+    for (UI32 row = 1; row <= header->height; row++)
+        bits.BuildMoves(row);
+    for (UI8 d = 0; d < 4; d++)
+        if (memcmp(&bits.open[d][0], section[6 + d], header->words * 8) != 0)
+            return false;
+
+    MazeGraph& graph = maze.graph;
+    graph.Clear();
+    graph.free_cells = header->free_cells;
+    graph.node_count = header->node_count;
+
+    if (header->graph_cells)
+    {
+        graph.nodes.assign((const UI32*)section[10], (const UI32*)section[10] + graph_nodes);
+        graph.adj_start.assign((const UI32*)section[11], (const UI32*)section[11] + graph_nodes + 1);
+        graph.adj.assign((const UI32*)section[12], (const UI32*)section[12] + header->adj);
+        graph.edges.assign((const MazeGraph::EDGE*)section[13],
+                           (const MazeGraph::EDGE*)section[13] + header->edges);
+
+        graph.cell_ref.Reset(header->width, header->height, MazeGraph::NO_REF);
+        graph.cell_offset.Reset(header->width, header->height, 0);
+        graph.cell_dirs.Reset(header->width, header->height, 0);
+        if (graph.cell_ref.Size() != header->graph_cells)
+            return false;
+
+        memcpy(graph.cell_ref.Data(), section[14], header->graph_cells * 4);
+        memcpy(graph.cell_offset.Data(), section[15], header->graph_cells * 4);
+        memcpy(graph.cell_dirs.Data(), section[16], header->graph_cells);
+
+        if (!ValidGraph(graph))
+            return false;
     }
 
-    nodelay(stage_win, !state);
-    isPaused = state;
-    ShowWin(stage_win);
-    ShowWin(player_win);
-    ShowWin(gnome_win);
-    ShowWin(traal_win);
+    maze.map_w = header->width;
+    maze.map_h = header->height;
+    return true;
+}   // MapCache::Restore
+
+/**
+ *  PUBLIC STATIC MEMBER FUNCTION MapCache::Store
+ *  @brief  Writes the cache file of a map from a maze that has just been
+ *          built from it. The file is written under a temporary name and
+ *          renamed when complete, so that games loading the same map at the
+ *          same time never see half of it.
+ *  @param  map_name: The map file.
+ *  @param  text: The text of the map.
+ *  @param  size: The length of the text.
+ *  @param  maze: The maze built from the text.
+ *  @return False if the cache file could not be written (a read-only
+ *          directory, a full disk, ...), which is not an error for the game.
+ */
+bool MapCache::Store(const std::string& map_name, const char* text, size_t size, const Maze& maze)
+{
+    const MapBits& bits = maze.bits;
+    const MazeGraph& graph = maze.graph;
+    HEADER head;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, MAPCACHE_MAGIC, 4);
+    head.version = MAPCACHE_VERSION;
+    head.layout = Layout();
+    head.width = maze.map_w;
+    head.height = maze.map_h;
+    head.spawns = maze.spawn_pos.size();
+    head.map_cells = maze.map.Size();
+    head.words_per_row = bits.words_per_row;
+    head.free_cells = graph.free_cells;
+    head.node_count = graph.node_count;
+    head.edges = graph.edges.size();
+    head.adj = graph.adj.size();
+    head.graph_cells = graph.cell_ref.Size();
+    head.free_list = maze.free_cells.size();
+    head.words = bits.walls.size();
+    head.text_size = size;
+    head.hash = Hash(text, size);
+
+    std::string cache_name = map_name + MAPCACHE_SUFFIX;
+    std::vector<char> temp_name(cache_name.begin(), cache_name.end());
+    const char suffix[] = ".XXXXXX";
+    temp_name.insert(temp_name.end(), suffix, suffix + sizeof(suffix));
+
+    I32 fd = mkstemp(&temp_name[0]);
+    if (fd < 0) return false;
+
+    bool ok = cache_write(fd, &head, sizeof(head)) &&
+              cache_write(fd, maze.map.Data(), head.map_cells) &&
+              cache_write(fd, maze.spawn_pos.data(), head.spawns * sizeof(POS)) &&
+              cache_write(fd, maze.spawn_kind.data(), head.spawns) &&
+              cache_write(fd, maze.free_cells.data(), (size_t)head.free_list * 4);
+
+    ok = ok && cache_write(fd, bits.walls.data(), head.words * 8);
+    for (UI8 d = 0; d < 4; d++)
+        ok = ok && cache_write(fd, bits.open[d].data(), head.words * 8);
+
+    if (head.graph_cells)
+        ok = ok && cache_write(fd, graph.nodes.data(), graph.nodes.size() * 4) &&
+                   cache_write(fd, graph.adj_start.data(), graph.adj_start.size() * 4) &&
+                   cache_write(fd, graph.adj.data(), graph.adj.size() * 4) &&
+                   cache_write(fd, graph.edges.data(), graph.edges.size() * sizeof(MazeGraph::EDGE)) &&
+                   cache_write(fd, graph.cell_ref.Data(), head.graph_cells * 4) &&
+                   cache_write(fd, graph.cell_offset.Data(), head.graph_cells * 4) &&
+                   cache_write(fd, graph.cell_dirs.Data(), head.graph_cells);
+
+    fchmod(fd, 0644);
+    ok = close(fd) == 0 && ok && rename(&temp_name[0], cache_name.c_str()) == 0;
+    if (!ok) unlink(&temp_name[0]);
+
+    return ok;
+}   // MapCache::Store
+
+/* CLASS STAGE PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION Stage::Populate
+ *  @brief  Places the diamonds and the parchment on a freshly loaded maze,
+ *          after making sure the maze has room for them and for the creatures
+ *          Engine::InitPos places next (Harry, plus a gnome and a traal when
+ *          the map declares no monsters).
+ */
+void Stage::Populate(void)
+{
+    UI32 needed = DIAMONDS_DEFAULT_COUNT + 2 + (maze->SpawnCount() == 0 ? 2 : 0);
+
+    if (free_count < needed)
+    {
+        char error[128];
+        snprintf(error, sizeof(error), "The map has %u free cells, it needs at least %u",
+                 free_count, needed);
+
+        Unload();
+        throw GENEXP(std::string("General error in Stage::Load:\n") + error);
+    }
+
+    PopDmnds();
+    PlaceParchment();
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Stage::PopDmnds
+ *  @brief  Populates the map with diamonds, represented as dots ('.')
+ */
+void Stage::PopDmnds(void)
+{
+    for (UI8 cc = 0; cc < DIAMONDS_DEFAULT_COUNT; cc++)
+    {
+        POS at = TakeCell(rng);
+        Diamond(at.x, at.y, true);
+    }
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Stage::PlaceParchment
+ *  @brief  Places the parchment on the map required for Harry to complete the level.
+ *          The parchment is represented with the character 'P'.
+ */
+ void Stage::PlaceParchment(void)
+ {
+     parch_pos = TakeCell(rng);
+ }
+
+/**
+ *  PRIVATE MEMBER FUNCTION Stage::Diamond
+ *  @brief  Places or removes the diamond of a cell.
+ *  @param  x, y: The cell.
+ *  @param  set: True to place a diamond, false to remove it.
+ */
+void Stage::Diamond(UI32 x, UI32 y, bool set)
+{
+    UI32 word = Bits().Word(x, y);
+
+    if (set)    diamonds[word] |= 1ULL << MapBits::Bit(x);
+    else        diamonds[word] &= ~(1ULL << MapBits::Bit(x));
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Stage::FreeCell
+ *  @brief  Returns the free cell at the given place of the free cells: the one
+ *          moved there, if any, or else the one of the maze.
+ *  @param  i: The place, below FreeCount.
+ */
+UI32 Stage::FreeCell(UI32 i) const
+{
+    MOVED::point_const_iterator found = moved.find(i);
+
+    return found == moved.end() ? maze->FreeCell(i) : found->second;
+}
+
+/* CLASS STAGE PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC DEFAULT CONTRUCTOR Stage
+ *  @brief Initialises the private members needed for the object to be valid.
+ */
+Stage::Stage() : map_w(0), map_h(0),
+                 diamonds_count(DIAMONDS_DEFAULT_COUNT), free_count(0)
+{} //Stage::Stage()
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Load
+ *  @brief  Loads the stage map (maze) from the given map file, which is mapped
+ *          in memory. The maze is taken from the cache file of the map when it
+ *          matches the map; otherwise the map is parsed in place and the cache
+ *          file is written for the next time.
+ *  @param  filename: The map file.
+ *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
+ *          before a new call of this function occurs
+ */
+void Stage::Load(const std::string& filename)
+{
+    MapFile file;
+    MapCache cache;
+
+    if (!file.Open(filename))
+        throw GENEXP("General error in Stage::Load:\nCould not load map file " + filename);
+
+    if (map_w != 0 || map_h != 0)
+        throw GENEXP("General error in Stage::Load:\nInvalid initial class values. You need to call Unload first.");
+
+    std::shared_ptr<Maze> built(new Maze);
+    if (!cache.Open(filename, file.Data(), file.Size()) || !cache.Restore(*built))
+    {
+        built->Clear();
+        built->Build(file.Data(), file.Size());
+        MapCache::Store(filename, file.Data(), file.Size(), *built);
+    }
+
+    Load(built);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Load
+ *  @brief  Loads the stage map (maze) from the given input stream
+ *  @param  mapdata: The input stream (a map file or a map already read in memory)
+ *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
+ *          before a new call of this function occurs
+ */
+void Stage::Load(std::istream& mapdata)
+{
+    if (!mapdata)
+        throw GENEXP("General error in Stage::Load:\nCould not load map file");
+
+    std::string text((std::istreambuf_iterator<char>(mapdata)), std::istreambuf_iterator<char>());
+    Parse(text.data(), text.size());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Load
+ *  @brief  Loads the stage map (maze) from a cache file that is already open,
+ *          which saves games loading the same map over and over from opening
+ *          it every time.
+ *  @param  cache: The cache file of the map.
+ *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
+ *          before a new call of this function occurs
+ */
+void Stage::Load(const MapCache& cache)
+{
+    if (map_w != 0 || map_h != 0)
+        throw GENEXP("General error in Stage::Load:\nInvalid initial class values. You need to call Unload first.");
+
+    std::shared_ptr<Maze> built(new Maze);
+    if (!cache.Restore(*built))
+        throw GENEXP("General error in Stage::Load:\nThe cache file of the map is damaged");
+
+    Load(built);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Load
+ *  @brief  Loads the stage map (maze) from a maze that is already built, which
+ *          is shared rather than copied, and places the diamonds and the
+ *          parchment on it. Only the diamonds and the cells taken off the free
+ *          ones take memory of the stage's own.
+ *  @param  _maze: The maze.
+ *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
+ *          before a new call of this function occurs
+ */
+void Stage::Load(const std::shared_ptr<const Maze>& _maze)
+{
+    if (map_w != 0 || map_h != 0)
+        throw GENEXP("General error in Stage::Load:\nInvalid initial class values. You need to call Unload first.");
+
+    maze = _maze;
+    map_w = maze->Width();
+    map_h = maze->Height();
+    diamonds.assign(maze->Bits().Words(), 0);
+    free_count = maze->FreeCount();
+    moved.clear();
+
+    //Populating the map with the diamonds and placing the parchment
+    Populate();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Parse
+ *  @brief  Loads the stage map (maze) from the text of a map, without going
+ *          through the cache.
+ *  @param  text: The text of the map.
+ *  @param  size: The length of the text.
+ *  @note   If a map was previously loaded it must be unloaded with Stage::Unload
+ *          before a new call of this function occurs
+ */
+void Stage::Parse(const char* text, size_t size)
+{
+    if (map_w != 0 || map_h != 0)
+        throw GENEXP("General error in Stage::Load:\nInvalid initial class values. You need to call Unload first.");
+
+    std::shared_ptr<Maze> built(new Maze);
+    built->Build(text, size);
+
+    Load(built);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::Unload
+ *  @brief  Unloads the stage map (maze) and sets the object appropriately to load new map.
+ *          The maze itself is only freed with the last stage that shares it.
+ *  @note   This specific function must be called after every Stage::Load call in order to
+ *          load a new map.
+ */
+void Stage::Unload(void)
+{
+    maze.reset();
+    diamonds.clear();
+    diamonds.shrink_to_fit();
+    moved.clear();
+    free_count = 0;
+    map_h = map_w = 0;
+} // Stage::Unload
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::EraseDiamond
+ *  @brief  Erases the diamond at the position given as a parametre.
+ *  @param  coords: The position of the diamond to erase.
+ */
+bool Stage::EraseDiamond(POS coords)
+{
+    if (Diamond(coords.x, coords.y))
+    {
+        Diamond(coords.x, coords.y, false);
+        moved[free_count++] = Map().Index(coords.x, coords.y);
+        diamonds_count--;
+        return true;
+    }
+
+    return false;
+} // EraseDiamonds
+
+/**
+ *  PUBLIC MEMBER FUNCTION Stage::TakeCell
+ *  @brief  Picks a random free cell and takes it off the free cells, so that
+ *          nothing else is placed on it. The free cells are kept in an array
+ *          in no particular order: the picked one is replaced by the last one,
+ *          which makes every pick a single draw, however crowded the maze.
+ *          The array is the one of the maze, shared by every stage of the map,
+ *          so the cells a stage moves around in it are kept apart, by place;
+ *          there are only as many as the cells the stage has taken.
+ *          The cells monsters start on are never free, and cells are freed
+ *          again when the diamond on them is erased.
+ *  @param  rng: The generator to draw from.
+ *  @return The cell taken.
+ */
+POS Stage::TakeCell(Philox& rng)
+{
+    if (free_count == 0)
+        throw GENEXP("General error in Stage::TakeCell:\nThere are no free cells left");
+
+    UI32 i = rng.Below(free_count);
+    UI32 cell = FreeCell(i);
+    UI32 last = FreeCell(--free_count);
+
+    if (i < free_count) moved[i] = last;
+    moved.erase(free_count);
+
+    return POS(Map().X(cell), Map().Y(cell));
+}
+
+#ifndef FLOWFIELD_H_INCLUDED
+#define FLOWFIELD_H_INCLUDED
+
+/**
+ *  CLASS: FlowField
+ *  @brief      FlowField holds the distance of every cell of the maze to a single
+ *              target cell (Harry's position). It is built once per player move
+ *              and read by every chasing monster, so deciding the next step of a
+ *              monster is a lookup of its four neighbours.
+ *              The search is only carried as far as the monsters ask for: it
+ *              stops once the cell being looked up is settled and is resumed by
+ *              the next lookup, and a new target only clears the cells the last
+ *              search reached. A gnome close to Harry so never pays for the
+ *              whole map.
+ *              On mazes whose graph of junctions is much smaller than the maze
+ *              itself, the distances are kept for the graph nodes only and the
+ *              corridors are worked out from them.
+ */
+class FlowField
+{
+    public:
+    static const UI32 UNREACHABLE = 0xFFFFFFFF;
+
+    FlowField() : width(0), height(0), target(), built(false), maze(NULL), head(0), tail(0), graph(NULL)
+    {}
+
+    void Reset(const Grid<I8>&, const MazeGraph&);
+    void Update(const Grid<I8>&, POS);
+    UI32 Distance(POS);
+    UI8 NextStep(POS);
+
+    private:
+    void Settle(UI32);
+
+    UI32 width, height;
+    POS target;
+    bool built;
+    const Grid<I8>* maze;
+    Grid<UI32> dist;
+    std::vector<UI32> queue;
+    UI32 head, tail;            // The cells queue[0, tail) are reached, queue[head, tail) still to expand
+    const MazeGraph* graph;
+    std::vector<UI32> node_dist;
+};
+
+#endif // FLOWFIELD_H_INCLUDED
+
+/**
+ *  PUBLIC MEMBER FUNCTION FlowField::Reset
+ *  @brief  Sizes the field for a new map and marks it as not built.
+ *  @param  map: The maze of the new map.
+ *  @param  _graph: The graph of that maze.
+ */
+void FlowField::Reset(const Grid<I8>& map, const MazeGraph& _graph)
+{
+    width = map.Width();
+    height = map.Height();
+    built = false;
+    maze = &map;
+    head = tail = 0;
+
+    if (_graph.Compact())
+    {
+        graph = &_graph;
+        dist.Clear();
+        queue.clear();
+    }
+    else
+    {
+        graph = NULL;
+        dist.Reset(width, height, UNREACHABLE);
+        dist.Fill(UNREACHABLE);
+        queue.resize(width * height);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FlowField::Update
+ *  @brief  Starts the distance field towards the given target. Nothing is done
+ *          if the field has already been built for that same target, since the
+ *          walls of the maze never change during a level. Only the target is
+ *          queued here; the search is carried on by FlowField::Settle as far as
+ *          the lookups need it.
+ *  @param  map: The maze the distances are calculated on.
+ *  @param  _target: The cell every distance is measured to.
+ */
+void FlowField::Update(const Grid<I8>& map, POS _target)
+{
+    if (built && target == _target) return;
+
+    target = _target;
+    built = true;
+
+    if (graph)
+    {
+        graph->Search(target, node_dist);
+        return;
+    }
+
+    // Every cell the last search reached is in the queue, the rest were never touched
+    for (UI32 i = 0; i < tail; i++)
+        dist[queue[i]] = UNREACHABLE;
+
+    head = tail = 0;
+
+    if (target.x >= width || target.y >= height || map(target.x, target.y) == '*')
+        return;
+
+    dist(target.x, target.y) = 0;
+    queue[tail++] = map.Index(target.x, target.y);
+}   // FlowField::Update
+
+/**
+ *  PRIVATE MEMBER FUNCTION FlowField::Settle
+ *  @brief  Carries the search on until the given cell and all its neighbours
+ *          hold their final distance: that is when the cell has been reached
+ *          and every cell up to its own distance is queued, or when there is
+ *          nothing left to search.
+ *  @param  cell: The index of the cell that is going to be looked up.
+ */
+void FlowField::Settle(UI32 cell)
+{
+    const Grid<I8>& map = *maze;
+
+    // The maze is walled all around, so the neighbours of a queued cell are
+    // always inside the grid and never need a bounds check
+    while (head < tail && (dist[cell] == UNREACHABLE || dist[queue[head]] < dist[cell]))
+    {
+        UI32 from = queue[head++];
+        UI32 next_dist = dist[from] + 1;
+
+        const UI32 next[4] = { map.Up(from), map.Right(from), map.Down(from), map.Left(from) };
+
+        for (UI8 i = 0; i < 4; i++)
+        {
+            UI32 n = next[i];
+            if (dist[n] != UNREACHABLE || map[n] == '*')
+                continue;
+
+            dist[n] = next_dist;
+            queue[tail++] = n;
+        }
+    }
+}   // FlowField::Settle
+
+/**
+ *  PUBLIC MEMBER FUNCTION FlowField::Distance
+ *  @brief  Returns the distance of the given cell to the target, or UNREACHABLE.
+ *  @param  cell: The cell to look up.
+ */
+UI32 FlowField::Distance(POS cell)
+{
+    if (graph)
+        return graph->Distance(cell, target, node_dist);
+
+    if (cell.x >= width || cell.y >= height)
+        return UNREACHABLE;
+
+    UI32 index = dist.Index(cell.x, cell.y);
+    Settle(index);
+
+    return dist[index];
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FlowField::NextStep
+ *  @brief  Returns the direction (UP, RIGHT, DOWN or LEFT) that takes a creature
+ *          standing on the given cell one step closer to the target, or 0 if the
+ *          target cannot be reached or is already reached.
+ *  @param  from: The position of the creature.
+ */
+UI8 FlowField::NextStep(POS from)
+{
+    if (graph)
+        return graph->NextStep(from, target, node_dist);
+
+    UI32 here = Distance(from);
+    if (here == UNREACHABLE || here == 0) return 0;
+
+    // Distance has settled every cell nearer than this one. The border of the
+    // field is UNREACHABLE, so the neighbours can be read blindly
+    UI32 cell = dist.Index(from.x, from.y);
+
+    if (dist[dist.Up(cell)] < here)     return UP;
+    if (dist[dist.Right(cell)] < here)  return RIGHT;
+    if (dist[dist.Down(cell)] < here)   return DOWN;
+    if (dist[dist.Left(cell)] < here)   return LEFT;
+
+    return 0;
+}
+
+#ifndef PERFSTATS_H_INCLUDED
+#define PERFSTATS_H_INCLUDED
+
+/**
+ *  CLASS: PerfStats
+ *  @brief      PerfStats gathers what the turns cost: the time spent in each
+ *              phase of a turn, the latency of the ticks and how often the
+ *              monsters fall back to their lesser moves. The latencies go to a
+ *              histogram of fixed buckets, four for every power of two of
+ *              microseconds, so a percentile is read in constant time and
+ *              memory, within a quarter of its value.
+ *              Nothing is measured unless a PerfStats is handed to the code
+ *              that is measured, so keeping none costs one test per phase.
+ */
+class PerfStats
+{
+    public:
+    typedef std::chrono::steady_clock CLOCK;
+
+    PerfStats() { Reset(); }
+
+    void Reset(void);
+    CLOCK::time_point Lap(PHASE_T, CLOCK::time_point);
+    void Move(MOVE_T kind)      { moves[kind]++; }
+    void Tick(CLOCK::duration);
+
+    UI64 Ticks(void)        const   { return ticks; }
+    UI64 PhaseNs(PHASE_T p) const   { return phase_ns[p]; }
+    UI64 Moves(MOVE_T kind) const   { return moves[kind]; }
+    UI64 Percentile(UI32) const;
+
+    private:
+    UI64 phase_ns[PHASE_COUNT];
+    UI64 moves[MOVE_COUNT];
+    UI64 buckets[PERF_BUCKETS];
+    UI64 ticks;
+
+    static UI32 Bucket(UI64);
+    static UI64 BucketStart(UI32);
+};
+
+#endif // PERFSTATS_H_INCLUDED
+
+/* CLASS PERFSTATS PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION PerfStats::Bucket
+ *  @brief  Returns the bucket of a latency. Latencies under 4 us have a
+ *          bucket each; every power of two after them is split in four.
+ *  @param  us: The latency in microseconds.
+ */
+UI32 PerfStats::Bucket(UI64 us)
+{
+    if (us < 4) return us;
+
+    UI32 log = 63 - __builtin_clzll(us);
+    return std::min<UI32>((log - 1) * 4 + ((us >> (log - 2)) & 3), PERF_BUCKETS - 1);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION PerfStats::BucketStart
+ *  @brief  Returns the smallest latency, in microseconds, of a bucket.
+ *  @param  bucket: The bucket.
+ */
+UI64 PerfStats::BucketStart(UI32 bucket)
+{
+    if (bucket < 4) return bucket;
+
+    return (UI64)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+/* CLASS PERFSTATS PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION PerfStats::Reset
+ *  @brief  Forgets everything measured so far.
+ */
+void PerfStats::Reset(void)
+{
+    memset(phase_ns, 0, sizeof(phase_ns));
+    memset(moves, 0, sizeof(moves));
+    memset(buckets, 0, sizeof(buckets));
+    ticks = 0;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION PerfStats::Lap
+ *  @brief  Adds the time since the given point to a phase.
+ *  @param  phase: The phase that took the time.
+ *  @param  since: When the phase began.
+ *  @return Now, when the next phase begins.
+ */
+PerfStats::CLOCK::time_point PerfStats::Lap(PHASE_T phase, CLOCK::time_point since)
+{
+    CLOCK::time_point now = CLOCK::now();
+    phase_ns[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+
+    return now;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION PerfStats::Tick
+ *  @brief  Counts a tick and the latency it was served with.
+ *  @param  latency: The time from when the tick was due to when its frame
+ *          was drawn.
+ */
+void PerfStats::Tick(CLOCK::duration latency)
+{
+    ticks++;
+    buckets[Bucket(std::chrono::duration_cast<std::chrono::microseconds>(latency).count())]++;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION PerfStats::Percentile
+ *  @brief  Returns the tick latency that the given percentage of the ticks
+ *          were served within, as the end of its bucket.
+ *  @param  pct: The percentage.
+ *  @return The latency in microseconds, 0 before the first tick.
+ */
+UI64 PerfStats::Percentile(UI32 pct) const
+{
+    if (ticks == 0) return 0;
+
+    UI64 rank = (ticks * pct + 99) / 100, seen = 0;
+    for (UI32 i = 0; i < PERF_BUCKETS - 1; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank) return BucketStart(i + 1);
+    }
+
+    return BucketStart(PERF_BUCKETS - 1);
+}
+
+#ifndef ENGINE_H_INCLUDED
+#define ENGINE_H_INCLUDED
+
+/**
+ *  CLASS: Engine
+ *  @brief      Engine controls every basic aspect of the game;
+ *              be that the monsters' and player's moves, collisions
+ *              or the proper initialisation of levels. It also holds an
+ *              inner struct for use as an exception when the user presses
+ *              the escape key to end the current game.
+ */
+class Engine
+{
+    public:
+    Engine() : player("Player 1"), perf(NULL), turns(0)
+    { Seed((UI64)0); }
+
+    typedef struct esc_struct
+    {   // Used as exception for when the user presses the escape key
+        std::string esc_reason;
+
+        esc_struct(const std::string& _reason) : esc_reason(_reason)
+        {}
+    }   Escape;
+
+    void InitLevel(const std::string&);
+    void InitLevel(const char*, size_t);
+    void InitLevel(const MapCache&);
+    void InitLevel(const std::shared_ptr<const Maze>&);
+    void InitLevel(Stage&);
+    void EndLevel(void);
+    COLL_T CheckMapCollision(POS);
+    TURN_T Step(I32);
+    UI32 Turns(void) const  { return turns; }
+
+    void Seed(const Philox&);
+    void Seed(UI64 seed)    { Seed(Philox(seed)); }
+    void Profile(PerfStats* stats)  { perf = stats; }
+
+    void NewMove(Living*, I32);
+    void NewSmartMove(UI32, UI8);
+    void NewDummyMove(UI32, UI8);
+
+    Stage stage;
+    Potter player;
+    Monsters monsters;
+
+    private:
+    FlowField flow;
+    Trails visits;      // How many times each monster has left each cell, for the wandering ones
+    std::vector<UI8> open_moves;    // The directions each monster may move to this turn
+    Philox rng;
+    PerfStats* perf;    // Where the turns are measured, if anywhere
+    UI32 turns;
+    void StartLevel(void);
+    void InitPos(void);
+    void MoveMonsters(void);
+    bool Caught(POS) const;
+    void InitMoveMaps(void);
+    void DestroyMoveMaps(void);
+};
+
+#endif // ENGINE_H_INCLUDED
+
+/* CLASS ENGINE PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::InitPos
+ *  @brief  Initialises the positions of the living creatures on the
+ *          map. The monsters the map declares start where the map puts
+ *          them and Harry is positioned randomly on a free cell of the stage,
+ *          so never on a monster, a diamond or the parchment. Maps that
+ *          declare no monsters get a gnome and a traal, positioned the same
+ *          way.
+ */
+void Engine::InitPos(void)
+{
+    monsters.Reset(stage.MapWidth(), stage.MapHeight());
+    for (UI32 i = 0; i < stage.SpawnCount(); i++)
+        monsters.Add(stage.SpawnPos(i), stage.SpawnKind(i));
+
+    // Positioning Harry
+    player.SetPos(stage.TakeCell(rng));
+
+    if (monsters.Count() > 0)
+        return;
+
+    // Positioning Gnome and Traal
+    monsters.Add(stage.TakeCell(rng), SMART);
+    monsters.Add(stage.TakeCell(rng), DUMMY);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::InitMoveMaps
+ *  @brief  Initialises the movement maps of the monsters. Each monster has a
+ *          map of its own, but only the cells it has actually left are kept,
+ *          so thousands of monsters do not cost thousands of whole mazes.
+ */
+void Engine::InitMoveMaps(void)
+{
+    visits.Reset();
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::DestroyMoveMaps
+ *  @brief  Dealocates the memory occupied by the monsters' movement maps.
+ */
+void Engine::DestroyMoveMaps(void)
+{
+    visits.Clear();
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::MoveMonsters
+ *  @brief  Gives every monster its move for the turn, in the order they
+ *          were added to the level. The walls do not change during the turn
+ *          and a monster is only ever moved by its own move, so the directions
+ *          open to all of them are looked up in one batch beforehand.
+ */
+void Engine::MoveMonsters(void)
+{
+    UI32 count = monsters.Count();
+    if (count == 0) return;
+
+    open_moves.resize(count);
+    stage.Bits().MoveMasks(&monsters.pos[0], count, &open_moves[0]);
+
+    for (UI32 i = 0; i < count; i++)
+    {
+        monsters.cells.Stay(i, monsters.pos[i]);
+
+        if (monsters.kind[i] == SMART)  NewSmartMove(i, open_moves[i]);
+        else                            NewDummyMove(i, open_moves[i]);
+    }
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::Caught
+ *  @brief  Tells whether a monster has caught Harry, either by standing on his
+ *          cell or by swapping cells with him during the turn. With Harry moving
+ *          first no monster can reach his old cell from his new one without
+ *          having caught him there already, but the check does not rely on the
+ *          order of the moves.
+ *  @param  from: The cell Harry stood on at the beginning of the turn.
+ */
+bool Engine::Caught(POS from) const
+{
+    POS at = player.CurPos();
+
+    if (monsters.Find(at) != Monsters::NOBODY)
+        return true;
+
+    return !(at == from) && monsters.Crossed(at, from) != Monsters::NOBODY;
+}
+
+/* CLASS ENGINE PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::Seed
+ *  @brief  Sets the generator used to place the creatures and derives from it
+ *          the one the stage uses to place the diamonds and the parchment. Two
+ *          engines seeded alike play exactly the same levels, whatever thread
+ *          they run on.
+ *  @param  _rng: The generator to use.
+ */
+void Engine::Seed(const Philox& _rng)
+{
+    rng = _rng.Split(0);
+    stage.Seed(_rng.Split(1));
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::InitLevel
+ *  @brief  Performs all the necessary actions to set a game level,
+ *          according to the map file passed as argument. The map is
+ *          loaded through its cache file.
+ *  @param  filename: The map file.
+ */
+void Engine::InitLevel(const std::string& filename)
+{
+    stage.Load(filename);
+    StartLevel();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::InitLevel
+ *  @brief  Performs all the necessary actions to set a game level,
+ *          according to the map text passed as argument.
+ *  @param  text: The text of a map, as in a map file.
+ *  @param  size: The length of the text.
+ */
+void Engine::InitLevel(const char* text, size_t size)
+{
+    stage.Parse(text, size);
+    StartLevel();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::InitLevel
+ *  @brief  Performs all the necessary actions to set a game level,
+ *          according to the open cache file of a map.
+ *  @param  cache: The cache file of the map.
+ */
+void Engine::InitLevel(const MapCache& cache)
+{
+    stage.Load(cache);
+    StartLevel();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::InitLevel
+ *  @brief  Performs all the necessary actions to set a game level on a maze
+ *          that is already built, which the level shares.
+ *  @param  maze: The maze.
+ */
+void Engine::InitLevel(const std::shared_ptr<const Maze>& maze)
+{
+    stage.Load(maze);
+    StartLevel();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::InitLevel
+ *  @brief  Performs all the necessary actions to set a game level, taking
+ *          over a stage that was loaded beforehand.
+ *  @param  ready: The loaded stage. It is swapped with the unloaded stage of
+ *                 the engine, so it can be loaded again afterwards.
+ */
+void Engine::InitLevel(Stage& ready)
+{
+    if (stage.MapWidth() != 0 || stage.MapHeight() != 0)
+        throw GENEXP("General error in Engine::InitLevel:\nInvalid initial class values. You need to call EndLevel first.");
+
+    std::swap(stage, ready);
+    StartLevel();
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Engine::StartLevel
+ *  @brief  Sets up the creatures and the move maps of a level once its stage
+ *          is loaded.
+ */
+void Engine::StartLevel(void)
+{
+    InitMoveMaps();
+    InitPos();
+
+    flow.Reset(stage.Map(), stage.Graph());
+    player.CollisionState(COLL_T::NONE);
+    turns = 0;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::EndLevel
+ *  @brief  Performs all the necessary actions to end a game level,
+ */
+void Engine::EndLevel(void)
+{
+    DestroyMoveMaps();
+
+    stage.Unload();
+    stage.DiamondsCount(10);
+
+    player.SetPos(POS());
+    monsters.Clear();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::CheckMapCollision
+ *  @brief  Calculates whether a given Living creature collides with another
+ *          object on the stage.
+ *  @param  liv_pos: The position that needs to be checked for collisions.
+ */
+COLL_T Engine::CheckMapCollision(POS liv_pos)
+{
+    // Positions that wrapped around below zero are off the map as well
+    if (liv_pos.x >= stage.MapWidth() || liv_pos.y >= stage.MapHeight())
+        return COLL_T::WALL;
+
+    if (stage.Bits().Wall(liv_pos.x, liv_pos.y))    return COLL_T::WALL;
+    if (stage.Diamond(liv_pos.x, liv_pos.y))        return COLL_T::DMND;
+
+    if (stage.DiamondsCount() == 0)
+        if (liv_pos == stage.parch_pos)
+            return COLL_T::PARCH;
+
+    return COLL_T::NONE;
+}
+
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::Step
+ *  @brief  Plays a single game turn: moves Harry according to the input, moves
+ *          the monsters, updates the score and the stage and reports how the
+ *          turn ended. It touches nothing but the engine's own members, so any
+ *          number of engines can be stepped independently.
+ *          With a PerfStats to profile into, the phases of the turn are timed.
+ *  @param  key: The key the player pressed during the turn (ERR for none).
+ *  @return PLAYING if the level goes on, WON if Harry reached the parchment,
+ *          LOST if a monster caught him or ESCAPED if the player quit.
+ */
+TURN_T Engine::Step(I32 key)
+{
+    if (key == KEY_ESCAPE) return TURN_T::ESCAPED;
+
+    POS from = player.CurPos();
+    PerfStats::CLOCK::time_point lap;
+    if (perf) lap = PerfStats::CLOCK::now();
+
+    turns++;
+    NewMove(&player, key);
+    if (perf) lap = perf->Lap(PHASE_T::PLAYER_PHASE, lap);
+
+    switch (CheckMapCollision(player.CurPos()))
+    {
+        case COLL_T::NONE:  player.CollisionState(COLL_T::NONE);    break;
+        case COLL_T::DMND:  player.CollisionState(COLL_T::DMND);    break;
+        case COLL_T::PARCH: player.CollisionState(COLL_T::PARCH);   break;
+        default:            break;
+    }
+
+    if (monsters.Find(player.CurPos()) != Monsters::NOBODY)
+        player.CollisionState(COLL_T::MONSTER);
+
+    if (player.CollisionState() != COLL_T::MONSTER)
+    {
+        if (perf) lap = perf->Lap(PHASE_T::COLLISION_PHASE, lap);
+        MoveMonsters();
+        if (perf) lap = perf->Lap(PHASE_T::MONSTERS_PHASE, lap);
+
+        if (Caught(from))
+            player.CollisionState(COLL_T::MONSTER);
+    }
+
+    if (perf) perf->Lap(PHASE_T::COLLISION_PHASE, lap);
+
+    switch (player.CollisionState())
+    {
+        case COLL_T::DMND:
+        player.AddToScore(10);
+        stage.EraseDiamond(player.CurPos());
+        return TURN_T::PLAYING;
+
+        case COLL_T::MONSTER:
+        return TURN_T::LOST;
+
+        case COLL_T::PARCH:
+        player.AddToScore(100);
+        return TURN_T::WON;
+
+        default:
+        return TURN_T::PLAYING;
+    }
+}   // Engine::Step
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::NewMove
+ *  @brief  It moves a creature to a new position according to the key provided,
+ *          only if  no wall collisions occur!
+ *  @param  creature: The creature to be moved.
+ *  @param  key: Value representing the direction of movement.
+ */
+void Engine::NewMove(Living* creature, I32 key)
+{
+    UI8 open = stage.Bits().MoveMask(creature->CurX(), creature->CurY());
+
+    switch(key)
+    {
+        case KEY_UP:
+        if (open & UP)      creature->MoveUp();
+        break;
+
+        case KEY_DOWN:
+        if (open & DOWN)    creature->MoveDown();
+        break;
+
+        case KEY_LEFT:
+        if (open & LEFT)    creature->MoveLeft();
+        break;
+
+        case KEY_RIGHT:
+        if (open & RIGHT)   creature->MoveRight();
+        break;
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::NewSmartMove
+ *  @brief  Moves a monster one step closer to Harry. The step is read from the
+ *          shared flow field, which is rebuilt only when Harry has changed
+ *          position since its last build. If Harry cannot be reached from the
+ *          monster's position, the monster wanders like a dummy one.
+ *  @param  i: The number of the monster to be moved.
+ *  @param  open: The directions the monster may move to, as MapBits::MoveMask
+ *          gives them.
+ */
+void Engine::NewSmartMove(UI32 i, UI8 open)
+{
+    flow.Update(stage.Map(), player.CurPos());
+
+    UI8 direction = flow.NextStep(monsters.pos[i]);
+
+    if (direction & open)   // The walls have the last word, whatever the graph says
+    {
+        if (perf) perf->Move(MOVE_T::SMART_STEP);
+        monsters.Move(i, direction);
+    }
+    else if (!(monsters.pos[i] == player.CurPos()))
+    {
+        if (perf) perf->Move(MOVE_T::SMART_WANDER);
+        NewDummyMove(i, open);
+    }
+}   // Engine::NewSmartMove
+
+/**
+ *  PUBLIC MEMBER FUNCTION Engine::NewDummyMove
+ *  @brief  This function is used to move a Monster randomly. The algorithm
+ *          does not allow the creature to get stuck in one route.
+ *  @param  i: The number of the monster to be moved.
+ *  @param  open: The directions the monster may move to, as MapBits::MoveMask
+ *          gives them.
+ */
+void Engine::NewDummyMove(UI32 i, UI8 open)
+{
+    const Grid<I8>& map = stage.Map();
+    POS at = monsters.pos[i];
+    UI32 here = map.Index(at.x, at.y);
+    UI32 prev = map.Index(monsters.prev_pos[i].x, monsters.prev_pos[i].y);
+
+    UI32 toup = map.Up(here);
+    UI32 toright = map.Right(here);
+    UI32 todown = map.Down(here);
+    UI32 toleft = map.Left(here);
+
+    bool up_free = open & UP;
+    bool right_free = open & RIGHT;
+    bool down_free = open & DOWN;
+    bool left_free = open & LEFT;
+    UI8 direction = 0;
+    MOVE_T level = MOVE_T::DUMMY_LEVEL1;
+
+    // A monster never leaves a wall it never stood on, so only the open cells are looked up
+    UI32 visits_up = up_free ? visits.Count(i, toup) : 0;
+    UI32 visits_right = right_free ? visits.Count(i, toright) : 0;
+    UI32 visits_down = down_free ? visits.Count(i, todown) : 0;
+    UI32 visits_left = left_free ? visits.Count(i, toleft) : 0;
+
+    // Level 1: Head for the less visited of two opposite cells
+    if (up_free && visits_up < visits_down)                 direction = UP;
+    else if (down_free && visits_down < visits_up)          direction = DOWN;
+    else if (right_free && visits_right < visits_left)      direction = RIGHT;
+    else if (left_free && visits_left < visits_right)       direction = LEFT;
+
+    // Level 2: Head for any cell less visited than the one the monster came from
+    if (!direction)
+    {
+        level = MOVE_T::DUMMY_LEVEL2;
+        UI32 visits_prev = visits.Count(i, prev);
+
+        if (up_free && visits_up < visits_prev)                 direction = UP;
+        else if (right_free && visits_right < visits_prev)      direction = RIGHT;
+        else if (down_free && visits_down < visits_prev)        direction = DOWN;
+        else if (left_free && visits_left < visits_prev)        direction = LEFT;
+    }
+
+    // Level 3: Head anywhere possible
+    if (!direction)
+    {
+        level = MOVE_T::DUMMY_LEVEL3;
+
+        if (up_free)            direction = UP;
+        else if (right_free)    direction = RIGHT;
+        else if (down_free)     direction = DOWN;
+        else if (left_free)     direction = LEFT;
+        else                    level = MOVE_T::DUMMY_STUCK;
+    }
+
+    // Gnomes that wander are already counted as such by NewSmartMove
+    if (perf && monsters.kind[i] == DUMMY) perf->Move(level);
+
+    if (direction)
+    {
+        visits.Leave(i, here);
+        monsters.Move(i, direction);
+    }
+}   // Engine::NewDummyMove
+
+#ifndef REPLAY_H_INCLUDED
+#define REPLAY_H_INCLUDED
+
+/**
+ *  CLASS: Recording
+ *  @brief      Recording holds everything needed to play a game again: the seed
+ *              the engine was given, the maps in the order they were played and
+ *              the keys passed to Engine::Step. Only turns with a key pressed are
+ *              stored, each one as the number of turns since the previous key
+ *              followed by the key, both varint encoded. Every map is stored
+ *              along with the hash of its text, and a recording whose maps have
+ *              changed since is not loaded, as it would play another game.
+ */
+class Recording
+{
+    public:
+    Recording() : seed(0), turn(0), total_turns(0), cursor(0), event_turn(0), event_key(ERR)
+    {}
+
+    void Start(UI64, const std::vector<std::string>&);
+    void Record(I32);
+    void Save(const std::string&);
+    void Load(const std::string&);
+
+    void Rewind(void);
+    I32 NextKey(void);
+    bool Finished(void) const   { return turn >= total_turns; }
+
+    UI64 Seed(void) const                           { return seed; }
+    const std::vector<std::string>& Maps(void) const { return maps; }
+
+    private:
+    UI64 seed;
+    std::vector<std::string> maps;
+    std::vector<UI64> hashes;   // Of the text of every map, 0 if it could not be read
+    std::vector<UI8> events;
+    UI32 turn, total_turns;
+
+    size_t cursor;      // Playback state
+    UI32 event_turn;
+    I32 event_key;
+
+    static void PutVarint(std::vector<UI8>&, UI64);
+    static UI64 MapHash(const std::string&);
+    UI64 GetVarint(const std::vector<UI8>&, size_t&) const;
+    void NextEvent(void);
+};
+
+#endif // REPLAY_H_INCLUDED
+
+/* CLASS RECORDING PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE STATIC MEMBER FUNCTION Recording::PutVarint
+ *  @brief  Appends a number to a buffer, seven bits per byte, lowest bits first.
+ *          The high bit of a byte is set when more bytes follow.
+ */
+void Recording::PutVarint(std::vector<UI8>& buf, UI64 value)
+{
+    while (value >= 0x80)
+    {
+        buf.push_back((UI8)(value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back((UI8)value);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Recording::GetVarint
+ *  @brief  Reads a number written by PutVarint and moves the position past it.
+ */
+UI64 Recording::GetVarint(const std::vector<UI8>& buf, size_t& pos) const
+{
+    UI64 value = 0;
+
+    for (UI8 shift = 0; shift < 64; shift += 7)
+    {
+        if (pos >= buf.size())
+            throw GENEXP("General error in Recording::Load:\nThe recording is truncated");
+
+        UI8 byte = buf[pos++];
+        value |= (UI64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+
+    throw GENEXP("General error in Recording::Load:\nInvalid data were found in the recording");
+}
+
+/**
+ *  PRIVATE STATIC MEMBER FUNCTION Recording::MapHash
+ *  @brief  Returns the hash of the text of a map, as the map cache takes it.
+ *  @param  map_name: The map file.
+ *  @return The hash, or 0 if the file could not be read.
+ */
+UI64 Recording::MapHash(const std::string& map_name)
+{
+    MapFile file;
+    if (!file.Open(map_name)) return 0;
+
+    return MapCache::Hash(file.Data(), file.Size());
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Recording::NextEvent
+ *  @brief  Decodes the next recorded key, or marks that there are no more.
+ */
+void Recording::NextEvent(void)
+{
+    if (cursor >= events.size())
+    {
+        event_key = ERR;
+        event_turn = total_turns;
+        return;
+    }
+
+    event_turn += GetVarint(events, cursor);
+    event_key = (I32)GetVarint(events, cursor);
+}
+
+/* CLASS RECORDING PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::Start
+ *  @brief  Starts recording a new game, discarding anything recorded before.
+ *  @param  _seed: The seed the engine was given for the game.
+ *  @param  _maps: The maps of the game.
+ */
+void Recording::Start(UI64 _seed, const std::vector<std::string>& _maps)
+{
+    seed = _seed;
+    maps = _maps;
+    hashes.clear();
+    for (size_t i = 0; i < maps.size(); i++)
+        hashes.push_back(MapHash(maps[i]));
+    events.clear();
+    turn = total_turns = event_turn = 0;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::Record
+ *  @brief  Records the key passed to Engine::Step for one turn.
+ *  @param  key: The key, or ERR if no key was pressed during the turn.
+ */
+void Recording::Record(I32 key)
+{
+    turn++;
+    total_turns = turn;
+
+    if (key == ERR) return;
+
+    PutVarint(events, turn - event_turn);
+    PutVarint(events, (UI32)key);
+    event_turn = turn;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::Save
+ *  @brief  Writes the recording to the given file.
+ *  @param  filename: The file to write.
+ */
+void Recording::Save(const std::string& filename)
+{
+    std::vector<UI8> header(REPLAY_MAGIC, REPLAY_MAGIC + 4);
+    header.push_back(REPLAY_VERSION);
+    PutVarint(header, seed);
+    PutVarint(header, total_turns);
+    PutVarint(header, maps.size());
+
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+        PutVarint(header, maps[i].length());
+        header.insert(header.end(), maps[i].begin(), maps[i].end());
+        PutVarint(header, hashes[i]);
+    }
+
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!out) throw FILEEXP(filename, "output");
+
+    out.write((const char*)&header[0], header.size());
+    if (!events.empty())
+        out.write((const char*)&events[0], events.size());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::Load
+ *  @brief  Reads a recording from the given file and rewinds it for playback.
+ *          A recording of maps that are not as they were is refused.
+ *  @param  filename: The file to read.
+ */
+void Recording::Load(const std::string& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!in) throw FILEEXP(filename, "input");
+
+    std::vector<UI8> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t pos = 5;
+
+    if (data.size() < pos || memcmp(&data[0], REPLAY_MAGIC, 4) != 0 || data[4] != REPLAY_VERSION)
+        throw GENEXP("General error in Recording::Load:\nNot a recording of this version of the game");
+
+    seed = GetVarint(data, pos);
+    total_turns = GetVarint(data, pos);
+    // Every map takes at least a byte of length and a byte of hash, so a count
+    // the rest of the file cannot hold is refused before anything is allocated
+    UI64 count = GetVarint(data, pos);
+    if (count > (data.size() - pos) / 2)
+        throw GENEXP("General error in Recording::Load:\nThe recording is truncated");
+
+    maps.resize(count);
+    hashes.resize(count);
+
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+        UI64 len = GetVarint(data, pos);
+        if (len > data.size() - pos)
+            throw GENEXP("General error in Recording::Load:\nThe recording is truncated");
+
+        maps[i].assign(data.begin() + pos, data.begin() + pos + len);
+        pos += len;
+
+        hashes[i] = GetVarint(data, pos);
+        if (MapHash(maps[i]) != hashes[i])
+            throw GENEXP("General error in Recording::Load:\nThe map " + maps[i] + " has changed since the game was recorded");
+    }
+
+    events.assign(data.begin() + pos, data.end());
+    Rewind();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::Rewind
+ *  @brief  Moves the playback back to the first turn.
+ */
+void Recording::Rewind(void)
+{
+    turn = 0;
+    cursor = 0;
+    event_turn = 0;
+    NextEvent();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Recording::NextKey
+ *  @brief  Plays back one turn.
+ *  @return The key recorded for the turn, or ERR if none was pressed.
+ */
+I32 Recording::NextKey(void)
+{
+    if (++turn != event_turn) return ERR;
+
+    I32 key = event_key;
+    NextEvent();
+
+    return key;
+}
+
+/**
+ *  FUNCTION replay_fast
+ *  @brief  Plays a recording on the given engine as fast as possible, with no
+ *          rendering at all, and prints how every level ended.
+ *  @param  engine: The engine to play on.
+ *  @param  rec: The recording to play.
+ *  @return How the last level played ended (PLAYING if the recording ran out).
+ */
+TURN_T replay_fast(Engine& engine, Recording& rec)
+{
+    static const char* outcome_names[] = { "recording ended", "won", "lost", "escaped" };
+    TURN_T outcome = TURN_T::WON;
+
+    rec.Rewind();
+    engine.Seed(rec.Seed());
+    engine.player.Score(0);
+
+    for (size_t i = 0; i < rec.Maps().size() && outcome == TURN_T::WON; i++)
+    {
+        try { engine.InitLevel(rec.Maps()[i]); }
+        catch(GENEXP& exp)
+        {   // The game skipped this map as well
+            printf("%s: %s\n", rec.Maps()[i].c_str(), exp.message.c_str());
+            engine.stage.Unload();
+            continue;
+        }
+
+        outcome = TURN_T::PLAYING;
+        while (outcome == TURN_T::PLAYING && !rec.Finished())
+            outcome = engine.Step(rec.NextKey());
+
+        printf("%s: %s after %u turns, score %u\n", rec.Maps()[i].c_str(),
+               outcome_names[outcome], engine.Turns(), engine.player.Score());
+
+        engine.EndLevel();
+    }
+
+    return outcome;
+}
+
+#ifndef LEVELLOADER_H_INCLUDED
+#define LEVELLOADER_H_INCLUDED
+
+/**
+ *  CLASS: LevelLoader
+ *  @brief      LevelLoader loads the stage of the next level on a thread of its
+ *              own, so that it is ready by the time the current level ends.
+ *              A stage only draws random numbers while it is loaded, so a stage
+ *              seeded with the generator of the current stage, once that one is
+ *              loaded, places the diamonds and the parchment exactly where the
+ *              engine itself would have placed them. Games, and the recordings
+ *              of games, are the same whether the levels are loaded ahead or not.
+ */
+class LevelLoader
+{
+    public:
+    LevelLoader() : failed(false)
+    {}
+    ~LevelLoader()  { Wait(); }
+
+    void Start(const std::string&, const Philox&);
+    void Finish(Engine&);
+
+    private:
+    LevelLoader(const LevelLoader&);
+    LevelLoader& operator = (const LevelLoader&);
+
+    std::thread worker;
+    Stage stage;
+    bool failed;
+    std::string error;
+
+    void Wait(void)     { if (worker.joinable()) worker.join(); }
+};
+
+#endif // LEVELLOADER_H_INCLUDED
+
+/* CLASS LEVELLOADER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION LevelLoader::Start
+ *  @brief  Starts loading a map in the background, waiting first for the
+ *          previous load, if any, to end.
+ *  @param  map_name: The map file.
+ *  @param  rng: The generator of the stage that is being played, after it
+ *               was loaded.
+ */
+void LevelLoader::Start(const std::string& map_name, const Philox& rng)
+{
+    Wait();
+
+    stage.Unload();
+    stage.DiamondsCount(DIAMONDS_DEFAULT_COUNT);
+    stage.Seed(rng);
+    failed = false;
+    error.clear();
+
+    worker = std::thread([this, map_name]()
+    {
+        try { stage.Load(map_name); }
+        catch(GENEXP& exp)
+        {
+            failed = true;
+            error = exp.message;
+        }
+    });
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION LevelLoader::Finish
+ *  @brief  Waits for the map to be loaded and sets the level on the engine.
+ *  @param  engine: The engine, with no level set.
+ *  @note   Throws the error of the load, if it failed, as Engine::InitLevel
+ *          would have.
+ */
+void LevelLoader::Finish(Engine& engine)
+{
+    Wait();
+
+    if (failed)
+    {
+        failed = false;
+        throw GENEXP(error);
+    }
+
+    engine.InitLevel(stage);
+}
+
+#ifndef TICKSCHEDULER_H_INCLUDED
+#define TICKSCHEDULER_H_INCLUDED
+
+/**
+ *  CLASS: TickScheduler
+ *  @brief      TickScheduler paces the game turns on the monotonic clock. Tick n
+ *              is due at start + n * period, whatever the time the turns before
+ *              it took to play and draw, so the cadence does not drift. After a
+ *              stall, the ticks missed are played back to back, but no more than
+ *              max_catchup of them at once; the older ones are dropped and the
+ *              schedule carries on from the next tick boundary.
+ */
+class TickScheduler
+{
+    public:
+    typedef std::chrono::steady_clock CLOCK;
+
+    TickScheduler(UI32 period_ms = TICK_DEFAULT_MS, UI32 _max_catchup = TICK_MAX_CATCHUP) :
+        period(std::chrono::milliseconds(period_ms)), max_catchup(_max_catchup), dropped(0)
+    { Start(); }
+
+    void Start(void)            { next = CLOCK::now() + period; }
+    void Wait(void) const       { std::this_thread::sleep_until(next); }
+    UI32 Due(void);
+    CLOCK::time_point LastDue(void) const   { return next - period; }
+    I32 Timeout(void) const;
+    UI64 Dropped(void) const    { return dropped; }
+
+    private:
+    CLOCK::duration period;
+    CLOCK::time_point next;     // When the next tick is due
+    UI32 max_catchup;
+    UI64 dropped;
+};
+
+#endif // TICKSCHEDULER_H_INCLUDED
+
+/* CLASS TICKSCHEDULER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION TickScheduler::Due
+ *  @brief  Returns how many ticks are due by now, at most max_catchup, and
+ *          moves the schedule past all of them.
+ */
+UI32 TickScheduler::Due(void)
+{
+    CLOCK::time_point now = CLOCK::now();
+    if (now < next) return 0;
+
+    UI64 late = (now - next) / period + 1;
+    next += period * late;
+
+    if (late <= max_catchup)
+        return late;
+
+    dropped += late - max_catchup;
+    return max_catchup;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION TickScheduler::Timeout
+ *  @brief  Returns how long to wait for the next tick, for poll() and the like.
+ *  @return The time in ms, rounded up, or 0 if a tick is due already.
+ */
+I32 TickScheduler::Timeout(void) const
+{
+    CLOCK::time_point now = CLOCK::now();
+    if (now >= next) return 0;
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(next - now + std::chrono::milliseconds(1) -
+                                                                 CLOCK::duration(1)).count();
+}
+
+#ifndef MAZEGENERATOR_H_INCLUDED
+#define MAZEGENERATOR_H_INCLUDED
+
+/**
+ *  CLASS: MazeGenerator
+ *  @brief      MazeGenerator makes random mazes as map text, ready for
+ *              Stage::Parse or to be written as a map file. The maze is a lattice
+ *              of square rooms, corridor cells wide, with one cell thick walls
+ *              between them. It is made one row of rooms at a time with Eller's
+ *              algorithm, so the time is linear in the size of the maze and the
+ *              extra memory is two arrays as long as one row.
+ *              With no loops, there is exactly one path between any two rooms.
+ *              The loop density is the percentage of the walls between two
+ *              rooms already joined that is opened anyway, each one adding a
+ *              loop. The same seed always makes the same maze.
+ */
+class MazeGenerator
+{
+    public:
+    MazeGenerator(UI64 seed, UI32 _loops = 0, UI32 _corridor = 1) :
+        rng(seed), loops(_loops), corridor(_corridor), coins(0), coins_left(0)
+    {}
+
+    void Generate(UI32, UI32, std::string&);
+    void Write(UI32, UI32, const std::string&);
+
+    private:
+    Philox rng;
+    UI32 loops;     // Percentage of the extra walls opened
+    UI32 corridor;  // Width of the rooms and corridors
+    UI32 coins;     // Random bits not used yet
+    UI8 coins_left;
+
+    // The rooms of the current row that are joined are linked in a ring, in
+    // the order of their columns
+    std::vector<UI32> prev, next;
+
+    bool Coin(void);
+};
+
+#endif // MAZEGENERATOR_H_INCLUDED
+
+/* CLASS MAZEGENERATOR PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION MazeGenerator::Coin
+ *  @brief  Returns a random bit. The bits of every number drawn are used one
+ *          by one, since the maze needs one or two of them per room.
+ */
+inline bool MazeGenerator::Coin(void)
+{
+    if (coins_left == 0)
+    {
+        coins = rng.Next();
+        coins_left = 32;
+    }
+
+    coins_left--;
+    bool bit = coins & 1;
+    coins >>= 1;
+
+    return bit;
+}
+
+/* CLASS MAZEGENERATOR PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION MazeGenerator::Generate
+ *  @brief  Makes a maze of the given size. The rooms take as much of it as they
+ *          fit in; any space left on the right and at the bottom is wall.
+ *  @param  width: The width of the map, in cells.
+ *  @param  height: The height of the map, in cells.
+ *  @param  text: Receives the text of the map, one line per row.
+ */
+void MazeGenerator::Generate(UI32 width, UI32 height, std::string& text)
+{
+    const UI32 step = corridor + 1;
+
+    if (corridor == 0 || width < step + 2 || height < step + 2)
+        throw GENEXP("General error in MazeGenerator::Generate:\nThe maze is too small for its corridors");
+    if (width > COORD_MAX || height > COORD_MAX)
+        throw GENEXP("General error in MazeGenerator::Generate:\nThe maze is too large");
+
+    const UI32 cols = (width - 1) / step, rows = (height - 1) / step;
+    const size_t line = (size_t)width + 1;
+
+    text.assign(line * height, '*');
+    for (size_t y = 0; y < height; y++)
+        text[y * line + width] = '\n';
+
+    prev.resize(cols);
+    next.resize(cols);
+    for (UI32 c = 0; c < cols; c++)
+        prev[c] = next[c] = c;
+
+    for (UI32 r = 0; r < rows; r++)
+    {
+        bool last = r + 1 == rows;
+        char* first = &text[(1 + (size_t)r * step) * line];
+        char* below = first + corridor * line;
+
+        for (UI32 c = 0; c < cols; c++)
+        {
+            memset(first + 1 + c * step, ' ', corridor);
+
+            // Since the rings are in column order, two rooms side by side are
+            // joined already when they follow each other in their ring
+            if (c + 1 < cols)
+            {
+                bool open;
+
+                if (prev[c + 1] != c)
+                {
+                    open = last || Coin();
+                    if (open)
+                    {   // Splice the ring of c + 1 in after c
+                        next[prev[c + 1]] = next[c];
+                        prev[next[c]] = prev[c + 1];
+                        next[c] = c + 1;
+                        prev[c + 1] = c;
+                    }
+                }
+                else open = loops && rng.Below(100) < loops;
+
+                if (open) first[(c + 1) * step] = ' ';
+            }
+
+            // A room keeps the wall below only if some other room of its ring
+            // is left to go down; it then starts a ring of its own
+            if (last) continue;
+
+            if (prev[c] != c && Coin())
+            {
+                prev[next[c]] = prev[c];
+                next[prev[c]] = next[c];
+                prev[c] = next[c] = c;
+            }
+            else memset(below + 1 + c * step, ' ', corridor);
+        }
+
+        for (UI32 y = 1; y < corridor; y++)
+            memcpy(first + y * line, first, width);
+    }
+}   // MazeGenerator::Generate
+
+/**
+ *  PUBLIC MEMBER FUNCTION MazeGenerator::Write
+ *  @brief  Makes a maze of the given size and writes it as a map file.
+ *  @param  width: The width of the map, in cells.
+ *  @param  height: The height of the map, in cells.
+ *  @param  filename: The map file to write.
+ */
+void MazeGenerator::Write(UI32 width, UI32 height, const std::string& filename)
+{
+    std::string text;
+    Generate(width, height, text);
+
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!out) throw FILEEXP(filename, "output");
+
+    out.write(text.data(), text.size());
+    if (!out) throw FILEEXP(filename, "output");
+}
+
+#ifndef HEADLESS
+
+#ifndef KEYDECODER_H_INCLUDED
+#define KEYDECODER_H_INCLUDED
+
+/**
+ *  CLASS: KeyDecoder
+ *  @brief      KeyDecoder turns the bytes a terminal sends into keys, one byte at
+ *              a time. A lone escape byte is the escape key, and "ESC [ A" to
+ *              "ESC [ D", or "ESC O A" to "ESC O D", are the arrow keys. Other
+ *              escape sequences are skipped. Whether an escape byte is the key
+ *              or starts a sequence is told by the byte after it, or by no byte
+ *              coming for a while, after which the caller expires it.
+ */
+class KeyDecoder
+{
+    public:
+    KeyDecoder() : state(TEXT)
+    {}
+
+    template <typename PUSH> void Feed(UI8, PUSH);
+    template <typename PUSH> void Expire(PUSH);
+    bool Waiting(void) const    { return state != TEXT; }
+
+    private:
+    typedef enum
+    {
+        TEXT, ESCAPED, SEQUENCE
+    }   STATE_T;
+
+    STATE_T state;
+};
+
+#endif // KEYDECODER_H_INCLUDED
+
+/* CLASS KEYDECODER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION KeyDecoder::Feed
+ *  @brief  Decodes the next byte, passing the keys it completes to push.
+ *  @param  byte: The byte.
+ *  @param  push: Takes a keycode.
+ */
+template <typename PUSH>
+void KeyDecoder::Feed(UI8 byte, PUSH push)
+{
+    static const I32 arrows[4] = { KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT };
+
+    switch (state)
+    {
+        case ESCAPED:
+        if (byte == '[' || byte == 'O')
+        {
+            state = SEQUENCE;
+            return;
+        }
+
+        // Not a sequence: the escape key, then whatever came after it
+        push(KEY_ESCAPE);
+        state = TEXT;
+        Feed(byte, push);
+        return;
+
+        case SEQUENCE:
+        // Parametres, up to the final byte of the sequence
+        if (byte >= 0x20 && byte < 0x40) return;
+
+        state = TEXT;
+        if (byte >= 'A' && byte <= 'D')
+            push(arrows[byte - 'A']);
+        return;
+
+        default:
+        if (byte == KEY_ESCAPE) state = ESCAPED;
+        else                    push(byte);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION KeyDecoder::Expire
+ *  @brief  Ends what the bytes decoded so far started, once no other byte
+ *          followed them in time: an escape byte is the escape key and the
+ *          start of a sequence is skipped.
+ *  @param  push: Takes a keycode.
+ */
+template <typename PUSH>
+void KeyDecoder::Expire(PUSH push)
+{
+    if (state == ESCAPED) push(KEY_ESCAPE);
+    state = TEXT;
+}
+
+#ifndef KEYQUEUE_H_INCLUDED
+#define KEYQUEUE_H_INCLUDED
+
+/**
+ *  CLASS: KeyQueue
+ *  @brief      KeyQueue holds the keys pressed between two turns and gives every
+ *              turn one key as the policy says: LATEST_WINS takes the last key
+ *              pressed since the turn before, BUFFER_AHEAD the first one and
+ *              keeps the last of the others for the next turn. The escape key
+ *              always comes first and the pause and debug keys are never
+ *              dropped.
+ */
+class KeyQueue
+{
+    public:
+    KeyQueue(INPUT_T _policy) : policy(_policy), pending(ERR), dropped(0)
+    {}
+
+    void Add(I32);
+    I32 Next(void);
+    UI64 Dropped(void) const    { return dropped; }
+
+    static bool IsCommand(I32 key)
+    { return key == KEY_PAUSE || key == 'P' || key == 'p' || key == ' '; }
+
+    private:
+    INPUT_T policy;
+    std::vector<I32> queued;        // Keys pressed, not used yet
+    I32 pending;                    // Key buffered for the next turn
+    UI64 dropped;
+};
+
+#endif // KEYQUEUE_H_INCLUDED
+
+/* CLASS KEYQUEUE PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION KeyQueue::Add
+ *  @brief  Adds a key pressed, or drops it if INPUT_QUEUE_SIZE keys are
+ *          already waiting.
+ *  @param  key: The keycode.
+ */
+void KeyQueue::Add(I32 key)
+{
+    if (queued.size() >= INPUT_QUEUE_SIZE)
+    {
+        dropped++;
+        return;
+    }
+
+    queued.push_back(key);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION KeyQueue::Next
+ *  @brief  Takes the key of the current turn, as the policy says.
+ *  @return The keycode, or ERR if no key was pressed.
+ */
+I32 KeyQueue::Next(void)
+{
+    if (std::find(queued.begin(), queued.end(), KEY_ESCAPE) != queued.end())
+    {
+        dropped += queued.size() - 1 + (pending != ERR);
+        queued.clear();
+        pending = ERR;
+        return KEY_ESCAPE;
+    }
+
+    // Pausing or opening the debug window takes a turn of its own
+    std::vector<I32>::iterator cmd = std::find_if(queued.begin(), queued.end(), IsCommand);
+    if (cmd != queued.end())
+    {
+        I32 key = *cmd;
+        queued.erase(cmd);
+        return key;
+    }
+
+    I32 key = pending;
+    pending = ERR;
+
+    if (queued.empty())
+        return key;
+
+    if (policy == INPUT_T::LATEST_WINS)
+    {
+        dropped += queued.size() - 1 + (key != ERR);
+        key = queued.back();
+    }
+    else
+    {
+        if (key == ERR)
+        {
+            key = queued.front();
+            queued.erase(queued.begin());
+        }
+        if (!queued.empty())
+        {
+            dropped += queued.size() - 1;
+            pending = queued.back();
+        }
+    }
+
+    queued.clear();
+    return key;
+}
+
+#ifndef KEYREADER_H_INCLUDED
+#define KEYREADER_H_INCLUDED
+
+/**
+ *  CLASS: KeyReader
+ *  @brief      KeyReader reads the keyboard on a thread of its own while a level
+ *              is played. The thread sleeps in poll() until the terminal has
+ *              input, decodes the escape sequences of the arrow keys itself and
+ *              pushes the keys into a lock-free ring that only it writes and
+ *              only the game reads, so no key is lost between two turns and the
+ *              game never waits for, or polls, the terminal. Every turn takes
+ *              one key from them through a KeyQueue.
+ */
+class KeyReader
+{
+    public:
+    KeyReader(INPUT_T policy) :
+        head(0), tail(0), overflow(0), keys(policy), in_pos(0), in_len(0)
+    { wake[0] = wake[1] = -1; }
+    ~KeyReader()    { Stop(); }
+
+    void Start(I32);
+    void Stop(void);
+    I32 NextKey(void);
+    UI64 Dropped(void) const    { return keys.Dropped() + overflow.load(std::memory_order_relaxed); }
+
+    private:
+    static const I32 READ_TIMEOUT = -1;
+    static const I32 READ_STOP = -2;
+
+    std::thread worker;
+    I32 wake[2];                    // Pipe that wakes the thread up to stop
+
+    // The ring: the thread only moves head, the game only moves tail
+    I32 ring[INPUT_QUEUE_SIZE];
+    std::atomic<UI32> head, tail;
+    std::atomic<UI64> overflow;     // Keys the thread found no room for
+
+    KeyQueue keys;                  // Keys taken from the ring, not used yet
+
+    UI8 in_buf[64];                 // Bytes read, not decoded yet
+    I32 in_pos, in_len;
+
+    void Run(I32);
+    I32 ReadByte(I32, I32);
+    void Push(I32);
+};
+
+#endif // KEYREADER_H_INCLUDED
+
+/* CLASS KEYREADER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION KeyReader::Start
+ *  @brief  Starts the thread that reads the keys.
+ *  @param  fd: The terminal to read, already in raw mode.
+ */
+void KeyReader::Start(I32 fd)
+{
+    if (worker.joinable()) return;
+    if (pipe(wake) != 0) throw GENEXP("Could not start the keyboard reader");
+
+    worker = std::thread(&KeyReader::Run, this, fd);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION KeyReader::Stop
+ *  @brief  Wakes the thread up and waits for it to end. Keys not taken yet
+ *          are thrown away.
+ */
+void KeyReader::Stop(void)
+{
+    if (!worker.joinable()) return;
+
+    UI8 byte = 0;
+    while (write(wake[1], &byte, 1) < 0 && errno == EINTR);
+    worker.join();
+
+    close(wake[0]);
+    close(wake[1]);
+    wake[0] = wake[1] = -1;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION KeyReader::NextKey
+ *  @brief  Takes the key of the current turn.
+ *  @return The keycode, or ERR if no key was pressed.
+ */
+I32 KeyReader::NextKey(void)
+{
+    for (UI32 t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_acquire); t != h; t++)
+    {
+        keys.Add(ring[t % INPUT_QUEUE_SIZE]);
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    return keys.Next();
+}
+
+/* CLASS KEYREADER PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION KeyReader::ReadByte
+ *  @brief  Returns the next byte from the terminal, waiting for it at most
+ *          timeout ms, or for ever if timeout is negative.
+ *  @param  fd: The terminal.
+ *  @param  timeout: The longest wait in ms.
+ *  @return The byte, READ_TIMEOUT or READ_STOP once the reader has to stop.
+ */
+I32 KeyReader::ReadByte(I32 fd, I32 timeout)
+{
+    while (in_pos == in_len)
+    {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+
+        I32 ready = poll(fds, 2, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0 || fds[1].revents) return READ_STOP;
+        if (ready == 0) return READ_TIMEOUT;
+
+        ssize_t got = read(fd, in_buf, sizeof(in_buf));
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (got <= 0) return READ_STOP;
+
+        in_pos = 0;
+        in_len = got;
+    }
+
+    return in_buf[in_pos++];
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION KeyReader::Push
+ *  @brief  Adds a key at the end of the ring, or drops it if the ring is full.
+ *  @param  key: The keycode.
+ */
+void KeyReader::Push(I32 key)
+{
+    UI32 h = head.load(std::memory_order_relaxed);
+
+    if (h - tail.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    {
+        overflow.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    ring[h % INPUT_QUEUE_SIZE] = key;
+    head.store(h + 1, std::memory_order_release);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION KeyReader::Run
+ *  @brief  The body of the thread. The bytes read are decoded into keys; an
+ *          escape byte that nothing follows for INPUT_ESC_DELAY_MS is the
+ *          escape key.
+ *  @param  fd: The terminal.
+ */
+void KeyReader::Run(I32 fd)
+{
+    KeyDecoder decoder;
+    std::function<void(I32)> push = [this](I32 key) { Push(key); };
+
+    for (;;)
+    {
+        I32 byte = ReadByte(fd, decoder.Waiting() ? INPUT_ESC_DELAY_MS : -1);
+        if (byte == READ_STOP) return;
+
+        if (byte == READ_TIMEOUT)   decoder.Expire(push);
+        else                        decoder.Feed(byte, push);
+    }
+}
+
+#ifndef FRAMEBUFFER_H_INCLUDED
+#define FRAMEBUFFER_H_INCLUDED
+
+/**
+ *  CLASS: FrameBuffer
+ *  @brief      FrameBuffer holds the cells of the map as they are to be shown:
+ *              the maze with its diamonds and parchment, and over it any number
+ *              of sprites, the last one on top. It remembers what the screen
+ *              shows, so a flush only emits the cells that differ, in screen
+ *              order. Only the cells written or covered by a sprite since the
+ *              last flush are looked at, so the cost of a frame grows with what
+ *              moved in it, not with the size of the map or of the screen.
+ */
+class FrameBuffer
+{
+    public:
+    FrameBuffer() : width(0), height(0)
+    {}
+
+    void Reset(UI32, UI32);
+    UI32 Width(void)    const   { return width; }
+    UI32 Height(void)   const   { return height; }
+
+    chtype At(UI32 x, UI32 y) const { return base[y * width + x]; }
+    void Put(UI32, UI32, chtype);
+    void PushSprite(UI32, UI32, chtype);
+    void PopSprite(void);
+    void ClearSprites(void);
+    void Redraw(void);
+
+    template <typename EMIT> UI32 Flush(EMIT);
+
+    private:
+    typedef std::pair<UI32, chtype> SPRITE;
+
+    UI32 width, height;
+    std::vector<chtype> base;       // The maze, the diamonds and the parchment
+    std::vector<chtype> next;       // The dirty cells as they are to be shown
+    std::vector<chtype> shown;      // What the screen shows
+    std::vector<SPRITE> sprites;
+    std::vector<UI32> dirty;        // Cells that may have changed since the last flush
+    std::vector<UI8> is_dirty;
+
+    void Touch(UI32 cell)
+    {
+        if (is_dirty[cell]) return;
+        is_dirty[cell] = 1;
+        dirty.push_back(cell);
+    }
+};
+
+#endif // FRAMEBUFFER_H_INCLUDED
+
+/* CLASS FRAMEBUFFER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::Reset
+ *  @brief  Makes an empty frame of the given size, for a screen that is blank.
+ *  @param  _width: The width of the frame.
+ *  @param  _height: The height of the frame.
+ */
+void FrameBuffer::Reset(UI32 _width, UI32 _height)
+{
+    width = _width;
+    height = _height;
+
+    base.assign(width * height, ' ');
+    next.assign(width * height, ' ');
+    shown.assign(width * height, ' ');
+    is_dirty.assign(width * height, 0);
+    sprites.clear();
+    dirty.clear();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::Put
+ *  @brief  Sets a cell of the map.
+ *  @param  x, y: The cell.
+ *  @param  cell: The character and its attributes.
+ */
+void FrameBuffer::Put(UI32 x, UI32 y, chtype cell)
+{
+    UI32 i = y * width + x;
+    if (base[i] == cell) return;
+
+    base[i] = cell;
+    Touch(i);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::PushSprite
+ *  @brief  Adds a sprite on top of the others.
+ *  @param  x, y: The cell of the sprite.
+ *  @param  cell: The character and its attributes.
+ */
+void FrameBuffer::PushSprite(UI32 x, UI32 y, chtype cell)
+{
+    sprites.push_back(SPRITE(y * width + x, cell));
+    Touch(sprites.back().first);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::PopSprite
+ *  @brief  Removes the sprite on top.
+ */
+void FrameBuffer::PopSprite(void)
+{
+    Touch(sprites.back().first);
+    sprites.pop_back();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::ClearSprites
+ *  @brief  Removes every sprite.
+ */
+void FrameBuffer::ClearSprites(void)
+{
+    for (UI32 i = 0; i < sprites.size(); i++)
+        Touch(sprites[i].first);
+
+    sprites.clear();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::Redraw
+ *  @brief  Forgets what the screen shows, so the next flush emits every cell.
+ */
+void FrameBuffer::Redraw(void)
+{
+    for (UI32 i = 0; i < shown.size(); i++)
+    {
+        shown[i] = 0;
+        Touch(i);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION FrameBuffer::Flush
+ *  @brief  Composes the cells that may have changed and passes the ones that
+ *          differ from the screen to emit, as emit(x, y, cell), row by row.
+ *  @param  emit: Draws a cell.
+ *  @return The number of cells emitted.
+ */
+template <typename EMIT>
+UI32 FrameBuffer::Flush(EMIT emit)
+{
+    std::sort(dirty.begin(), dirty.end());
+
+    for (UI32 i = 0; i < dirty.size(); i++)
+        next[dirty[i]] = base[dirty[i]];
+    for (UI32 i = 0; i < sprites.size(); i++)
+        next[sprites[i].first] = sprites[i].second;
+
+    UI32 emitted = 0;
+    for (UI32 i = 0; i < dirty.size(); i++)
+    {
+        UI32 cell = dirty[i];
+        is_dirty[cell] = 0;
+
+        if (next[cell] == shown[cell]) continue;
+
+        shown[cell] = next[cell];
+        emit(cell % width, cell / width, shown[cell]);
+        emitted++;
+    }
+
+    dirty.clear();
+    return emitted;
+}
+
+#ifndef RENDERBACKEND_H_INCLUDED
+#define RENDERBACKEND_H_INCLUDED
+
+// The foreground and background of every colour pair the game uses
+const short color_pairs[COLOR_PAIR_COUNT][2] =
+{
+    { COLOR_WHITE, COLOR_BLACK },   // Pair 0 is the terminal's own
+    { COLOR_WHITE, COLOR_BLACK },
+    { COLOR_GREEN, COLOR_BLACK },
+    { COLOR_YELLOW, COLOR_BLACK },
+    { COLOR_BLACK, COLOR_RED },
+    { COLOR_BLACK, COLOR_BLUE },
+    { COLOR_BLACK, COLOR_YELLOW }
+};
+
+/**
+ *  CLASS: AnsiFrame
+ *  @brief      AnsiFrame builds the escape sequences that draw cells on a
+ *              terminal, in screen coordinates. The cursor is only moved when
+ *              a cell does not follow the one before it, and the colours are
+ *              only set when they change. It does not need ncurses to be
+ *              running, so frames can be built for any terminal.
+ */
+class AnsiFrame
+{
+    public:
+    AnsiFrame() : colors(true)
+    { Forget(); }
+
+    void Put(I32, I32, chtype);
+    void Text(I32, I32, const std::string&, chtype);
+    void Colors(bool _colors)   { colors = _colors; }
+    void Forget(void)           { row = col = -1; attrs = ~(attr_t)0; }
+
+    std::string& Out(void)      { return out; }
+    const std::string& Out(void) const  { return out; }
+
+    private:
+    std::string out;    // The sequences so far
+    I32 row, col;       // Where the cursor is, -1 if not known
+    attr_t attrs;       // The attributes in effect, ~0 if not known
+    bool colors;        // Whether the terminal shows colours
+};
+
+/**
+ *  CLASS: RenderBackend
+ *  @brief      RenderBackend is what the frames of a level are drawn with. The
+ *              cells are in map coordinates; the map and score windows only
+ *              tell where on the screen the map and the score are.
+ */
+class RenderBackend
+{
+    public:
+    RenderBackend() : map_win(NULL), score_win(NULL)
+    {}
+    virtual ~RenderBackend() {}
+
+    void Attach(WINDOW* map, WINDOW* score)  { map_win = map; score_win = score; }
+
+    virtual void Cell(UI32, UI32, chtype) = 0;
+    virtual void Score(UI32) = 0;
+    virtual void Flush(void) = 0;
+
+    protected:
+    WINDOW* map_win;
+    WINDOW* score_win;
+};
+
+/**
+ *  CLASS: CursesBackend
+ *  @brief      CursesBackend draws into the windows and lets ncurses update
+ *              the screen.
+ */
+class CursesBackend : public RenderBackend
+{
+    public:
+    void Cell(UI32 x, UI32 y, chtype cell)  { mvwaddch(map_win, y, x, cell); }
+    void Score(UI32);
+    void Flush(void);
+};
+
+/**
+ *  CLASS: AnsiBackend
+ *  @brief      AnsiBackend writes the escape sequences of a frame itself, as a
+ *              single write(), past ncurses. The frame is wrapped in a save and
+ *              a restore of the cursor, which also restores the attributes, so
+ *              ncurses carries on from where it left the terminal.
+ */
+class AnsiBackend : public RenderBackend
+{
+    public:
+    void Cell(UI32 x, UI32 y, chtype cell)  { Put(getbegy(map_win) + y, getbegx(map_win) + x, cell); }
+    void Score(UI32);
+    void Flush(void);
+
+    private:
+    AnsiFrame frame;    // The frame so far
+
+    void Put(I32, I32, chtype);
+};
+
+/**
+ *  CLASS: NullBackend
+ *  @brief      NullBackend draws nothing.
+ */
+class NullBackend : public RenderBackend
+{
+    public:
+    void Cell(UI32, UI32, chtype)   {}
+    void Score(UI32)                {}
+    void Flush(void)                {}
+};
+
+#endif // RENDERBACKEND_H_INCLUDED
+
+/* CLASS CURSESBACKEND PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION CursesBackend::Score
+ *  @brief  Draws the score on the info bar. It shows with the next flush.
+ *  @param  score: The value to draw.
+ */
+void CursesBackend::Score(UI32 score)
+{
+    werase(score_win);
+    wprintw(score_win, "%d", score);
+    wnoutrefresh(score_win);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION CursesBackend::Flush
+ *  @brief  Updates the screen, along with any other window refreshed with
+ *          wnoutrefresh, in a single flush.
+ */
+void CursesBackend::Flush(void)
+{
+    wnoutrefresh(map_win);
+    doupdate();
+}
+
+/* CLASS ANSIFRAME PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION AnsiFrame::Put
+ *  @brief  Adds a cell of the screen to the frame.
+ *  @param  y, x: The cell of the screen.
+ *  @param  cell: The character and its attributes.
+ */
+void AnsiFrame::Put(I32 y, I32 x, chtype cell)
+{
+    I8 seq[32];
+
+    if (y != row || x != col)
+    {
+        snprintf(seq, sizeof(seq), "\x1b[%d;%dH", y + 1, x + 1);
+        out += seq;
+        row = y;
+        col = x;
+    }
+
+    if ((cell & A_ATTRIBUTES) != attrs)
+    {
+        attrs = cell & A_ATTRIBUTES;
+        out += (attrs & A_BOLD) ? "\x1b[0;1" : "\x1b[0";
+
+        short pair = PAIR_NUMBER(attrs);
+        if (colors && pair > 0 && pair < COLOR_PAIR_COUNT)
+        {
+            snprintf(seq, sizeof(seq), ";%d;%d", 30 + color_pairs[pair][0], 40 + color_pairs[pair][1]);
+            out += seq;
+        }
+        out += 'm';
+    }
+
+    out += (I8)(cell & A_CHARTEXT);
+    col++;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION AnsiFrame::Text
+ *  @brief  Adds a line of text to the frame.
+ *  @param  y, x: Where the text starts on the screen.
+ *  @param  text: The text.
+ *  @param  attrs: The attributes of the text.
+ */
+void AnsiFrame::Text(I32 y, I32 x, const std::string& text, chtype attrs)
+{
+    for (size_t i = 0; i < text.size(); i++)
+        Put(y, x + i, (UI8)text[i] | attrs);
+}
+
+/* CLASS ANSIBACKEND PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION AnsiBackend::Score
+ *  @brief  Draws the score on the info bar, over the whole score window.
+ *  @param  score: The value to draw.
+ */
+void AnsiBackend::Score(UI32 score)
+{
+    I8 text[16];
+    I32 width = std::min(getmaxx(score_win), (I32)sizeof(text) - 1);
+    snprintf(text, sizeof(text), "%-*u", width, score);
+
+    chtype bkgd = getbkgd(score_win) & A_ATTRIBUTES;
+    for (I32 i = 0; i < width; i++)
+        Put(getbegy(score_win), getbegx(score_win) + i, (UI8)text[i] | bkgd);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION AnsiBackend::Flush
+ *  @brief  Writes the frame to the terminal.
+ */
+void AnsiBackend::Flush(void)
+{
+    std::string& out = frame.Out();
+    if (out.empty()) return;
+
+    out += "\x1b" "8";
+    for (size_t done = 0; done < out.size(); )
+    {
+        ssize_t n = write(STDOUT_FILENO, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+
+    out.clear();
+}
+
+/* CLASS ANSIBACKEND PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION AnsiBackend::Put
+ *  @brief  Adds a cell of the screen to the frame.
+ *  @param  y, x: The cell of the screen.
+ *  @param  cell: The character and its attributes.
+ */
+void AnsiBackend::Put(I32 y, I32 x, chtype cell)
+{
+    if (frame.Out().empty())
+    {   // The first cell of the frame: where ncurses left the cursor and the
+        // attributes is not known
+        frame.Out() = "\x1b" "7";
+        frame.Forget();
+        frame.Colors(has_colors());
+    }
+
+    frame.Put(y, x, cell);
+}
+
+#ifndef GAMEPLAY_H_INCLUDED
+#define GAMEPLAY_H_INCLUDED
+
+/**
+ *  CLASS: Gameplay
+ *  @brief      Gameplay is the class that represents the visual aspects
+ *              of the game. Its instances hold every window and subwindow
+ *              (ncurses' terminology) that is shown to the screen and control
+ *              every interactive way of communication with the player. The
+ *              maze and the creatures are composed in a frame buffer, drawn
+ *              a frame at a time with the render backend chosen.
+ */
+class Gameplay
+{
+    public:
+    Gameplay() : backend(&curses_out), stage_offset(COLS / 2), score_offset(1), debug_offset(LINES - 3), hud(false)
+    {}
+
+    typedef struct win_exc
+    {   // Used as an exceptiom to be thrown in case a window function goes bad
+        std::string message;
+        win_exc(std::string arg): message(arg) {}
+    } WINEXP;
+
+    void InitDebugWin(void);
+    void InitInfoBar(const std::string&);
+    void InitStageWin(void);
+    void InitLevel(const ::Stage&);
+    void EndLevel(void);
+    void DrawMenu(UI8);
+    void DrawParch(POS);
+    void DrawScore(UI32);
+    void DrawHighScores(const std::vector<SCOS>&);
+    void DrawCreatures(const Potter&, const Monsters&);
+    void Present(void);
+    void Render(RENDER_T);
+    void DrawHud(const PerfStats&, UI64, UI64);
+
+    chtype MapCell(POS pos) const   { return frame.At(pos.x, pos.y); }
+    static chtype MazeCell(I8 tile)
+    { return (UI8)tile | (tile == '.' ? COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK) : 0); }
+    static chtype ParchCell(void)   { return 'P' | COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK) | A_BOLD; }
+    static chtype HarryCell(void)   { return 'H' | COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK); }
+    static chtype MonsterCell(MONST_T kind)
+    { return (kind == SMART ? 'G' : 'T') | COLOR_PAIR(COLOR_PAIR_BLACK_RED); }
+
+    const WINDOW* Stage(void)   const   { return stage_win; }
+    const WINDOW* Map(void)     const   { return map_win; }
+    const WINDOW* Debug(void)   const   { return debug_win; }
+    const WINDOW* InfoBar(void) const   { return info_win; }
+    const WINDOW* Score(void)   const   { return score_win; }
+
+    WINDOW* Stage(void)     { return stage_win; }
+    WINDOW* Map(void)       { return map_win; }
+    WINDOW* Debug(void)     { return debug_win; }
+    WINDOW* InfoBar(void)   { return info_win; }
+    WINDOW* Score(void)     { return score_win; }
+
+    void ShowWin (WINDOW*) const;
+
+    void ColorFlashWin(WINDOW*, UI32);
+    void FlashToggleCell(POS, chtype, chtype, UI32);
+
+    I32 WaitKey(void);
+    I32 GetPlayerInput(void);
+    I32 GetPlayerInput(KeyReader&);
+    void Pause(bool);
+    bool Pause(void) const { return isPaused; }
+    void Hud(bool);
+    bool Hud(void) const { return hud; }
+
+    void DiamondEaten(POS);
+
+    private:
+    WINDOW* stage_win;
+    WINDOW* map_win;
+    WINDOW* info_win;
+    WINDOW* score_win;
+    WINDOW* debug_win;
+    FrameBuffer frame;
+
+    CursesBackend curses_out;
+    AnsiBackend ansi_out;
+    NullBackend null_out;
+    RenderBackend* backend;
+
+    UI8 stage_offset;
+    UI8 score_offset;
+    UI8 debug_offset;
+    bool isPaused;
+    bool hud;       // Whether the debug window shows the performance overlay
+
+    const static std::string menu_items[MENU_ITEMS_COUNT];
+
+    void InitMapWin(UI32, UI32);
+};
+
+#endif // GAMEPLAY_H_INCLUDED
+
+const std::string Gameplay::menu_items[MENU_ITEMS_COUNT] = // Main menu options
+    {"Play game", "Show High Score Table", "Quit"};
+
+/* CLASS GAMEPLAY PRIVATE MEMBER FUNCTIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::InitMapWin
+ *  @brief  Initialises the map window according to the width and height passed
+ *          as arguments. Map window is stage's derivative window. Map window
+ *          holds the visual part of the game's maze.
+ *  @param  height: The height of the map window.
+ *  @param  width: The width of the map window.
+ */
+void Gameplay::InitMapWin(UI32 height, UI32 width)
+{
+    stage_offset = (COLS - (I32)width) / 2;
+    if ((map_win = derwin(stage_win, height, width, 0, stage_offset)) == NULL)
+        throw WINEXP("Unable to acquire resources to construct window: map_win");
+}
+
+/* CLASS GAMEPLAY PUBLIC MEMBER FUNCTIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::InitStageWin
+ *  @brief  Initialises the stage window. The maze, the living creatures and some
+ *          game messages are hosted in the stage window.
+ */
+void Gameplay::InitStageWin(void)
+{
+    if ((stage_win = newwin(LINES - 3, COLS - 1, score_offset, 0)) == NULL)
+        throw WINEXP("Unable to acquire resources to construct window: stage_win");
+
+    keypad(stage_win, TRUE);
+    nodelay(stage_win, TRUE);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::InitLevel
+ *  @brief  Performs the necessary actions to set up the screen for a new level.
+ *          The maze is drawn with the first frame.
+ *  @param  stage: The stage of the level, to draw the maze and the diamonds of.
+ */
+void Gameplay::InitLevel(const ::Stage& stage)
+{
+    UI32 map_height = stage.MapHeight();
+    UI32 map_width  = stage.MapWidth();
+
+    InitMapWin(map_height, map_width);
+    frame.Reset(map_width, map_height);
+    backend->Attach(map_win, score_win);
+
+    for (UI32 i = 0; i < map_height; i++)
+        for (UI32 j = 0; j < map_width; j++)
+            frame.Put(j, i, MazeCell(stage.Tile(j, i)));
+}   // Gameplay::InitLevel
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::EndLevel
+ *  @brief  Clears the screen and ends the current level.
+ */
+void Gameplay::EndLevel(void)
+{
+    frame.Reset(0, 0);
+
+    wclear(stage_win);
+    wclear(map_win);
+    delwin(map_win);
+}
+
+void Gameplay::InitDebugWin(void)
+{
+    debug_offset = LINES - 3;
+    if ((debug_win = newwin(3, COLS, debug_offset, 0)) == NULL)
+        throw WINEXP("Unable to acquire resources to construct window: debug_win");
+
+    wbkgd(debug_win, COLOR_PAIR(COLOR_PAIR_BLACK_BLUE));
+    scrollok(debug_win, TRUE);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::InitInfoBar
+ *  @brief  Initialises the information bar window. The information bar shows
+ *          information about the current player.
+ *  @param  player_name: The player name to draw on the bar.
+ */
+void Gameplay::InitInfoBar(const std::string& player_name)
+{
+    if ((info_win = newwin(1,COLS, 0, 0)) == NULL)
+        throw WINEXP("Unable to acquire resources to construct window: info_win");
+
+    if ((score_win = derwin(info_win, 1, 5, 0, COLS - 5)) == NULL)
+        throw WINEXP("Unable to acquire resources to construct window: score_win");
+
+    wbkgd(info_win, COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
+    wbkgd(score_win, COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
+    wprintw(info_win, " %s", player_name.c_str());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawMenu
+ *  @brief  Draws the main menu on the screen.
+ *  @param  slc: An integer showing which menu item to highlight.
+ */
+void Gameplay::DrawMenu(UI8 slc)
+{
+    for (UI8 i = 0; i < MENU_ITEMS_COUNT; i++)
+    {
+        if (slc == i) wattron(stage_win, COLOR_PAIR(COLOR_PAIR_YELLOW_BLACK));
+        mvwaddstr(stage_win, i*2 + 3, (COLS - menu_items[i].length()) / 2, menu_items[i].c_str());
+        wstandend(stage_win);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawParch
+ *  @brief  Draws the parch in the maze (as a 'P' character). Must be called
+ *          after all of the diamonds in the level are eaten.
+ *  @param  parch_pos: The position to draw the parch.
+ */
+void Gameplay::DrawParch(POS parch_pos)
+{
+    frame.Put(parch_pos.x, parch_pos.y, ParchCell());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawScore
+ *  @brief  Draws the score passed as an argument on the info bar. It shows
+ *          with the next frame.
+ *  @param  score: The value to draw.
+ */
+void Gameplay::DrawScore(UI32 score)
+{
+    backend->Score(score);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawHighScores
+ *  @brief  Draws the high score table with a nice delay effect.
+ *  @param  table: The score table to retrieve data from.
+ */
+void Gameplay::DrawHighScores(const std::vector<SCOS>& sc_table)
+{
+    UI8 counter = 1;
+    std::string sc_label = "HIGHSCORE TABLE";
+
+    wattron(stage_win, COLOR_PAIR(COLOR_PAIR_GREEN_BLACK) | A_BOLD);
+    mvwprintw(stage_win, 0, (COLS - sc_label.length()) / 2, "%s", sc_label.c_str());
+    wstandend(stage_win);
+
+    if (sc_table.begin() == sc_table.end())
+    {
+        mvwprintw(stage_win, counter*2, (COLS - std::string("(empty)").length()) / 2,
+                  "(empty)");
+        wrefresh(stage_win);
+    }
+    else
+        for(std::vector<SCOS>::const_iterator it = sc_table.begin(); it != sc_table.end(); it++)
+        {
+            mvwprintw(stage_win, counter*2, (COLS - 20) / 2,
+                      "%d \t %s", (*it).player_score, (*it).player_name);
+            counter++;
+            if (counter*2 == LINES) break;
+
+            napms(50);
+            wrefresh(stage_win);
+        }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawCreatures
+ *  @brief  Puts Harry and the monsters, in their current places, on the next
+ *          frame. The monsters are drawn over Harry.
+ *  @param  player: Harry.
+ *  @param  monsters: The monsters of the level.
+ */
+void Gameplay::DrawCreatures(const Potter& player, const Monsters& monsters)
+{
+    frame.ClearSprites();
+    frame.PushSprite(player.CurPos().x, player.CurPos().y, HarryCell());
+
+    for (UI32 i = 0; i < monsters.Count(); i++)
+        frame.PushSprite(monsters.Pos(i).x, monsters.Pos(i).y, MonsterCell(monsters.Kind(i)));
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::Present
+ *  @brief  Draws the cells of the frame that changed since the last one and
+ *          flushes the backend.
+ */
+void Gameplay::Present(void)
+{
+    frame.Flush([this](UI32 x, UI32 y, chtype cell) { backend->Cell(x, y, cell); });
+    backend->Flush();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::Render
+ *  @brief  Chooses the backend the levels are drawn with. Must be called
+ *          between levels.
+ *  @param  kind: The backend.
+ */
+void Gameplay::Render(RENDER_T kind)
+{
+    switch (kind)
+    {
+        case RENDER_T::ANSI_OUT:
+        backend = &ansi_out;
+        break;
+
+        case RENDER_T::NULL_OUT:
+        backend = &null_out;
+        break;
+
+        default:
+        backend = &curses_out;
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::WaitKey
+ *  @brief  Waits for a key to be pressed.
+ *  @return The keycode.
+ */
+I32 Gameplay::WaitKey(void)
+{
+    nodelay(stage_win, FALSE);
+    I32 key = wgetch(stage_win);
+    nodelay(stage_win, TRUE);
+
+    return key;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::GetPlayerInput
+ *  @brief  Handles the input from the keyboard.
+ *  @return The keycode.
+ */
+I32 Gameplay::GetPlayerInput(void)
+{
+    I32 key = wgetch(stage_win);
+
+    if (key == ' ') ShowWin(debug_win);
+
+    return key;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::GetPlayerInput
+ *  @brief  Handles the input from the keyboard, as read by the key reader.
+ *          The space key shows or hides the performance overlay.
+ *  @param  keys: The key reader.
+ *  @return The keycode, or ERR if no key was pressed.
+ */
+I32 Gameplay::GetPlayerInput(KeyReader& keys)
+{
+    I32 key = keys.NextKey();
+
+    if (key == ' ') Hud(!hud);
+
+    return key;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::ShowWin
+ *  @brief  Brings the window passed as argument to the front and
+ *          refreshes the view in order to draw it.
+ *  @param  win: The window to be drawn.
+ */
+void Gameplay::ShowWin (WINDOW* _win) const
+{
+    touchwin(_win);
+    wrefresh(_win);
+}
+
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::GetPlayerInput
+ *  @brief  Pauses or unpauses the gameplay according to the
+ *          boolean parametre passed.
+ *  @param  state: True for paused or false for unpaused.
+ */
+void Gameplay::Pause(bool state)
+{
+    int stage_x, stage_y;
+    getmaxyx(stage_win, stage_y, stage_x);
+
+    if (!isPaused)
+        mvwprintw(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2, PAUSE_MESSAGE);
+    else
+    {
+        for (int i = 0; i < strlen(PAUSE_MESSAGE); i++)
+            mvwdelch(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2);
+        for (int i = 0; i < strlen(PAUSE_MESSAGE); i++)
+            mvwinsch(stage_win, stage_y / 2, (stage_x - getmaxx(map_win)) / 2 - strlen(PAUSE_MESSAGE) - 2, ' ');
+    }
+
+    nodelay(stage_win, !state);
+    isPaused = state;
+    ShowWin(stage_win);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::Hud
+ *  @brief  Shows or hides the performance overlay in the debug window. Once
+ *          hidden, the map is drawn again where the window covered it.
+ *  @param  state: True to show the overlay or false to hide it.
+ */
+void Gameplay::Hud(bool state)
+{
+    hud = state;
+
+    wbkgd(debug_win, COLOR_PAIR(state ? COLOR_PAIR_BLACK_BLUE : COLOR_PAIR_NORMAL));
+    werase(debug_win);
+    wnoutrefresh(debug_win);
+    doupdate();
+
+    if (!state)
+    {
+        touchwin(map_win);
+        frame.Redraw();
+        Present();
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DrawHud
+ *  @brief  Draws the performance overlay: the time an average frame spent
+ *          in each phase, the tick latency, what was dropped to keep up and
+ *          how the monsters moved.
+ *  @param  stats: The measurements.
+ *  @param  late_ticks: The ticks the scheduler dropped.
+ *  @param  lost_keys: The keys the key reader dropped.
+ */
+void Gameplay::DrawHud(const PerfStats& stats, UI64 late_ticks, UI64 lost_keys)
+{
+    I8 line[3][160];
+    double frames = std::max<UI64>(stats.Ticks(), 1) * 1000.0;
+
+    snprintf(line[0], sizeof(line[0]), "us/frame  input %.1f  harry %.1f  monsters %.1f  collision %.1f  render %.1f",
+             stats.PhaseNs(PHASE_T::INPUT_PHASE) / frames, stats.PhaseNs(PHASE_T::PLAYER_PHASE) / frames,
+             stats.PhaseNs(PHASE_T::MONSTERS_PHASE) / frames, stats.PhaseNs(PHASE_T::COLLISION_PHASE) / frames,
+             stats.PhaseNs(PHASE_T::RENDER_PHASE) / frames);
+    snprintf(line[1], sizeof(line[1]), "latency   p50 %llu us  p99 %llu us  frames %llu  late ticks %llu  lost keys %llu",
+             stats.Percentile(50), stats.Percentile(99), stats.Ticks(), late_ticks, lost_keys);
+    snprintf(line[2], sizeof(line[2]), "gnomes    step %llu  wander %llu   traals  level 1 %llu  level 2 %llu  level 3 %llu  stuck %llu",
+             stats.Moves(MOVE_T::SMART_STEP), stats.Moves(MOVE_T::SMART_WANDER), stats.Moves(MOVE_T::DUMMY_LEVEL1),
+             stats.Moves(MOVE_T::DUMMY_LEVEL2), stats.Moves(MOVE_T::DUMMY_LEVEL3), stats.Moves(MOVE_T::DUMMY_STUCK));
+
+    werase(debug_win);
+    for (UI32 i = 0; i < 3; i++)
+        mvwaddnstr(debug_win, i, 1, line[i], getmaxx(debug_win) - 2);
+
+    wnoutrefresh(debug_win);
+    doupdate();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::FlashToggleCell
+ *  @brief  Repeatedly toggles a cell of the map between two looks, for as
+ *          many times as specified by the last argument.
+ *  @param  pos: The cell.
+ *  @param  c1: The first look.
+ *  @param  c2: The second look.
+ *  @param  times: Maximun times to flash the cell.
+ */
+void Gameplay::FlashToggleCell(POS pos, chtype c1, chtype c2, UI32 times)
+{
+    for (UI32 i = 0; i < times; i++)
+    {
+        frame.PushSprite(pos.x, pos.y, c1);
+        Present();
+        frame.PopSprite();
+        napms(200);
+
+        frame.PushSprite(pos.x, pos.y, c2);
+        Present();
+        frame.PopSprite();
+        napms(200);
+    }
+}
+
+
+/**
+ *  PUBLIC MEMBER FUNCTION Gameplay::DiamondEaten
+ *  @brief  Deletes a diamond (dot) from the screen at the specified coordinates.
+ *  @param  coords: The coordinates of the diamond to be erased.
+ */
+void Gameplay::DiamondEaten(POS coords)
+{
+    frame.Put(coords.x, coords.y, ' ');
+}
+
+#ifndef GAMEBASE_H_INCLUDED
+#define GAMEBASE_H_INCLUDED
+
+Gameplay gpl;   // Gameplay
+Engine glen;    // Global Engine
+HighScore hsc;  // High Scores Controller
+Recording grec; // Recording of the current game (or the one being replayed)
+bool replaying = false;
+UI32 tick_ms = TICK_DEFAULT_MS; // Length of a game turn
+INPUT_T input_policy = INPUT_T::BUFFER_AHEAD;
+PerfStats perf; // What the turns cost, measured while the overlay shows
+
+void init_curses(void)
+{
+    initscr();
+    curs_set(0);
+
+    if (has_colors())
+    {
+        start_color();
+        for (short i = COLOR_PAIR_NORMAL; i < COLOR_PAIR_COUNT; i++)
+            init_pair(i, color_pairs[i][0], color_pairs[i][1]);
+    }
+
+    raw();
+    noecho();
+    nonl();
+}
+
+void init_gameplay(void)
+{
+    gpl.InitStageWin();
+    gpl.InitDebugWin();
+}
+
+void kill_gameplay()
+{
+    wclear(gpl.InfoBar());
+    wclear(gpl.Debug());
+
+    delwin(gpl.Score());
+    delwin(gpl.InfoBar());
+    delwin(gpl.Debug());
+    delwin(gpl.Map());
+    delwin(gpl.Stage());
+}
+
+/**
+ *  FUNCTION load_next_level
+ *  @brief  Sets the level the loader has ready and draws it.
+ *  @param  loader: The loader of the level.
+ */
+void load_next_level(LevelLoader& loader)
+{
+    loader.Finish(glen);
+    gpl.InitLevel(glen.stage);
+    gpl.DrawCreatures(glen.player, glen.monsters);
+
+    gpl.ShowWin(gpl.InfoBar());
+    gpl.ShowWin(gpl.Stage());
+    gpl.Present();
+}
+
+void kill_cur_level(void)
+{
+    glen.EndLevel();
+    gpl.EndLevel();
+
+    wrefresh(gpl.Stage());
+}
+
+TURN_T new_turn(KeyReader& keys)
+{
+    PerfStats::CLOCK::time_point lap;
+    if (gpl.Hud()) lap = PerfStats::CLOCK::now();
+
+    I32 inp = gpl.GetPlayerInput(keys);
+
+    if (inp == ' ')
+    {   // The overlay was shown or hidden: measure afresh, or not at all
+        perf.Reset();
+        glen.Profile(gpl.Hud() ? &perf : NULL);
+    }
+    else if (gpl.Hud())
+        perf.Lap(PHASE_T::INPUT_PHASE, lap);
+
+    if (inp == KEY_PAUSE || inp == 'P' || inp == 'p')
+        gpl.Pause()?gpl.Pause(false):gpl.Pause(true);
+
+    if (gpl.Pause() && inp != KEY_ESCAPE)
+        return TURN_T::PLAYING;
+
+    if (replaying && inp != KEY_ESCAPE)
+    {
+        if (grec.Finished()) return TURN_T::ESCAPED;
+        inp = grec.NextKey();
+    }
+    else if (!replaying)
+        grec.Record(inp);
+
+    TURN_T outcome = glen.Step(inp);
+    if (outcome == TURN_T::ESCAPED)
+        return outcome;
+
+    if (glen.player.CollisionState() == COLL_T::DMND)
+        gpl.DiamondEaten(glen.player.CurPos());
+
+    return outcome;
+}
+
+/**
+ *  FUNCTION draw_turn
+ *  @brief  Draws the creatures, the score and the parchment, once it shows,
+ *          as the turns played since the last drawing left them, as one frame.
+ */
+void draw_turn(void)
+{
+    if (glen.stage.DiamondsCount() == 0)
+        gpl.DrawParch(glen.stage.ParchPos());
+
+    gpl.DrawCreatures(glen.player, glen.monsters);
+    gpl.DrawScore(glen.player.Score());
+    gpl.Present();
+}
+
+/**
+ *  FUNCTION play
+ *  @brief  Plays the current level one turn per tick of the scheduler, until
+ *          it ends in one of the exceptions below. The screen is drawn after
+ *          the ticks that played a turn, once for all the ticks played back to
+ *          back after a stall, and not at all while the game is paused. The
+ *          keys are read on a thread of their own for as long as the level is
+ *          played; while paused, every tick only looks for the pause key.
+ */
+void play(void)
+{
+    TickScheduler ticks(tick_ms);
+    KeyReader keys(input_policy);
+    TURN_T outcome = TURN_T::PLAYING;
+
+    flushinp();
+    keys.Start(STDIN_FILENO);
+
+    while (outcome == TURN_T::PLAYING)
+    {
+        ticks.Wait();
+
+        UI32 turns = glen.Turns();
+        for (UI32 due = ticks.Due(); due > 0 && outcome == TURN_T::PLAYING; due--)
+            outcome = new_turn(keys);
+
+        if (glen.Turns() != turns && outcome != TURN_T::ESCAPED)
+        {
+            PerfStats::CLOCK::time_point lap;
+            if (gpl.Hud()) lap = PerfStats::CLOCK::now();
+
+            draw_turn();
+
+            if (gpl.Hud())
+            {
+                perf.Tick(perf.Lap(PHASE_T::RENDER_PHASE, lap) - ticks.LastDue());
+                gpl.DrawHud(perf, ticks.Dropped(), keys.Dropped());
+            }
+        }
+    }
+
+    switch (outcome)
+    {
+        case TURN_T::ESCAPED:
+        throw Engine::Escape("User pressed escape key\n");
+
+        case TURN_T::LOST:
+        throw Potter::Lose(glen.player.CurPos());
+
+        default:
+        throw Potter::Win(glen.player.CurPos());
+    }
+}
+
+/**
+ *  FUNCTION play_levels
+ *  @brief  Plays the given maps in order until the player loses or quits,
+ *          in which case Potter::Lose or Engine::Escape is thrown. Every map
+ *          is loaded in the background while the one before it is played.
+ *  @param  maps: The map files to play.
+ */
+void play_levels(const std::vector<std::string>& maps)
+{
+    LevelLoader loader;
+
+    if (!maps.empty())
+        loader.Start(maps[0], glen.stage.Rng());
+
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+        bool loaded = false;
+
+        try
+        {
+            load_next_level(loader);
+            loaded = true;
+
+            if (i + 1 < maps.size())
+                loader.Start(maps[i + 1], glen.stage.Rng());
+
+            gpl.WaitKey();
+
+            try{ play(); }
+            catch (Potter::Win& exp)
+            {
+                POS pos = glen.player.CurPos();
+                gpl.FlashToggleCell(pos, gpl.MapCell(pos), Gameplay::HarryCell(), 5);
+            }
+
+            kill_cur_level();
+            flushinp();
+        }
+        catch(GENEXP& exp)
+        {
+            printw("%s", exp.message.c_str());
+            gpl.ShowWin(stdscr);
+            glen.stage.Unload();
+            getch();
+            wclear(stdscr);
+
+            if (!loaded && i + 1 < maps.size())
+                loader.Start(maps[i + 1], glen.stage.Rng());
+        }
+    }
+    flushinp();
+}
+
+/**
+ *  FUNCTION flash_capture
+ *  @brief  Flashes Harry and the monster that caught him.
+ */
+void flash_capture(void)
+{
+    UI32 catcher = glen.monsters.Find(glen.player.CurPos());
+
+    if (catcher != Monsters::NOBODY)
+        gpl.FlashToggleCell(glen.player.CurPos(), Gameplay::HarryCell(),
+                            Gameplay::MonsterCell(glen.monsters.Kind(catcher)), 5);
+}
+
+void get_player_name(I8 name[])
+{
+    std::string name_prompt
+        = "Please enter a nick up to ten characters: ";
+
+    echo();
+    nodelay(gpl.Stage(), FALSE);
+
+    mvwprintw(gpl.Stage(), (LINES - 4) / 2, (COLS - name_prompt.length() - (NICKNAME_DEFAULT_LENGTH - 1)) / 2, "%s", name_prompt.c_str());
+    wrefresh(gpl.Stage());
+    wgetnstr(gpl.Stage(), name, NICKNAME_DEFAULT_LENGTH - 1);
+
+    noecho();
+    nodelay(gpl.Stage(), TRUE);
+
+    wclear(gpl.Stage());
+}
+
+void handle_player_score(void)
+{
+    I8 player_name[NICKNAME_DEFAULT_LENGTH];
+
+    get_player_name(player_name);
+    if (strcmp(player_name, "") != 0)
+        glen.player.Name(player_name);
+
+    hsc.InitTable();
+    hsc.PlayerName(glen.player.Name());
+    hsc << glen.player.Score();
+    hsc.SaveTable();
+}
+
+#endif // GAMEBASE_H_INCLUDED
+
+#ifndef GAMESERVER_H_INCLUDED
+#define GAMESERVER_H_INCLUDED
+
+class GameServer;
+
+/**
+ *  CLASS: ScoreKeeper
+ *  @brief      ScoreKeeper enters the scores of the games a server ends on the
+ *              high score table, on a thread of its own. The table is a file
+ *              shared by every game on the machine and entering a score waits
+ *              for its lock, which any of them may hold for as long as it likes,
+ *              so the server only hands the scores over; the thread enters all
+ *              the scores handed over meanwhile at once and tells the server
+ *              through an eventfd its epoll loop watches. The scores are handed
+ *              over with the serial number of their session rather than the
+ *              session itself, which may well be gone by the time they are in.
+ */
+class ScoreKeeper
+{
+    public:
+    typedef struct score_entry
+    {
+        UI64 session;       // The serial number of the session
+        std::string name;
+        UI32 score;
+        std::string error;  // Why the score could not be entered, if it could not
+    }   ENTRY;
+
+    ScoreKeeper() : wake(-1), stopping(false)
+    {}
+    ~ScoreKeeper()  { Stop(); }
+
+    void Start(void);
+    void Stop(void);
+    I32 Fd(void)    const   { return wake; }
+
+    void Enter(UI64, const std::string&, UI32);
+    void Entered(std::vector<ENTRY>&);
+
+    private:
+    ScoreKeeper(const ScoreKeeper&);
+    ScoreKeeper& operator = (const ScoreKeeper&);
+
+    std::thread worker;
+    I32 wake;                   // Counts the batches entered, not taken yet
+    std::mutex lock;            // Guards the entries and stopping
+    std::condition_variable more;
+    std::vector<ENTRY> queued, done;
+    bool stopping;
+    HighScore table;            // Only the thread reads and writes it
+
+    void Run(void);
+};
+
+/**
+ *  CLASS: Session
+ *  @brief      Session is the game of a client of the server, from the first
+ *              level to the last one, on an engine of its own. The engine shares
+ *              the maze of each level with every other session on the same map
+ *              and only keeps the diamonds, the creatures and what they steer by
+ *              of its own. The client sends
+ *              a hello line, "TFQ columns rows name", and then the bytes of its
+ *              keyboard; it is sent the game as escape sequences, only the cells
+ *              that changed since the frame before. No frame is made while the
+ *              client has not taken the one before: the changes wait in the frame
+ *              buffer and go with the next frame, so a slow client is never sent
+ *              more than one frame behind, whatever the number of turns played.
+ *              A game that ends with a score waits, playing nothing, until the
+ *              server has the score entered on the high score table.
+ */
+class Session
+{
+    public:
+    Session(I32 _fd, UI64 _serial, INPUT_T policy) :
+        fd(_fd), serial(_serial), state(HELLO), cols(0), rows(0), level(0), keys(policy), paused(false),
+        map_x(0), map_y(1), shown_score(0), sent(0), polling_out(false)
+    {}
+    ~Session()  { close(fd); }
+
+    I32 Fd(void)            const   { return fd; }
+    UI64 Serial(void)       const   { return serial; }
+    bool Closed(void)       const   { return state == CLOSED; }
+    bool Writing(void)      const   { return sent < ansi.Out().size(); }
+    bool PollingOut(void)   const   { return polling_out; }
+    void PollingOut(bool polling)   { polling_out = polling; }
+
+    void Receive(GameServer&);
+    void Tick(GameServer&, UI32);
+    void Present(void);
+    void Send(void);
+    void Over(const std::string&);
+    void Saved(const std::string&);
+    void Close(void)    { state = CLOSED; }
+
+    private:
+    Session(const Session&);
+    Session& operator = (const Session&);
+
+    typedef enum
+    {
+        HELLO, WAITING, PLAYING, SAVING, OVER, CLOSED
+    }   STATE_T;
+
+    I32 fd;
+    UI64 serial;        // Tells the session apart from every other one of the server
+    STATE_T state;
+    std::string hello;  // The hello line, until it is whole
+    std::string name;
+    I32 cols, rows;     // The size of the client's terminal
+
+    Engine engine;
+    UI32 level;         // The map being played
+    KeyDecoder decoder;
+    KeyQueue keys;
+    TickScheduler::CLOCK::time_point last_byte;
+    bool paused;
+
+    FrameBuffer frame;
+    AnsiFrame ansi;     // Bytes not sent yet, from sent on
+    I32 map_x, map_y;   // Where the map is on the client's terminal
+    UI32 shown_score;
+    size_t sent;
+    bool polling_out;   // Whether the server waits for the socket to take more
+    std::string last;   // The last words, sent once the score is entered
+
+    void Hello(GameServer&);
+    void Key(I32);
+    void StartLevel(GameServer&);
+    void Turn(GameServer&);
+    void Pause(bool);
+    void DrawInfoBar(void);
+    void DrawScore(UI32);
+    void GameOver(GameServer&, const std::string&);
+};
+
+/**
+ *  CLASS: GameServer
+ *  @brief      GameServer hosts the games of any number of clients in a single
+ *              process, on a Unix domain socket. One thread runs it all: an epoll
+ *              loop accepts the clients, reads their keys and sends their frames
+ *              as the sockets allow, and its timeout is the next tick of a single
+ *              scheduler that plays a turn of every session. Nothing it does waits
+ *              for a lock: the scores of the games are entered on the high score
+ *              table by a ScoreKeeper. The maps are loaded
+ *              once, through their cache files. The maze of a map, with its grid,
+ *              its wall and move bitsets and its graph, is restored from the cache
+ *              when a session first plays the map and is shared by every session
+ *              playing it, until the last one is done with it; a maze nobody
+ *              plays takes no memory.
+ */
+class GameServer
+{
+    public:
+    GameServer(UI32 tick_ms, INPUT_T _policy) :
+        ticks(tick_ms), policy(_policy), path_ino(0), listen_fd(-1), epoll_fd(-1), games(0), serials(0)
+    {}
+    ~GameServer();
+
+    void AddMap(const std::string&);
+    void Listen(const std::string&);
+    void Run(volatile sig_atomic_t&);
+
+    UI32 MapCount(void)     const   { return maps.size(); }
+    void InitLevel(Engine&, UI32);
+    UI64 NewSeed(void)              { return (UI64)time(NULL) + ((UI64)games++ << 32); }
+    UI32 Games(void)        const   { return games; }
+    void EnterScore(UI64 session, const std::string& name, UI32 score)
+    { scores.Enter(session, name, score); }
+
+    private:
+    GameServer(const GameServer&);
+    GameServer& operator = (const GameServer&);
+
+    typedef struct served_map
+    {
+        MapFile file;
+        MapCache cache;
+        bool cached;    // Whether the maze is restored from the cache
+        std::weak_ptr<const Maze> maze;     // The maze, while any session plays it
+    }   SERVED_MAP;
+
+    std::vector<std::unique_ptr<SERVED_MAP> > maps;
+    std::vector<std::unique_ptr<Session> > sessions;
+    TickScheduler ticks;
+    INPUT_T policy;
+    std::string path;
+    UI64 path_ino;      // The socket file this server made
+    I32 listen_fd, epoll_fd;
+    UI32 games;
+    UI64 serials;       // Sessions accepted so far
+    ScoreKeeper scores;
+
+    void Accept(void);
+    void Watch(Session&);
+    void Entered(void);
+};
+
+#endif // GAMESERVER_H_INCLUDED
+
+/* CLASS SCOREKEEPER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION ScoreKeeper::Start
+ *  @brief  Starts the thread that enters the scores.
+ */
+void ScoreKeeper::Start(void)
+{
+    if (worker.joinable()) return;
+
+    wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake < 0) throw GENEXP(std::string("General error in ScoreKeeper::Start:\n") + strerror(errno));
+
+    stopping = false;
+    worker = std::thread(&ScoreKeeper::Run, this);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION ScoreKeeper::Stop
+ *  @brief  Waits for the thread to enter the scores it was handed and to end.
+ *          Scores entered but not taken yet are thrown away.
+ */
+void ScoreKeeper::Stop(void)
+{
+    if (worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> held(lock);
+            stopping = true;
+        }
+        more.notify_one();
+        worker.join();
+    }
+
+    if (wake >= 0) close(wake);
+    wake = -1;
+    done.clear();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION ScoreKeeper::Enter
+ *  @brief  Hands a score over to be entered on the table.
+ *  @param  session: The serial number of the session the score is for.
+ *  @param  name: The name of the player.
+ *  @param  score: The score.
+ */
+void ScoreKeeper::Enter(UI64 session, const std::string& name, UI32 score)
+{
+    ENTRY entry;
+    entry.session = session;
+    entry.name = name;
+    entry.score = score;
+
+    {
+        std::lock_guard<std::mutex> held(lock);
+        queued.push_back(entry);
+    }
+    more.notify_one();
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION ScoreKeeper::Entered
+ *  @brief  Takes the scores entered since the last call.
+ *  @param  entries: Receives the entries, each with its error, if any.
+ */
+void ScoreKeeper::Entered(std::vector<ENTRY>& entries)
+{
+    UI64 count;
+    while (read(wake, &count, sizeof(count)) < 0 && errno == EINTR);
+
+    std::lock_guard<std::mutex> held(lock);
+    entries.swap(done);
+    done.clear();
+}
+
+/* CLASS SCOREKEEPER PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION ScoreKeeper::Run
+ *  @brief  The body of the thread. The scores handed over while the last ones
+ *          were entered are entered together, with a single read and a single
+ *          append of the file. Once stopping, the thread still enters what it
+ *          was handed before it ends.
+ */
+void ScoreKeeper::Run(void)
+{
+    std::unique_lock<std::mutex> held(lock);
+
+    for (;;)
+    {
+        more.wait(held, [this]() { return stopping || !queued.empty(); });
+        if (queued.empty()) return;
+
+        std::vector<ENTRY> batch;
+        batch.swap(queued);
+        held.unlock();
+
+        std::string error;
+        try
+        {
+            table.InitTable();
+            for (UI32 i = 0; i < batch.size(); i++)
+            {
+                table.PlayerName(batch[i].name);
+                table << batch[i].score;
+            }
+            table.SaveTable();
+        }
+        catch(FILEEXP& exp)
+        {
+            error = "Could not load file '" + exp.filename + "' for '" + exp.open_purpose + "'\r\n";
+            table.EmptyTable();     // The scores not saved are not kept for another try
+        }
+
+        held.lock();
+        for (UI32 i = 0; i < batch.size(); i++)
+        {
+            batch[i].error = error;
+            done.push_back(batch[i]);
+        }
+
+        UI64 one = 1;
+        while (write(wake, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+/* CLASS SESSION PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Receive
+ *  @brief  Reads whatever the client has sent: the hello line, and then the
+ *          keys. Any key starts a level that waits for one. The session is
+ *          closed once the client hangs up.
+ *  @param  server: The server of the session.
+ */
+void Session::Receive(GameServer& server)
+{
+    UI8 buf[256];
+    std::function<void(I32)> push = [this](I32 key) { Key(key); };
+
+    for (;;)
+    {
+        ssize_t got = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (got <= 0)
+        {
+            state = CLOSED;
+            return;
+        }
+
+        last_byte = TickScheduler::CLOCK::now();
+
+        for (ssize_t i = 0; i < got && state != CLOSED; i++)
+        {
+            if (state == HELLO)
+            {
+                if (buf[i] != '\n')
+                {
+                    hello += (I8)buf[i];
+                    if (hello.size() > SERVER_HELLO_MAX) state = CLOSED;
+                }
+                else Hello(server);
+            }
+            else if (state == WAITING || state == PLAYING)
+                decoder.Feed(buf[i], push);
+        }
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Tick
+ *  @brief  Plays the turns due, unless the level waits for a key. An escape
+ *          byte that nothing followed in time is taken as the escape key first.
+ *  @param  server: The server of the session.
+ *  @param  due: The number of turns due.
+ */
+void Session::Tick(GameServer& server, UI32 due)
+{
+    if ((state == WAITING || state == PLAYING) && decoder.Waiting() &&
+        TickScheduler::CLOCK::now() - last_byte >= std::chrono::milliseconds(INPUT_ESC_DELAY_MS))
+        decoder.Expire([this](I32 key) { Key(key); });
+
+    for (; due > 0 && state == PLAYING; due--)
+        Turn(server);
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Present
+ *  @brief  Makes the next frame of the level, the cells that changed since the
+ *          last one, once the client has taken that one. Cells that do not fit
+ *          on the client's terminal are left out.
+ */
+void Session::Present(void)
+{
+    if ((state != WAITING && state != PLAYING) || Writing()) return;
+
+    if (engine.stage.DiamondsCount() == 0)
+        frame.Put(engine.stage.ParchPos().x, engine.stage.ParchPos().y, Gameplay::ParchCell());
+
+    frame.ClearSprites();
+    frame.PushSprite(engine.player.CurPos().x, engine.player.CurPos().y, Gameplay::HarryCell());
+    for (UI32 i = 0; i < engine.monsters.Count(); i++)
+        frame.PushSprite(engine.monsters.Pos(i).x, engine.monsters.Pos(i).y,
+                         Gameplay::MonsterCell(engine.monsters.Kind(i)));
+
+    frame.Flush([this](UI32 x, UI32 y, chtype cell)
+    {
+        if (map_x + (I32)x < cols && map_y + (I32)y < rows)
+            ansi.Put(map_y + y, map_x + x, cell);
+    });
+
+    if (engine.player.Score() != shown_score)
+        DrawScore(engine.player.Score());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Send
+ *  @brief  Sends the client as much of what it has not been sent yet as the
+ *          socket takes. A session that is over is closed once it is all sent.
+ */
+void Session::Send(void)
+{
+    std::string& out = ansi.Out();
+
+    while (sent < out.size())
+    {
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0)
+        {
+            state = CLOSED;
+            return;
+        }
+
+        sent += n;
+    }
+
+    out.clear();
+    sent = 0;
+
+    if (state == OVER) state = CLOSED;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Over
+ *  @brief  Ends the game: the level, if any, is dropped, the screen is cleared
+ *          and the session is closed once the message is sent.
+ *  @param  message: The last words to the client, if any.
+ */
+void Session::Over(const std::string& message)
+{
+    if (state == CLOSED) return;
+
+    engine.EndLevel();
+
+    ansi.Out() += "\x1b[0m\x1b[2J\x1b[H";
+    ansi.Out() += message;
+    state = OVER;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION Session::Saved
+ *  @brief  Ends the game once its score is entered on the high score table.
+ *  @param  error: Why the score could not be entered, if it could not.
+ */
+void Session::Saved(const std::string& error)
+{
+    if (state == SAVING) Over(last + error);
+}
+
+/* CLASS SESSION PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION Session::Hello
+ *  @brief  Reads the hello line and starts the game on the first map.
+ *  @param  server: The server of the session.
+ */
+void Session::Hello(GameServer& server)
+{
+    I32 name_at = 0;
+
+    if (sscanf(hello.c_str(), SERVER_HELLO " %d %d %n", &cols, &rows, &name_at) < 2 ||
+        name_at == 0 || cols <= 0 || rows <= 0)
+    {
+        state = CLOSED;
+        return;
+    }
+
+    for (size_t i = name_at; i < hello.size() && name.size() < NICKNAME_DEFAULT_LENGTH - 1; i++)
+        if (isprint((UI8)hello[i])) name += hello[i];
+    if (name.empty()) name = engine.player.Name();
+
+    engine.Seed(server.NewSeed());
+    engine.player.Name(name);
+    engine.player.Score(0);
+    level = 0;
+
+    StartLevel(server);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::Key
+ *  @brief  Takes a key of the client: it starts a level that waits for one,
+ *          or else waits for its turn.
+ *  @param  key: The keycode.
+ */
+void Session::Key(I32 key)
+{
+    if (state == WAITING)   state = PLAYING;
+    else                    keys.Add(key);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::StartLevel
+ *  @brief  Sets the level of the current map and draws it on a clear screen.
+ *          The level waits for a key to start.
+ *  @param  server: The server of the session.
+ */
+void Session::StartLevel(GameServer& server)
+{
+    try { server.InitLevel(engine, level); }
+    catch(GENEXP& exp)
+    {
+        Over(exp.message + "\r\n");
+        return;
+    }
+
+    const Stage& stage = engine.stage;
+    frame.Reset(stage.MapWidth(), stage.MapHeight());
+    for (UI32 i = 0; i < stage.MapHeight(); i++)
+        for (UI32 j = 0; j < stage.MapWidth(); j++)
+            frame.Put(j, i, Gameplay::MazeCell(stage.Tile(j, i)));
+
+    map_x = std::max(0, (cols - (I32)stage.MapWidth()) / 2);
+    ansi.Out() += "\x1b[0m\x1b[2J";
+    ansi.Forget();
+    DrawInfoBar();
+
+    paused = false;
+    state = WAITING;
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::Turn
+ *  @brief  Plays a turn with the next key of the client. A level won moves the
+ *          game to the next map, and the game ends with the last one won, a
+ *          level lost or the escape key.
+ *  @param  server: The server of the session.
+ */
+void Session::Turn(GameServer& server)
+{
+    I32 key = keys.Next();
+
+    if (key == KEY_PAUSE || key == 'P' || key == 'p')
+        Pause(!paused);
+
+    if (paused && key != KEY_ESCAPE)
+        return;
+
+    TURN_T outcome = engine.Step(key);
+
+    if (engine.player.CollisionState() == COLL_T::DMND)
+        frame.Put(engine.player.CurPos().x, engine.player.CurPos().y, ' ');
+
+    switch (outcome)
+    {
+        case TURN_T::WON:
+        engine.EndLevel();
+        if (++level < server.MapCount())
+            StartLevel(server);
+        else
+            GameOver(server, "You found the last parchment!");
+        break;
+
+        case TURN_T::LOST:
+        GameOver(server, "You were caught.");
+        break;
+
+        case TURN_T::ESCAPED:
+        Over("");
+        break;
+
+        default:
+        break;
+    }
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::Pause
+ *  @brief  Pauses or resumes the game, showing the pause message on the left
+ *          of the map while paused, as the terminal game does.
+ *  @param  on: True to pause the game or false to resume it.
+ */
+void Session::Pause(bool on)
+{
+    std::string message(PAUSE_MESSAGE);
+    I32 x = std::max(0, (cols - 1 - (I32)frame.Width()) / 2 - (I32)message.size() - 2);
+
+    if (!on) message.assign(message.size(), ' ');
+    ansi.Text(map_y + (rows - 3) / 2, x, message, 0);
+
+    paused = on;
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::DrawInfoBar
+ *  @brief  Draws the information bar, with the name of the player and the
+ *          score, across the top line of the terminal.
+ */
+void Session::DrawInfoBar(void)
+{
+    std::string bar = " " + name;
+    bar.resize(cols, ' ');
+
+    ansi.Text(0, 0, bar, COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
+    DrawScore(engine.player.Score());
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::DrawScore
+ *  @brief  Draws the score on the right of the information bar.
+ *  @param  score: The value to draw.
+ */
+void Session::DrawScore(UI32 score)
+{
+    I8 text[16];
+    snprintf(text, sizeof(text), "%-5u", score);
+
+    ansi.Text(0, std::max(0, cols - 5), std::string(text, std::min(cols, 5)), COLOR_PAIR(COLOR_PAIR_BLACK_YELLOW));
+    shown_score = score;
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION Session::GameOver
+ *  @brief  Ends a game the player lost or won. A score, if any, is handed to
+ *          the server to be entered on the high score table shared by every
+ *          game on the machine, and the game is over once it is entered.
+ *  @param  server: The server of the session.
+ *  @param  message: How the game ended.
+ */
+void Session::GameOver(GameServer& server, const std::string& message)
+{
+    UI32 score = engine.player.Score();
+    I8 text[64];
+    snprintf(text, sizeof(text), " Score: %u\r\n", score);
+
+    last = message + text;
+
+    if (score == 0)
+    {
+        Over(last);
+        return;
+    }
+
+    engine.EndLevel();
+    state = SAVING;
+    server.EnterScore(serial, name, score);
+}
+
+/* CLASS GAMESERVER PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION GameServer::~GameServer
+ *  @brief  Waits for the scores handed over to be entered, closes the sessions
+ *          and the socket, and removes the socket file, unless another server
+ *          has replaced it meanwhile.
+ */
+GameServer::~GameServer()
+{
+    struct stat st;
+    scores.Stop();
+    sessions.clear();
+
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (listen_fd < 0) return;
+
+    close(listen_fd);
+    if (lstat(path.c_str(), &st) == 0 && (UI64)st.st_ino == path_ino)
+        unlink(path.c_str());
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION GameServer::AddMap
+ *  @brief  Adds a map to the ones every game plays, in order. The map is
+ *          loaded once up front, both to validate it and to write its cache
+ *          file, which its maze is then restored from; if it could not be
+ *          written, the maze is parsed from the map instead.
+ *  @param  map_name: The map file.
+ */
+void GameServer::AddMap(const std::string& map_name)
+{
+    std::unique_ptr<SERVED_MAP> map(new SERVED_MAP);
+    if (!map->file.Open(map_name)) throw FILEEXP(map_name, "input");
+
+    Stage probe;
+    probe.Load(map_name);
+
+    Maze check;
+    map->cached = map->cache.Open(map_name, map->file.Data(), map->file.Size()) && map->cache.Restore(check);
+    check.Clear();
+
+    maps.push_back(std::move(map));
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION GameServer::Listen
+ *  @brief  Opens the socket the clients connect to. A socket file left over
+ *          from a server that did not end well is replaced; a server still
+ *          listening on it, or any other file, is not. The socket gets the
+ *          permissions the umask of the server leaves, so whoever may write
+ *          to it (and to the high score table through it) is up to whoever
+ *          starts the server.
+ *  @param  _path: The socket file.
+ */
+void GameServer::Listen(const std::string& _path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (_path.size() >= sizeof(addr.sun_path))
+        throw GENEXP("General error in GameServer::Listen:\nThe socket path is too long: " + _path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, _path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        throw GENEXP(std::string("General error in GameServer::Listen:\n") + strerror(errno));
+
+    if (lstat(_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        I32 probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+
+        if (live) throw GENEXP("General error in GameServer::Listen:\nA server is running on " + _path);
+        unlink(_path.c_str());
+    }
+
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        throw GENEXP("General error in GameServer::Listen:\nCould not bind " + _path + ": " + strerror(errno));
+
+    path = _path;
+    if (lstat(path.c_str(), &st) == 0) path_ino = st.st_ino;
+
+    if (listen(listen_fd, SOMAXCONN) != 0 || (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        throw GENEXP(std::string("General error in GameServer::Listen:\n") + strerror(errno));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+        throw GENEXP(std::string("General error in GameServer::Listen:\n") + strerror(errno));
+
+    scores.Start();
+    ev.data.ptr = &scores;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, scores.Fd(), &ev) != 0)
+        throw GENEXP(std::string("General error in GameServer::Listen:\n") + strerror(errno));
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION GameServer::Run
+ *  @brief  Serves the clients until stop is set. Every pass waits for the
+ *          sockets at most until the next tick, handles the clients that are
+ *          ready, plays the turns due in every session and sends the frames.
+ *          The sockets of the clients that do not take a frame in full are
+ *          watched for room until they do.
+ *  @param  stop: Set by a signal handler to stop the server.
+ */
+void GameServer::Run(volatile sig_atomic_t& stop)
+{
+    struct epoll_event events[SERVER_EVENTS];
+
+    ticks.Start();
+
+    while (!stop)
+    {
+        I32 ready = epoll_wait(epoll_fd, events, SERVER_EVENTS, ticks.Timeout());
+        if (ready < 0 && errno != EINTR)
+            throw GENEXP(std::string("General error in GameServer::Run:\n") + strerror(errno));
+
+        for (I32 i = 0; i < ready; i++)
+        {
+            Session* session = (Session*)events[i].data.ptr;
+
+            if (!session)                                       Accept();
+            else if (events[i].data.ptr == &scores)             Entered();
+            else if (session->Closed())                         continue;
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))  session->Close();
+            else
+            {
+                if (events[i].events & EPOLLIN)
+                {   // A level shows as soon as it is set, not with the next tick
+                    session->Receive(*this);
+                    session->Present();
+                }
+                if (!session->Closed() && session->Writing())
+                    session->Send();
+            }
+        }
+
+        UI32 due = ticks.Due();
+        for (UI32 i = 0; i < sessions.size(); i++)
+        {
+            Session& session = *sessions[i];
+
+            if (due > 0 && !session.Closed())
+            {
+                session.Tick(*this, due);
+                session.Present();
+            }
+            if (!session.Closed() && session.Writing())
+                session.Send();
+
+            Watch(session);
+        }
+
+        // Closed sessions go, the last one taking the place of each
+        for (UI32 i = 0; i < sessions.size(); )
+            if (sessions[i]->Closed())
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sessions[i]->Fd(), NULL);
+                std::swap(sessions[i], sessions.back());
+                sessions.pop_back();
+            }
+            else i++;
+    }
+
+    for (UI32 i = 0; i < sessions.size(); i++)
+    {
+        sessions[i]->Over("The server is shutting down.\r\n");
+        sessions[i]->Send();
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION GameServer::InitLevel
+ *  @brief  Sets a level of one of the maps on an engine. The maze of the map
+ *          is shared with the sessions already playing it, or built for them
+ *          when there are none.
+ *  @param  engine: The engine, with no level set.
+ *  @param  level: The number of the map.
+ */
+void GameServer::InitLevel(Engine& engine, UI32 level)
+{
+    SERVED_MAP& map = *maps[level];
+    std::shared_ptr<const Maze> maze = map.maze.lock();
+
+    if (!maze)
+    {
+        std::shared_ptr<Maze> built(new Maze);
+        if (!map.cached || !map.cache.Restore(*built))
+        {
+            built->Clear();
+            built->Build(map.file.Data(), map.file.Size());
+        }
+
+        map.maze = maze = built;
+    }
+
+    engine.InitLevel(maze);
+}
+
+/* CLASS GAMESERVER PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION GameServer::Accept
+ *  @brief  Takes every client waiting to connect, up to SERVER_MAX_SESSIONS
+ *          sessions at once; the ones past that are turned away.
+ */
+void GameServer::Accept(void)
+{
+    for (;;)
+    {
+        I32 fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) return;
+
+        if (sessions.size() >= SERVER_MAX_SESSIONS)
+        {
+            close(fd);
+            continue;
+        }
+
+        sessions.push_back(std::unique_ptr<Session>(new Session(fd, serials++, policy)));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = sessions.back().get();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            sessions.pop_back();
+    }
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION GameServer::Watch
+ *  @brief  Watches the socket of a session for room to write, only for as
+ *          long as the session has something left to send.
+ *  @param  session: The session.
+ */
+void GameServer::Watch(Session& session)
+{
+    bool writing = !session.Closed() && session.Writing();
+    if (session.Closed() || writing == session.PollingOut()) return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (writing ? (UI32)EPOLLOUT : 0);
+    ev.data.ptr = &session;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.Fd(), &ev) == 0)
+        session.PollingOut(writing);
+}
+
+/**
+ *  PRIVATE MEMBER FUNCTION GameServer::Entered
+ *  @brief  Ends the games whose scores have been entered on the high score
+ *          table, of the sessions that are still there. Their last words are
+ *          sent with the frames of the pass.
+ */
+void GameServer::Entered(void)
+{
+    std::vector<ScoreKeeper::ENTRY> entries;
+    scores.Entered(entries);
+
+    for (UI32 e = 0; e < entries.size(); e++)
+        for (UI32 i = 0; i < sessions.size(); i++)
+            if (sessions[i]->Serial() == entries[e].session)
+            {
+                sessions[i]->Saved(entries[e].error);
+                break;
+            }
+}
+
+volatile sig_atomic_t server_stop = 0;
+
+void stop_server(int)
+{
+    server_stop = 1;
+}
+
+/**
+ *  FUNCTION run_server
+ *  @brief  Hosts games of the given maps for the clients of a Unix domain
+ *          socket, until the server is interrupted or terminated.
+ *  @param  path: The socket file.
+ *  @param  maps: The map files every game plays, in order.
+ *  @return The exit status of the program.
+ */
+int run_server(const std::string& path, const std::vector<std::string>& maps)
+{
+    GameServer server(tick_ms, input_policy);
+
+    try
+    {
+        if (maps.empty())
+            throw GENEXP("No map to serve");
+
+        for (size_t i = 0; i < maps.size(); i++)
+            server.AddMap(maps[i]);
+
+        server.Listen(path);
+    }
+    catch(FILEEXP& exp)
+    {
+        fprintf(stderr, "Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
+        return 1;
+    }
+    catch(GENEXP& exp)
+    {
+        fprintf(stderr, "%s\n", exp.message.c_str());
+        return 1;
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = stop_server;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Serving %u maps on %s\n", server.MapCount(), path.c_str());
+
+    try { server.Run(server_stop); }
+    catch(GENEXP& exp)
+    {
+        fprintf(stderr, "%s\n", exp.message.c_str());
+        return 1;
+    }
+
+    fprintf(stderr, "%u games served\n", server.Games());
+    return 0;
+}
+
+/**
+ *  FUNCTION run_client
+ *  @brief  Plays on a game server: the terminal is put in raw mode, its size
+ *          and the name of the player are sent in the hello line, and then
+ *          the keys go to the server and the frames to the terminal, as they
+ *          come, until the server ends the game.
+ *  @param  path: The socket file of the server.
+ *  @param  name: The name of the player. Only its first visible characters,
+ *          as many as a nickname holds, are sent, so the hello line always
+ *          fits and ends with its new line character.
+ *  @return The exit status of the program.
+ */
+int run_client(const std::string& path, const std::string& name)
+{
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "The socket path is too long: %s\n", path.c_str());
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    I32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Could not connect to %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0 || ws.ws_row == 0)
+    {
+        ws.ws_col = 80;
+        ws.ws_row = 24;
+    }
+
+    std::string nick;
+    for (size_t i = 0; i < name.size() && nick.size() < NICKNAME_DEFAULT_LENGTH - 1; i++)
+        if (isgraph((UI8)name[i])) nick += name[i];
+
+    I8 hello[SERVER_HELLO_MAX + 1];
+    snprintf(hello, sizeof(hello), SERVER_HELLO " %u %u %s\n", ws.ws_col, ws.ws_row, nick.c_str());
+
+    struct termios saved, raw;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (tty)
+    {
+        raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    const char* start = "\x1b[?25l";
+    write(STDOUT_FILENO, start, strlen(start));
+
+    UI8 buf[4096];
+    bool open = send(fd, hello, strlen(hello), MSG_NOSIGNAL) == (ssize_t)strlen(hello);
+
+    while (open)
+    {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[0].revents)
+        {
+            ssize_t got = read(fd, buf, sizeof(buf));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+
+            for (ssize_t done = 0; done < got; )
+            {
+                ssize_t n = write(STDOUT_FILENO, buf + done, got - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+            }
+        }
+
+        if (fds[1].revents)
+        {
+            ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+            if (got < 0 && errno == EINTR) continue;
+            open = got > 0 && send(fd, buf, got, MSG_NOSIGNAL) == got;
+        }
+    }
+
+    const char* end = "\x1b[0m\x1b[?25h";
+    write(STDOUT_FILENO, end, strlen(end));
+
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    close(fd);
+
+    return 0;
+}
+
+/**
+ *  FUNCTION print_usage
+ *  @brief  Prints the command lines the game accepts, after a bad argument.
+ *  @param  program: The name the game was run as.
+ */
+static void print_usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--tick ms] [--input latest|ahead] [--render curses|ansi|null]\n"
+                    "          [--replay file [--fast]] map1 [map2 ...]\n"
+                    "       %s [--tick ms] [--input latest|ahead] --serve socket map1 [map2 ...]\n"
+                    "       %s --connect socket [--name nick]\n", program, program, program);
+}
+
+int main(int argc, char* argv[])
+{
+    I32 kstroke;
+    UI8 selection = 0;
+    UI32 games_played = 0;
+    std::vector<std::string> maps;
+    std::string replay_file;
+    bool replay_fast_mode = false;
+    std::string serve_path, connect_path;
+    const I8* user = getenv("USER");
+    std::string client_name = user ? user : "";
+
+    // See print_usage for the command lines
+    for (I32 i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_file = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            serve_path = argv[++i];
+        else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+            connect_path = argv[++i];
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+            client_name = argv[++i];
+        else if (strcmp(argv[i], "--tick") == 0 && i + 1 < argc)
+            tick_ms = std::max(1UL, strtoul(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "latest") == 0)     input_policy = INPUT_T::LATEST_WINS;
+            else if (strcmp(argv[i], "ahead") == 0) input_policy = INPUT_T::BUFFER_AHEAD;
+            else
+            {
+                fprintf(stderr, "Unknown input policy '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "curses") == 0)     gpl.Render(RENDER_T::CURSES_OUT);
+            else if (strcmp(argv[i], "ansi") == 0)  gpl.Render(RENDER_T::ANSI_OUT);
+            else if (strcmp(argv[i], "null") == 0)  gpl.Render(RENDER_T::NULL_OUT);
+            else
+            {
+                fprintf(stderr, "Unknown renderer '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fast") == 0)
+            replay_fast_mode = true;
+        else
+            maps.push_back(argv[i]);
+    }
+
+    if (!serve_path.empty())
+        return run_server(serve_path, maps);
+    if (!connect_path.empty())
+        return run_client(connect_path, client_name);
+
+    if (!replay_file.empty())
+    {
+        try { grec.Load(replay_file); }
+        catch(FILEEXP& exp)
+        {
+            fprintf(stderr, "Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
+            return 1;
+        }
+        catch(GENEXP& exp)
+        {
+            fprintf(stderr, "%s\n", exp.message.c_str());
+            return 1;
+        }
+
+        if (replay_fast_mode)
+        {
+            replay_fast(glen, grec);
+            return 0;
+        }
+    }
+
+    try
+    {
+        init_curses();
+        init_gameplay();
+
+        if (!replay_file.empty())
+        {   // Replays the recording at the normal pace and quits
+            replaying = true;
+            selection = SLC_QUIT;
+            gpl.InitInfoBar(glen.player.Name());
+            glen.Seed(grec.Seed());
+            glen.player.Score(0);
+
+            try { play_levels(grec.Maps()); }
+            catch(Potter::Lose& exp)
+            {
+                flash_capture();
+                kill_cur_level();
+            }
+            catch(Engine::Escape& exp)
+            {
+                kill_cur_level();
+            }
+        }
+
+        while(selection != SLC_QUIT)
+        {
+            gpl.ShowWin(stdscr);
+            wclear(gpl.Stage());
+            selection = 0;
+
+            do
+            {
+                gpl.DrawMenu(selection);
+
+                kstroke = gpl.GetPlayerInput();
+                if (kstroke == KEY_UP) selection > 0?selection--:selection = MENU_ITEMS_COUNT - 1;
+                if (kstroke == KEY_DOWN) selection < MENU_ITEMS_COUNT - 1?selection++:selection = 0;
+            } while (kstroke != KEY_ENTER && kstroke != KEY_RETURN);
+
+            wclear(gpl.Stage());
+            wrefresh(gpl.Stage());
+            flushinp();
+
+            switch(selection)
+            {
+                case 0:
+                try
+                {
+                    UI64 seed = (UI64)time(NULL) + ((UI64)games_played++ << 32);
+
+                    gpl.InitInfoBar(glen.player.Name());
+                    glen.Seed(seed);
+                    glen.player.Score(0);
+                    grec.Start(seed, maps);
+
+                    play_levels(maps);
+
+                    if (glen.player.Score() > 0)
+                        handle_player_score();
+                }
+                catch(Potter::Lose& exp)
+                {
+                    flash_capture();
+
+                    kill_cur_level();
+
+                    flushinp();
+
+                    if (glen.player.Score() > 0)
+                        handle_player_score();
+                }
+                catch(Engine::Escape& exp)
+                {
+                    kill_cur_level();
+                }
+                catch(FILEEXP& exp)
+                {
+                    printw("Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
+                    gpl.ShowWin(stdscr);
+                    getch();
+                    wclear(stdscr);
+                }
+
+                try { grec.Save(REPLAY_FILE); }
+                catch(FILEEXP& exp)
+                {
+                    printw("Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
+                    gpl.ShowWin(stdscr);
+                    getch();
+                    wclear(stdscr);
+                }
+
+                case 1:
+                wclear(gpl.Stage());
+
+                hsc.InitTable();
+
+                gpl.DrawHighScores(hsc.Top(LINES / 2));
+                wrefresh(gpl.Stage());
+
+                hsc.SaveTable();
+
+                flushinp();
+                gpl.WaitKey();
+                break;
+
+                case 2:     break;
+            }
+        }
+    }
+    catch(Gameplay::WINEXP& exp)
+    {
+        printw("An error occured while loading: %s", exp.message.c_str());
+        printw("Press any key to terminate every process\n");
+        getch();
+    }
+
+    kill_gameplay();
+    endwin();
+
+    return 0;
+}
+
+#else   // HEADLESS
+
+#ifndef SIMULATION_H_INCLUDED
+#define SIMULATION_H_INCLUDED
+
+/**
+ *  CLASS: ScriptedInput
+ *  @brief      ScriptedInput plays the part of the keyboard in the headless build.
+ *              A script is a text file holding one letter per turn: u, d, l or r
+ *              for a move and '.' for a turn with no key pressed. Every other
+ *              character is ignored. The script starts over when it runs out.
+ */
+class ScriptedInput
+{
+    public:
+    ScriptedInput() : cursor(0)
+    {}
+
+    void Load(std::ifstream&);
+    I32 NextKey(void);
+    void Rewind(void)       { cursor = 0; }
+    bool Empty(void) const  { return keys.empty(); }
+
+    private:
+    std::vector<I32> keys;
+    size_t cursor;
+};
+
+/**
+ *  CLASS: RandomInput
+ *  @brief      RandomInput is a player that keeps walking in one direction and
+ *              turns to a random one about every fourth turn. Each instance owns
+ *              its generator, so players on different threads never share
+ *              anything.
+ */
+class RandomInput
+{
+    public:
+    RandomInput(const Philox& _rng) : rng(_rng), key(KEY_UP)
+    {}
+
+    I32 NextKey(void);
+
+    private:
+    Philox rng;
+    I32 key;
+};
+
+/**
+ *  CLASS: BatchResults
+ *  @brief      BatchResults gathers the outcome of every game played on a single
+ *              map during a batch run. All of its counters are atomics, so the
+ *              worker threads add their results without taking any lock.
+ */
+class BatchResults
+{
+    public:
+    BatchResults(COORD w, COORD h) : games(0), wins(0), losses(0), turns(0),
+                                     width(w), height(h),
+                                     captures(new std::atomic<UI32>[(size_t)w * h]())
+    {}
+
+    void Add(const Engine&, TURN_T);
+    void Report(const std::string&) const;
+
+    private:
+    std::atomic<UI32> games;
+    std::atomic<UI32> wins;
+    std::atomic<UI32> losses;
+    std::atomic<UI64> turns;
+    COORD width, height;
+    std::unique_ptr<std::atomic<UI32>[]> captures;
+};
+
+#endif // SIMULATION_H_INCLUDED
+
+/**
+ *  PUBLIC MEMBER FUNCTION ScriptedInput::Load
+ *  @brief  Reads a movement script from the given input file stream.
+ *  @param  script: The input file stream.
+ */
+void ScriptedInput::Load(std::ifstream& script)
+{
+    if (!script)
+        throw GENEXP("General error in ScriptedInput::Load:\nCould not load script file");
+
+    I8 ch;
+    while (script.get(ch))
+    {
+        switch (ch)
+        {
+            case 'u':   keys.push_back(KEY_UP);     break;
+            case 'd':   keys.push_back(KEY_DOWN);   break;
+            case 'l':   keys.push_back(KEY_LEFT);   break;
+            case 'r':   keys.push_back(KEY_RIGHT);  break;
+            case '.':   keys.push_back(ERR);        break;
+        }
+    }
+
+    cursor = 0;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION ScriptedInput::NextKey
+ *  @brief  Returns the key for the next turn (ERR when no script is loaded).
+ */
+I32 ScriptedInput::NextKey(void)
+{
+    if (keys.empty()) return ERR;
+
+    I32 key = keys[cursor++];
+    if (cursor == keys.size()) cursor = 0;
+
+    return key;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION RandomInput::NextKey
+ *  @brief  Returns the key for the next turn.
+ */
+I32 RandomInput::NextKey(void)
+{
+    static const I32 directions[4] = { KEY_UP, KEY_RIGHT, KEY_DOWN, KEY_LEFT };
+
+    UI32 r = rng.Next();
+    if ((r & 0x3) == 0)
+        key = directions[(r >> 2) & 0x3];
+
+    return key;
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION BatchResults::Add
+ *  @brief  Records the outcome of a finished game.
+ *  @param  engine: The engine the game was played on.
+ *  @param  outcome: How the game ended.
+ */
+void BatchResults::Add(const Engine& engine, TURN_T outcome)
+{
+    games.fetch_add(1, std::memory_order_relaxed);
+    turns.fetch_add(engine.Turns(), std::memory_order_relaxed);
+
+    if (outcome == TURN_T::WON)
+        wins.fetch_add(1, std::memory_order_relaxed);
+    else if (outcome == TURN_T::LOST)
+    {
+        losses.fetch_add(1, std::memory_order_relaxed);
+
+        POS at = engine.player.CurPos();
+        if (at.x < width && at.y < height)
+            captures[(size_t)at.y * width + at.x].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ *  PUBLIC MEMBER FUNCTION BatchResults::Report
+ *  @brief  Prints the win rate, the mean turns survived and the cells where
+ *          Harry got caught most often.
+ *  @param  map_name: The name of the map the results belong to.
+ */
+void BatchResults::Report(const std::string& map_name) const
+{
+    UI32 n = games.load();
+    if (n == 0) return;
+
+    UI32 w = wins.load(), l = losses.load();
+    printf("%s: %u games, won %.1f%%, lost %.1f%%, abandoned %.1f%%, mean turns survived %.1f\n",
+           map_name.c_str(), n, 100.0 * w / n, 100.0 * l / n, 100.0 * (n - w - l) / n,
+           (double)turns.load() / n);
+
+    std::vector<std::pair<UI32, UI32> > hotspots;
+    for (UI32 i = 0; i < (UI32)width * height; i++)
+        if (captures[i].load())
+            hotspots.push_back(std::make_pair(captures[i].load(), i));
+
+    std::sort(hotspots.rbegin(), hotspots.rend());
+    for (size_t i = 0; i < hotspots.size() && i < SIM_CAPTURE_HOTSPOTS; i++)
+        printf("    caught at (%u,%u): %u times\n", hotspots[i].second % width,
+               hotspots[i].second / width, hotspots[i].first);
+}
+
+/**
+ *  FUNCTION run_batch
+ *  @brief  Plays the given number of independent games on a single map,
+ *          spread over a pool of worker threads. Every worker owns its engine
+ *          and its player; the only shared state are the atomic game counter
+ *          and the atomic results.
+ *  @param  map_name: The map file to play.
+ *  @param  games: The number of games to play.
+ *  @param  threads: The number of worker threads.
+ *  @param  script: The movement script to use, or an empty one for random players.
+ *  @param  max_turns: Games still going after that many turns are abandoned.
+ *  @param  seed: Game g is played with the streams split from seed as g, so
+ *                the results do not depend on the number of threads.
+ */
+void run_batch(const std::string& map_name, UI32 games, UI32 threads,
+               const ScriptedInput& script, UI32 max_turns, UI64 seed)
+{
+    MapFile map_file;
+    if (!map_file.Open(map_name)) throw FILEEXP(map_name, "input");
+
+    // The map is loaded once up front, both to validate it and to size the
+    // results. That also writes its cache file, which every game then loads
+    // from; if it could not be written, every game parses the map instead.
+    Stage probe;
+    probe.Load(map_name);
+
+    MapCache cache;
+    Maze check;
+    bool cached = cache.Open(map_name, map_file.Data(), map_file.Size()) && cache.Restore(check);
+    check.Clear();
+
+    BatchResults results(probe.MapWidth(), probe.MapHeight());
+    std::atomic<UI32> next_game(0);
+    std::vector<std::thread> pool;
+    const Philox base(seed);
+
+    for (UI32 t = 0; t < threads; t++)
+        pool.push_back(std::thread([&]()
+        {
+            Engine engine;
+            ScriptedInput scripted(script);
+
+            for (UI32 game; (game = next_game.fetch_add(1, std::memory_order_relaxed)) < games; )
+            {
+                Philox game_rng = base.Split(game);
+                RandomInput random(game_rng.Split(1));
+
+                engine.Seed(game_rng.Split(0));
+                if (cached) engine.InitLevel(cache);
+                else        engine.InitLevel(map_file.Data(), map_file.Size());
+                engine.player.Score(0);
+                scripted.Rewind();
+
+                TURN_T outcome = TURN_T::PLAYING;
+                while (outcome == TURN_T::PLAYING && engine.Turns() < max_turns)
+                    outcome = engine.Step(scripted.Empty() ? random.NextKey() : scripted.NextKey());
+
+                results.Add(engine, outcome);
+                engine.EndLevel();
+            }
+        }));
+
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+
+    results.Report(map_name);
 }
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::FlashToggleWin
- *  @brief  Given two window pointers, this function repeatedly toggles
- *          their visible state for as many times as specified by the
- *          third argument.
- *  @param  w1: The first window.
- *  @param  w2: The second window.
- *  @param  times: Maximun times to flash the windows.
+ *  FUNCTION generate_map
+ *  @brief  Makes a random maze, writes it as a map file and loads it back
+ *          into a stage to report on it, which also writes its cache file.
+ *  @param  map_name: The map file to write.
+ *  @param  size: The size of the maze, as WIDTHxHEIGHT.
+ *  @param  loops: The loop density, in percent.
+ *  @param  corridor: The width of the corridors.
+ *  @param  seed: The seed of the maze.
  */
-void Gameplay::FlashToggleWin(WINDOW* w1, WINDOW* w2, UI32 times)
+void generate_map(const std::string& map_name, const char* size, UI32 loops, UI32 corridor, UI64 seed)
 {
-    for (UI32 i = 0; i < times; i++)
-    {
-        ShowWin(w1);
-        napms(200);
-        ShowWin(w2);
-        napms(200);
-    }
+    char* end;
+    UI32 width = strtoul(size, &end, 10);
+    UI32 height = *end == 'x' ? strtoul(end + 1, &end, 10) : 0;
+
+    if (*end != '\0' || width == 0 || height == 0)
+        throw GENEXP(std::string("General error in generate_map:\nInvalid maze size ") + size);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    MazeGenerator generator(seed, loops, corridor);
+    generator.Write(width, height, map_name);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Stage stage;
+    stage.Load(map_name);
+
+    printf("%s: %ux%u, %u free cells, %u junctions, made in %.3f s\n", map_name.c_str(),
+           width, height, stage.Graph().FreeCells(), stage.Graph().NodeCount(), secs);
 }
 
+#ifndef BENCH
 
 /**
- *  PUBLIC MEMBER FUNCTION Gameplay::DiamondEaten
- *  @brief  Deletes a diamond (dot) from the screen at the specified coordinates.
- *  @param  coords: The coordinates of the diamond to be erased.
+ *  Headless simulation entry point.
+ *  Usage: thefinalquest-sim [-S seed] [-s script] [-t max_turns] [-b games [-j threads]] map1 [map2 ...]
+ *         thefinalquest-sim -r recording
+ *         thefinalquest-sim [-S seed] -g WIDTHxHEIGHT [-l loops] [-w corridor] map
+ *  The maps are played in order like in the interactive game, driven by the
+ *  script and without any delay between turns. A level that is still going
+ *  after max_turns turns is abandoned.
+ *  With -b, every map is instead played the given number of times on its own,
+ *  by random players unless a script is given, and a difficulty report is
+ *  printed for each one.
+ *  Runs with the same seed give the same results; the seed is printed so that
+ *  runs with a random one can be repeated.
+ *  With -r, a game recorded by the interactive build is played back instead.
+ *  With -g, a random maze of the given size is written to the map file
+ *  instead; loops is the percentage of extra walls opened to make loops
+ *  (0 by default) and corridor the width of the corridors (1 by default).
  */
-void Gameplay::DiamondEaten(POS coords)
+int main(int argc, char* argv[])
 {
-    mvwdelch(map_win, coords.y, coords.x);
-    mvwinsch(map_win, coords.y, coords.x, ' ');
-}
+    UI32 max_turns = 0;
+    UI32 batch_games = 0;
+    UI32 threads = std::thread::hardware_concurrency();
+    UI64 seed = (UI64)time(NULL);
+    ScriptedInput script;
+    Recording rec;
+    std::vector<std::string> maps;
+    const char* maze_size = NULL;
+    UI32 maze_loops = 0, maze_corridor = 1;
 
-#ifndef GAMEBASE_H_INCLUDED
-#define GAMEBASE_H_INCLUDED
+    try
+    {
+        for (I32 i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            {
+                Engine engine;
+                rec.Load(argv[++i]);
+                replay_fast(engine, rec);
+                return 0;
+            }
+            else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            {
+                std::ifstream scriptdata(argv[++i], std::ios::in);
+                script.Load(scriptdata);
+            }
+            else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+                max_turns = strtoul(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+                seed = strtoull(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+                batch_games = strtoul(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+                threads = strtoul(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+                maze_size = argv[++i];
+            else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+                maze_loops = strtoul(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+                maze_corridor = strtoul(argv[++i], NULL, 10);
+            else
+                maps.push_back(argv[i]);
+        }
 
-Gameplay gpl;   // Gameplay
-Engine glen;    // Global Engine
-HighScore hsc;  // High Scores Controller
+        if (maps.empty() || (maze_size && maps.size() != 1))
+        {
+            fprintf(stderr, "Usage: %s [-S seed] [-s script] [-t max_turns] [-b games [-j threads]] map1 [map2 ...]\n"
+                            "       %s -r recording\n"
+                            "       %s [-S seed] -g WIDTHxHEIGHT [-l loops] [-w corridor] map\n", argv[0], argv[0], argv[0]);
+            return 1;
+        }
 
-void init_curses(void)
-{
-    initscr();
-    curs_set(0);
+        if (threads == 0) threads = 1;
+        printf("seed %llu\n", (unsigned long long)seed);
 
-    if (has_colors())
+        if (maze_size)
+        {
+            generate_map(maps[0], maze_size, maze_loops, maze_corridor, seed);
+            return 0;
+        }
+
+        if (batch_games > 0)
+        {
+            for (size_t i = 0; i < maps.size(); i++)
+                run_batch(maps[i], batch_games, threads, script,
+                          max_turns ? max_turns : SIM_DEFAULT_MAX_BATCH_TURNS, seed);
+            return 0;
+        }
+
+        if (max_turns == 0) max_turns = SIM_DEFAULT_MAX_TURNS;
+
+        static const char* outcome_names[] = { "abandoned", "won", "lost", "escaped" };
+        Engine engine;
+        engine.Seed(seed);
+        UI64 total_turns = 0;
+        TURN_T outcome = TURN_T::WON;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < maps.size() && outcome == TURN_T::WON; i++)
+        {
+            engine.InitLevel(maps[i]);
+
+            outcome = TURN_T::PLAYING;
+            while (outcome == TURN_T::PLAYING && engine.Turns() < max_turns)
+                outcome = engine.Step(script.NextKey());
+
+            printf("%s: %s after %u turns, score %u\n", maps[i].c_str(),
+                   outcome_names[outcome], engine.Turns(), engine.player.Score());
+
+            total_turns += engine.Turns();
+            engine.EndLevel();
+        }
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%llu turns in %.3f s (%.0f turns/s)\n", (unsigned long long)total_turns,
+               secs, secs > 0 ? total_turns / secs : 0.0);
+    }
+    catch(GENEXP& exp)
     {
-        start_color();
-        init_pair(COLOR_PAIR_NORMAL, COLOR_WHITE, COLOR_BLACK);
-        init_pair(COLOR_PAIR_GREEN_BLACK, COLOR_GREEN, COLOR_BLACK);
-        init_pair(COLOR_PAIR_YELLOW_BLACK, COLOR_YELLOW, COLOR_BLACK);
-        init_pair(COLOR_PAIR_BLACK_RED, COLOR_BLACK, COLOR_RED);
-        init_pair(COLOR_PAIR_BLACK_BLUE, COLOR_BLACK, COLOR_BLUE);
-        init_pair(COLOR_PAIR_BLACK_YELLOW, COLOR_BLACK, COLOR_YELLOW);
+        fprintf(stderr, "%s\n", exp.message.c_str());
+        return 1;
+    }
+    catch(FILEEXP& exp)
+    {
+        fprintf(stderr, "Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
+        return 1;
     }
 
-    raw();
-    noecho();
-    nonl();
+    return 0;
 }
 
-void init_gameplay(void)
-{
-    gpl.InitStageWin();
-    gpl.InitPlayerWin();
-    gpl.InitGnomeWin();
-    gpl.InitTraalWin();
-    gpl.InitDebugWin();
-}
+#endif // BENCH
 
-void kill_gameplay()
-{
-    wclear(gpl.InfoBar());
-    wclear(gpl.Debug());
-    wclear(gpl.Player());
-    wclear(gpl.Gnome());
-    wclear(gpl.Traal());
+#ifdef BENCH
 
-    delwin(gpl.Score());
-    delwin(gpl.InfoBar());
-    delwin(gpl.Debug());
-    delwin(gpl.Map());
-    delwin(gpl.Stage());
-    delwin(gpl.Player());
-    delwin(gpl.Gnome());
-    delwin(gpl.Traal());
-}
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
 
-void load_next_level(std::ifstream& _mapdata)
+UI64 bench_allocs = 0;      // Allocations made so far
+volatile UI64 bench_sink;   // Keeps the results of the operations measured alive
+
+void* operator new(size_t size)
 {
-    glen.InitLevel(_mapdata);
-    gpl.InitLevel(glen.stage.Map());
+    bench_allocs++;
 
-    gpl.MoveWin(gpl.Player(), glen.player.CurPos());
-    gpl.MoveWin(gpl.Gnome(), glen.gnome.CurPos());
-    gpl.MoveWin(gpl.Traal(), glen.traal.CurPos());
+    void* block = malloc(size ? size : 1);
+    if (block == NULL) throw std::bad_alloc();
 
-    gpl.ShowWin(gpl.InfoBar());
-    gpl.ShowWin(gpl.Stage());
-    gpl.ShowWin(gpl.Player());
-    gpl.ShowWin(gpl.Gnome());
-    gpl.ShowWin(gpl.Traal());
+    return block;
 }
 
-void kill_cur_level(void)
+void operator delete(void* block) noexcept
 {
-    glen.EndLevel();
-    gpl.EndLevel();
-
-    wrefresh(gpl.Stage());
+    free(block);
 }
 
-void new_turn(void)
+/**
+ *  CLASS: Bench
+ *  @brief      Bench holds the microbenchmarks of the hot paths of the engine.
+ *              Every benchmark runs on mazes of a few sizes, made with fixed
+ *              seeds, so two runs of the same build measure the same work. An
+ *              operation is first repeated in batches twice as long each time
+ *              until a batch lasts BENCH_BATCH_MS; BENCH_RUNS such batches are
+ *              then timed and the median is reported, in ns per operation,
+ *              along with the allocations per operation.
+ */
+class Bench
 {
-    UI32 inp = gpl.GetPlayerInput();
+    public:
+    Bench(const char* _filter) : filter(_filter)
+    {}
 
-    if (inp == KEY_ESCAPE) throw Engine::Escape("User pressed escape key\n");
-    if (inp == KEY_PAUSE || inp == 'P' || inp == 'p')
-        gpl.Pause()?gpl.Pause(false):gpl.Pause(true);
+    void Run(void);
 
-    if (!gpl.Pause()) {
-        glen.NewMove(&glen.player, inp);
+    private:
+    const char* filter; // Only the benchmarks whose name holds it run
 
-        if (glen.CheckMapCollision(glen.player.CurPos()) == COLL_T::NONE)
-            glen.player.CollisionState(COLL_T::NONE);
-        if (glen.CheckMapCollision(glen.player.CurPos()) == COLL_T::DMND)
-            glen.player.CollisionState(COLL_T::DMND);
-        if (glen.CheckMapCollision(glen.player.CurPos()) == COLL_T::PARCH)
-            glen.player.CollisionState(COLL_T::PARCH);
-        if (glen.player.CurPos() == glen.gnome.CurPos() ||
-            glen.player.CurPos() == glen.traal.CurPos())
-            glen.player.CollisionState(COLL_T::MONSTER);
+    bool Wanted(const char* name) const { return strstr(name, filter) != NULL; }
+    template <typename OP> void Measure(const char*, UI32, OP);
+    template <typename OP> static UI64 Time(OP, UI64);
 
-        if (glen.player.CollisionState() != COLL_T::MONSTER)
-        {
-            glen.NewSmartMove(&glen.gnome);
-            glen.NewDummyMove(&glen.traal);
+    void LoadStage(UI32, const std::string&);
+    void MoveCreatures(UI32, const std::string&);
+    void PlaceDiamonds(UI32, const std::string&);
+    void RankScores(UI32);
+};
 
-            if (glen.player.CurPos() == glen.gnome.CurPos() ||
-                glen.player.CurPos() == glen.traal.CurPos())
-                glen.player.CollisionState(COLL_T::MONSTER);
-        }
+#endif // BENCH_H_INCLUDED
 
-        gpl.MoveWin(gpl.Player(), glen.player.CurPos());
-        gpl.MoveWin(gpl.Gnome(), glen.gnome.CurPos());
-        gpl.MoveWin(gpl.Traal(), glen.traal.CurPos());
+/* CLASS BENCH PRIVATE MEMBER DEFINITIONS */
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::Time
+ *  @brief  Returns the time it takes to repeat an operation, in ns.
+ *  @param  op: The operation.
+ *  @param  times: How many times to repeat it.
+ */
+template <typename OP>
+UI64 Bench::Time(OP op, UI64 times)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-        gpl.ShowWin(gpl.Map());
-        gpl.ShowWin(gpl.Player());
-        gpl.ShowWin(gpl.Gnome());
-        gpl.ShowWin(gpl.Traal());
-    }
-}
+    for (UI64 i = 0; i < times; i++)
+        op();
 
-void handle_score(void)
-{
-    if (glen.player.CollisionState() == COLL_T::DMND)
-        glen.player.AddToScore(10);
-    if (glen.player.CollisionState() == COLL_T::PARCH)
-        glen.player.AddToScore(100);
-    gpl.DrawScore(glen.player.Score());
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
-void play(void)
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::Measure
+ *  @brief  Measures an operation and prints a line for it.
+ *  @param  name: The name of the benchmark.
+ *  @param  size: The size of the maze, or of the table, it runs on.
+ *  @param  op: The operation.
+ */
+template <typename OP>
+void Bench::Measure(const char* name, UI32 size, OP op)
 {
-    while(1)
-    {
-        if (glen.stage.DiamondsCount() == 0)
-            gpl.DrawParch(glen.stage.ParchPos());
+    if (!Wanted(name)) return;
 
-        new_turn();
+    UI64 batch = 1;
+    while (Time(op, batch) < BENCH_BATCH_MS * 1000000ULL && batch < (1ULL << 30))
+        batch *= 2;
 
-        handle_score();
+    double ns[BENCH_RUNS];
+    UI64 allocs = bench_allocs;
 
-        flushinp();
+    for (UI32 i = 0; i < BENCH_RUNS; i++)
+        ns[i] = (double)Time(op, batch) / batch;
 
-        napms(250);
+    allocs = bench_allocs - allocs;
+    std::sort(ns, ns + BENCH_RUNS);
 
-        if (glen.player.CollisionState() == COLL_T::DMND)
-        {
-            glen.stage.EraseDiamond(glen.player.CurPos());
-            gpl.DiamondEaten(glen.player.CurPos());
-        }
-        if (glen.player.CollisionState() == COLL_T::MONSTER)
-            throw Potter::Lose(glen.player.CurPos());
-        if (glen.player.CollisionState() == COLL_T::PARCH)
-            throw Potter::Win(glen.player.CurPos());
-    }
+    printf("%-20s %6u %14.1f ns/op %10.2f allocs/op\n", name, size, ns[BENCH_RUNS / 2],
+           (double)allocs / (batch * BENCH_RUNS));
+    fflush(stdout);
 }
 
-void get_player_name(I8 name[])
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::LoadStage
+ *  @brief  Loads a maze from its text, and from a map file that has a cache.
+ *  @param  size: The width and height of the maze.
+ *  @param  text: The text of the maze.
+ */
+void Bench::LoadStage(UI32 size, const std::string& text)
 {
-    std::string name_prompt
-        = "Please enter a nick up to ten characters: ";
+    Stage stage;
 
-    echo();
-    nodelay(gpl.Stage(), FALSE);
+    Measure("stage_parse", size, [&]()
+    {
+        stage.Unload();
+        stage.Parse(text.data(), text.size());
+    });
 
-    mvwprintw(gpl.Stage(), (LINES - 4) / 2, (COLS - name_prompt.length() - (NICKNAME_DEFAULT_LENGTH - 1)) / 2, "%s", name_prompt.c_str());
-    wrefresh(gpl.Stage());
-    wgetnstr(gpl.Stage(), name, NICKNAME_DEFAULT_LENGTH - 1);
+    if (!Wanted("stage_load_cached")) return;
 
-    noecho();
-    nodelay(gpl.Stage(), TRUE);
+    char dir[] = "/tmp/tfqbenchXXXXXX";
+    if (mkdtemp(dir) == NULL) return;
 
-    wclear(gpl.Stage());
+    std::string map = std::string(dir) + "/map";
+    std::ofstream(map.c_str(), std::ios::out | std::ios::binary).write(text.data(), text.size());
+
+    stage.Unload();
+    stage.Load(map);    // Writes the cache
+    Measure("stage_load_cached", size, [&]()
+    {
+        stage.Unload();
+        stage.Load(map);
+    });
+
+    unlink(map.c_str());
+    unlink((map + MAPCACHE_SUFFIX).c_str());
+    rmdir(dir);
 }
 
-void handle_player_score(void)
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::MoveCreatures
+ *  @brief  Checks random cells for collisions, looks up the moves open from
+ *          them, 64 cells at a time, one by one and in a batch, and moves a
+ *          gnome and a traal. The gnome chases Harry, put on a random free
+ *          cell before every move, so the flow field is rebuilt every time, as
+ *          it is every turn Harry moves.
+ *  @param  size: The width and height of the maze.
+ *  @param  text: The text of the maze.
+ */
+void Bench::MoveCreatures(UI32 size, const std::string& text)
 {
-    I8 player_name[NICKNAME_DEFAULT_LENGTH];
+    Engine engine;
+    engine.Seed((UI64)size);
+    engine.InitLevel(text.data(), text.size());
 
-    get_player_name(player_name);
-    if (strcmp(player_name, "") != 0)
-        glen.player.Name(player_name);
+    Philox rng((UI64)size);
+    std::vector<POS> cells, free_cells;
+    while (free_cells.size() < BENCH_CELLS)
+    {
+        POS at(rng.Below(size), rng.Below(size));
 
-    hsc.InitTable();
-    hsc.PlayerName(glen.player.Name());
-    hsc << glen.player.Score();
-}
-
-#endif // GAMEBASE_H_INCLUDED
+        if (cells.size() < BENCH_CELLS) cells.push_back(at);
+        if (engine.CheckMapCollision(at) != COLL_T::WALL) free_cells.push_back(at);
+    }
 
+    UI32 i = 0;
+    Measure("check_collision", size, [&]()
+    {
+        bench_sink = engine.CheckMapCollision(cells[i++ % BENCH_CELLS]);
+    });
 
-int main(int argc, char* argv[])
-{
-    I32 kstroke;
-    UI8 selection = 0;
-    std::ifstream mapdata;
+    const MapBits& bits = engine.stage.Bits();
+    std::vector<UI8> masks(BENCH_CELLS);
+    bits.MoveMasks(&cells[0], BENCH_CELLS, &masks[0]);
+    for (UI32 j = 0; j < BENCH_CELLS; j++)
+        if (masks[j] != bits.MoveMask(cells[j].x, cells[j].y))
+            throw GENEXP("General error in Bench::MoveCreatures:\nMapBits::MoveMasks disagrees with MapBits::MoveMask");
 
-    try
+    Measure("move_mask", size, [&]()
     {
-        init_curses();
-        init_gameplay();
-
-        while(selection != SLC_QUIT)
-        {
-            gpl.ShowWin(stdscr);
-            wclear(gpl.Stage());
-            selection = 0;
+        UI32 first = (i++ % (BENCH_CELLS / 64)) * 64;
+        for (UI32 j = first; j < first + 64; j++)
+            masks[j] = bits.MoveMask(cells[j].x, cells[j].y);
+        bench_sink = masks[first];
+    });
 
-            do
-            {
-                gpl.DrawMenu(selection);
+    Measure("move_masks", size, [&]()
+    {
+        UI32 first = (i++ % (BENCH_CELLS / 64)) * 64;
+        bits.MoveMasks(&cells[first], 64, &masks[first]);
+        bench_sink = masks[first];
+    });
 
-                kstroke = gpl.GetPlayerInput();
-                if (kstroke == KEY_UP) selection > 0?selection--:selection = MENU_ITEMS_COUNT - 1;
-                if (kstroke == KEY_DOWN) selection < MENU_ITEMS_COUNT - 1?selection++:selection = 0;
-            } while (kstroke != KEY_ENTER && kstroke != KEY_RETURN);
+    // Monster 0 is the gnome and monster 1 the traal of a map with no spawns
+    Measure("new_smart_move", size, [&]()
+    {
+        engine.player.SetPos(free_cells[i++ % BENCH_CELLS]);
+        engine.NewSmartMove(0, bits.MoveMask(engine.monsters.Pos(0).x, engine.monsters.Pos(0).y));
+    });
 
-            wclear(gpl.Stage());
-            wrefresh(gpl.Stage());
-            flushinp();
+    Measure("new_dummy_move", size, [&]()
+    {
+        engine.NewDummyMove(1, bits.MoveMask(engine.monsters.Pos(1).x, engine.monsters.Pos(1).y));
+    });
+}
 
-            switch(selection)
-            {
-                case 0:
-                try
-                {
-                    gpl.InitInfoBar(glen.player.Name());
-                    glen.player.Score(0);
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::PlaceDiamonds
+ *  @brief  Places diamonds on free cells, the way a stage is populated, and
+ *          erases each one again, so the stage never runs out of free cells.
+ *  @param  size: The width and height of the maze.
+ *  @param  text: The text of the maze.
+ */
+void Bench::PlaceDiamonds(UI32 size, const std::string& text)
+{
+    Stage stage;
+    stage.Parse(text.data(), text.size());
 
-                    for (UI8 i = 1; i < argc; i++)
-                    {
-                        try
-                        {
-                            mapdata.open(argv[i], std::ios::in);
-                            load_next_level(mapdata);
-                            mapdata.close();
-
-                            wgetch(gpl.Player());
-
-                            try{ play(); }
-                            catch (Potter::Win& exp)
-                            {
-                                gpl.FlashToggleWin(gpl.Map(), gpl.Player(), 5);
-                            }
-
-                            kill_cur_level();
-                            flushinp();
-                        }
-                        catch(GENEXP& exp)
-                        {
-                            printw("%s", exp.message.c_str());
-                            gpl.ShowWin(stdscr);
-                            glen.stage.Unload();
-                            mapdata.close();
-                            getch();
-                            wclear(stdscr);
-                        }
-                    }
-                    flushinp();
+    Measure("place_diamond", size, [&]()
+    {
+        POS at = stage.TakeCell(stage.rng);
 
-                    if (glen.player.Score() > 0)
-                        handle_player_score();
-                }
-                catch(Potter::Lose& exp)
-                {
-                    if (glen.player.CurPos() == glen.gnome.CurPos())
-                        gpl.FlashToggleWin(gpl.Player(), gpl.Gnome(), 5);
-                    else gpl.FlashToggleWin(gpl.Player(), gpl.Traal(), 5);
+        stage.Diamond(at.x, at.y, true);
+        stage.EraseDiamond(at);
+    });
+}
 
-                    kill_cur_level();
+/**
+ *  PRIVATE MEMBER FUNCTION Bench::RankScores
+ *  @brief  Adds the scores of players to a high score table, finds their
+ *          ranks and reads the top of the table, as the game shows it.
+ *  @param  size: The number of players on the table.
+ */
+void Bench::RankScores(UI32 size)
+{
+    HighScore table;
+    Philox rng((UI64)size);
+    std::vector<std::string> names(size);
 
-                    flushinp();
+    for (UI32 i = 0; i < size; i++)
+    {
+        char name[16];  // "p" and up to five digits, as the table only takes ten characters
+        snprintf(name, sizeof(name), "p%u", i);
+        names[i] = name;
 
-                    if (glen.player.Score() > 0)
-                        handle_player_score();
-                }
-                catch(Engine::Escape& exp)
-                {
-                    kill_cur_level();
-                }
-                catch(FILEEXP& exp)
-                {
-                    printw("Could not load file '%s' for '%s'\n", exp.filename.c_str(), exp.open_purpose.c_str());
-                    gpl.ShowWin(stdscr);
-                    getch();
-                    wclear(stdscr);
-                }
+        table.PlayerName(names[i]);
+        table << rng.Below(10000);
+    }
 
-                case 1:
-                wclear(gpl.Stage());
+    Measure("hiscore_add", size, [&]()
+    {
+        table.PlayerName(names[rng.Below(size)]);
+        table << rng.Below(10000);
+    });
 
-                hsc.InitTable();
-                hsc.SortTable();
+    Measure("hiscore_rank", size, [&]()
+    {
+        bench_sink = table.Rank(names[rng.Below(size)]);
+    });
 
-                gpl.DrawHighScores(hsc.ScoreTable());
-                wrefresh(gpl.Stage());
+    Measure("hiscore_top", size, [&]()
+    {
+        bench_sink = table.Top(BENCH_TOP_SCORES).size();
+    });
+}
 
-                hsc.SaveTable();
-                hsc.EmptyTable();
+/* CLASS BENCH PUBLIC MEMBER DEFINITIONS */
+/**
+ *  PUBLIC MEMBER FUNCTION Bench::Run
+ *  @brief  Runs the benchmarks.
+ */
+void Bench::Run(void)
+{
+    static const UI32 sizes[] = { 31, 127, 511, 2047 };
 
-                flushinp();
-                wgetch(gpl.Player());
-                break;
+    for (UI32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        std::string text;
+        MazeGenerator((UI64)sizes[s], BENCH_MAZE_LOOPS).Generate(sizes[s], sizes[s], text);
 
-                case 2:     break;
-            }
-        }
+        LoadStage(sizes[s], text);
+        MoveCreatures(sizes[s], text);
+        PlaceDiamonds(sizes[s], text);
     }
-    catch(Gameplay::WINEXP& exp)
+
+    for (UI32 size = 10; size <= 10000; size *= 10)
+        RankScores(size);
+}
+
+/**
+ *  Benchmark entry point.
+ *  Usage: thefinalquest-bench [name]
+ *  Runs every benchmark, or only those whose name holds the given text.
+ */
+int main(int argc, char* argv[])
+{
+    try { Bench(argc > 1 ? argv[1] : "").Run(); }
+    catch(GENEXP& exp)
     {
-        printw("An error occured while loading: %s", exp.message.c_str());
-        printw("Press any key to terminate every process\n");
-        getch();
+        fprintf(stderr, "%s\n", exp.message.c_str());
+        return 1;
     }
 
-    kill_gameplay();
-    endwin();
-
-    return 0;
-}
+    return 0;
+}
+
+#endif // BENCH
+
+#endif // HEADLESS